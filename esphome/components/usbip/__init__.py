@@ -1,9 +1,18 @@
 import esphome.codegen as cg
 import esphome.config_validation as cv
+from esphome.components import sensor, text_sensor
 
-from esphome.const import CONF_PORT, CONF_ID
+from esphome.const import (
+    CONF_PORT,
+    CONF_ID,
+    CONF_UPDATE_INTERVAL,
+    ENTITY_CATEGORY_DIAGNOSTIC,
+    STATE_CLASS_MEASUREMENT,
+    STATE_CLASS_TOTAL_INCREASING,
+)
 
 DEPENDENCIES = ["usb_host"]
+AUTO_LOAD = ["sensor", "text_sensor"]
 
 usbip_ns = cg.esphome_ns.namespace('usbip')
 USBIPComponent = usbip_ns.class_('USBIPComponent', cg.Component)
@@ -12,15 +21,124 @@ USBIPComponent = usbip_ns.class_('USBIPComponent', cg.Component)
 usb_host_ns = cg.esphome_ns.namespace('usb_host')
 USBHost = usb_host_ns.class_('USBHost', cg.Component)
 USBClient = usb_host_ns.class_('USBClient', cg.Component)
+ClientOptions = usbip_ns.struct('USBIPComponent::ClientOptions')
+TxPolicy = usbip_ns.enum('TxPolicy', is_class=True)
+TX_POLICIES = {
+    'default': TxPolicy.DEFAULT,
+    'latency': TxPolicy.LATENCY,
+    'throughput': TxPolicy.THROUGHPUT,
+}
 
 CONF_USB_HOST = 'usb_host'
+CONF_MAX_CONNECTIONS = 'max_connections'
+CONF_MAX_CONFIG_DESCRIPTOR_SIZE = 'max_config_descriptor_size'
+CONF_STRING_CACHE_SIZE = 'string_cache_size'
+CONF_PREFETCH_CONCURRENCY = 'prefetch_concurrency'
+CONF_PERSIST_DESCRIPTORS = 'persist_descriptors'
+CONF_DEVLIST_EXTENSIONS = 'devlist_extensions'
+CONF_LOOP_BUDGET = 'loop_budget'
+CONF_METRICS = 'metrics'
+CONF_SUMMARY = 'summary'
+CONF_CAPTURE = 'capture'
+CONF_CLIENTS = 'clients'
+CONF_CLIENT = 'client'
+CONF_BULK_IN_DEPTH = 'bulk_in_depth'
+CONF_RECORDS = 'records'
+CONF_TX_POLICY = 'tx_policy'
+CONF_COALESCE_WINDOW = 'coalesce_window'
+CONF_COALESCE_BYTES = 'coalesce_bytes'
+CONF_SOCKET_BUFFER_SIZE = 'socket_buffer_size'
+CONF_NETWORK_TASK = 'network_task'
+CONF_CORE = 'core'
+CONF_PRIORITY = 'priority'
+
+
+def _metric(unit, accuracy=0, state_class=STATE_CLASS_MEASUREMENT, icon='mdi:chart-line'):
+    return sensor.sensor_schema(
+        unit_of_measurement=unit,
+        accuracy_decimals=accuracy,
+        state_class=state_class,
+        entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+        icon=icon,
+    )
+
+
+# Optional diagnostic sensors, published every update_interval. Latencies
+# and loop_time are averages over the interval, loop_time_max its maximum.
+METRIC_SENSORS = {
+    'loop_time': _metric('µs', icon='mdi:timer-outline'),
+    'loop_time_max': _metric('µs', icon='mdi:timer-alert-outline'),
+    'rx_rate': _metric('B/s', icon='mdi:download-network'),
+    'tx_rate': _metric('B/s', icon='mdi:upload-network'),
+    'send_eagain': _metric('', state_class=STATE_CLASS_TOTAL_INCREASING, icon='mdi:pause-octagon'),
+    'short_writes': _metric('', state_class=STATE_CLASS_TOTAL_INCREASING, icon='mdi:content-cut'),
+    'connections': _metric('', icon='mdi:lan-connect'),
+    'transfers_in_flight': _metric('', icon='mdi:transit-transfer'),
+    'descriptor_fetch_latency': _metric('ms', icon='mdi:timer-sand'),
+    'urb_latency': _metric('µs', icon='mdi:timer-sand'),
+    'interrupt_latency': _metric('µs', icon='mdi:timer-sand'),
+    # Most transfer buffer bytes in use at once since boot
+    'buffer_pool_high_water': _metric('B', icon='mdi:memory'),
+}
+
+METRICS_SCHEMA = cv.Schema({
+    cv.Optional(CONF_UPDATE_INTERVAL, default='60s'): cv.positive_time_period_milliseconds,
+    cv.Optional(CONF_SUMMARY): text_sensor.text_sensor_schema(
+        entity_category=ENTITY_CATEGORY_DIAGNOSTIC, icon='mdi:chart-box-outline'),
+    **{cv.Optional(key): schema for key, schema in METRIC_SENSORS.items()},
+})
 
 CONFIG_SCHEMA = cv.Schema({
     cv.GenerateID(): cv.declare_id(USBIPComponent),
     cv.Optional(CONF_PORT, default=3240): cv.port,
     cv.Optional('string_wait_ms', default=2000): cv.Any(cv.positive_time_period_milliseconds, cv.positive_int),
+    # Every connection uses one lwIP socket (CONFIG_LWIP_MAX_SOCKETS)
+    cv.Optional(CONF_MAX_CONNECTIONS, default=4): cv.int_range(min=1, max=8),
+    # Descriptor cache reserved per exported client at setup (bytes)
+    cv.Optional(CONF_MAX_CONFIG_DESCRIPTOR_SIZE, default=1024): cv.int_range(min=9, max=65535),
+    cv.Optional(CONF_STRING_CACHE_SIZE, default=512): cv.int_range(min=0, max=65535),
+    # Descriptor requests the background prefetcher keeps outstanding; the
+    # rest of the host stack's request slots stay free for URB traffic
+    cv.Optional(CONF_PREFETCH_CONCURRENCY, default=2): cv.int_range(min=1, max=8),
+    # Save each device's descriptors to flash and serve them right after a
+    # reboot, revalidated against the device in the background
+    cv.Optional(CONF_PERSIST_DESCRIPTORS, default=True): cv.boolean,
+    # Append descriptors and strings to every device list entry for clients
+    # that read them; stock usbip clients misparse such a list
+    cv.Optional(CONF_DEVLIST_EXTENSIONS, default=False): cv.boolean,
+    # Time one loop() may spend on USB/IP work; network and USB I/O run
+    # first, background descriptor work gets what is left
+    cv.Optional(CONF_LOOP_BUDGET, default='2ms'): cv.positive_time_period_microseconds,
+    cv.Optional(CONF_METRICS): METRICS_SCHEMA,
+    # Socket I/O in its own task instead of the main loop; core -1 lets the
+    # scheduler pick one
+    cv.Optional(CONF_NETWORK_TASK): cv.Schema({
+        cv.Optional(CONF_CORE, default=1): cv.int_range(min=-1, max=1),
+        cv.Optional(CONF_PRIORITY, default=5): cv.int_range(min=1, max=24),
+    }),
+    # Ring of the last PDUs (112 bytes each), served as a pcap file to
+    # whoever connects to the capture port
+    cv.Optional(CONF_CAPTURE): cv.Schema({
+        cv.Optional(CONF_RECORDS, default=64): cv.int_range(min=1, max=4096),
+        cv.Optional(CONF_PORT, default=3241): cv.port,
+    }),
     cv.Optional(CONF_USB_HOST): cv.use_id(USBHost),
-    cv.Optional('clients'): cv.ensure_list(cv.use_id(USBClient)),
+    # Either a client id or a mapping with per-client settings
+    cv.Optional(CONF_CLIENTS): cv.ensure_list(cv.maybe_simple_value(cv.Schema({
+        cv.Required(CONF_CLIENT): cv.use_id(USBClient),
+        # Bulk IN transfers kept queued per endpoint ahead of the client's
+        # requests; 0 issues one transfer per request
+        cv.Optional(CONF_BULK_IN_DEPTH, default=0): cv.int_range(min=0, max=8),
+        # latency: TCP_NODELAY, every reply written at once (HID);
+        # throughput: replies coalesced into fewer writes (mass storage)
+        cv.Optional(CONF_TX_POLICY, default='default'): cv.enum(TX_POLICIES, lower=True),
+        # throughput only: how long / up to how many bytes replies are held,
+        # and SO_SNDBUF/SO_RCVBUF (0 keeps the TCP stack's default)
+        cv.Optional(CONF_COALESCE_WINDOW, default='1ms'): cv.All(
+            cv.positive_time_period_microseconds, cv.Range(max=cv.TimePeriod(milliseconds=20))),
+        cv.Optional(CONF_COALESCE_BYTES, default=16384): cv.int_range(min=512, max=65536),
+        cv.Optional(CONF_SOCKET_BUFFER_SIZE, default=0): cv.int_range(min=0, max=262144),
+    }), key=CONF_CLIENT)),
 }).extend(cv.COMPONENT_SCHEMA)
 
 
@@ -36,8 +154,40 @@ async def to_code(config):
         # can create a proper adapter.
         cg.add(var.set_esphome_host(host))
 
-    for c in config.get('clients') or ():
-        client = await cg.get_variable(c)
-        cg.add(var.add_exported_client(client))
+    for c in config.get(CONF_CLIENTS) or ():
+        client = await cg.get_variable(c[CONF_CLIENT])
+        options = cg.StructInitializer(
+            ClientOptions,
+            ('bulk_in_depth', c[CONF_BULK_IN_DEPTH]),
+            ('tx_policy', c[CONF_TX_POLICY]),
+            ('coalesce_us', c[CONF_COALESCE_WINDOW].total_microseconds),
+            ('coalesce_bytes', c[CONF_COALESCE_BYTES]),
+            ('socket_buffer_size', c[CONF_SOCKET_BUFFER_SIZE]),
+        )
+        cg.add(var.add_exported_client(client, options))
     if 'string_wait_ms' in config:
         cg.add(var.set_string_wait_ms(config['string_wait_ms']))
+    cg.add(var.set_max_connections(config[CONF_MAX_CONNECTIONS]))
+    cg.add(var.set_loop_budget_us(config[CONF_LOOP_BUDGET].total_microseconds))
+    cg.add(var.set_prefetch_concurrency(config[CONF_PREFETCH_CONCURRENCY]))
+    cg.add(var.set_persist_descriptors(config[CONF_PERSIST_DESCRIPTORS]))
+    cg.add(var.set_devlist_extensions(config[CONF_DEVLIST_EXTENSIONS]))
+    cg.add(var.set_descriptor_cache_size(config[CONF_MAX_CONFIG_DESCRIPTOR_SIZE], config[CONF_STRING_CACHE_SIZE]))
+
+    if CONF_NETWORK_TASK in config:
+        task = config[CONF_NETWORK_TASK]
+        cg.add(var.set_network_task(task[CONF_CORE], task[CONF_PRIORITY]))
+
+    if CONF_CAPTURE in config:
+        cg.add(var.set_capture(config[CONF_CAPTURE][CONF_RECORDS], config[CONF_CAPTURE][CONF_PORT]))
+
+    if CONF_METRICS in config:
+        metrics = config[CONF_METRICS]
+        cg.add(var.set_metrics_update_interval(metrics[CONF_UPDATE_INTERVAL]))
+        for key in METRIC_SENSORS:
+            if key in metrics:
+                sens = await sensor.new_sensor(metrics[key])
+                cg.add(getattr(var, f'set_{key}_sensor')(sens))
+        if CONF_SUMMARY in metrics:
+            sens = await text_sensor.new_text_sensor(metrics[CONF_SUMMARY])
+            cg.add(var.set_metrics_summary_text_sensor(sens))
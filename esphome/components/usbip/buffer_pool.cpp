@@ -0,0 +1,104 @@
+#include "buffer_pool.h"
+#include <algorithm>
+
+namespace esphome {
+namespace usbip {
+
+void BufferPool::add_size(size_t size) {
+  if (size == 0) return;
+  size = (size + GRANULE - 1) / GRANULE * GRANULE;
+  size_t pos = 0;
+  while (pos < this->num_classes_ && this->classes_[pos].size < size) pos++;
+  if (pos < this->num_classes_ && this->classes_[pos].size <= size + size / 4) return;
+  if (this->num_classes_ < MAX_CLASSES) {
+    this->insert_class(size, 0);
+    return;
+  }
+  if (size != this->candidate_size_) {
+    this->candidate_size_ = size;
+    this->candidate_uses_ = 0;
+  }
+  this->count_use(this->candidate_uses_);
+  size_t victim = 0;
+  for (size_t i = 1; i < this->num_classes_; ++i) {
+    if (this->classes_[i].uses < this->classes_[victim].uses) victim = i;
+  }
+  if (this->candidate_uses_ <= this->classes_[victim].uses) return;
+  // Buffers of the evicted class still handed out are freed when given back
+  for (size_t i = victim; i + 1 < this->num_classes_; ++i) this->classes_[i] = std::move(this->classes_[i + 1]);
+  this->num_classes_--;
+  this->classes_[this->num_classes_].free.clear();
+  this->classes_[this->num_classes_].free.shrink_to_fit();
+  this->insert_class(size, this->candidate_uses_);
+  this->candidate_size_ = 0;
+  this->candidate_uses_ = 0;
+}
+
+void BufferPool::insert_class(size_t size, uint32_t uses) {
+  size_t pos = 0;
+  while (pos < this->num_classes_ && this->classes_[pos].size < size) pos++;
+  // Keep the classes sorted; moving a class moves its free list along
+  for (size_t i = this->num_classes_; i > pos; --i) this->classes_[i] = std::move(this->classes_[i - 1]);
+  SizeClass &c = this->classes_[pos];
+  c.size = size;
+  c.keep = std::min(MAX_KEEP, std::max(MIN_KEEP, BYTES_PER_CLASS / size));
+  c.uses = uses;
+  c.free.clear();
+  c.free.reserve(c.keep);
+  this->num_classes_++;
+}
+
+void BufferPool::count_use(uint32_t &uses) {
+  if (++uses < DECAY_USES) return;
+  for (size_t i = 0; i < this->num_classes_; ++i) this->classes_[i].uses /= 2;
+  this->candidate_uses_ /= 2;
+}
+
+std::vector<uint8_t> BufferPool::take(size_t len) {
+  std::vector<uint8_t> buf;
+  size_t i = 0;
+  while (i < this->num_classes_ && this->classes_[i].size < len) i++;
+  if (i < this->num_classes_) this->count_use(this->classes_[i].uses);
+  if (i < this->num_classes_ && !this->classes_[i].free.empty()) {
+    buf = std::move(this->classes_[i].free.back());
+    this->classes_[i].free.pop_back();
+    this->hits_++;
+  } else {
+    buf.reserve(i < this->num_classes_ ? this->classes_[i].size : len);
+    this->misses_++;
+  }
+  buf.resize(len);
+  this->in_use_bytes_ += buf.capacity();
+  this->high_water_bytes_ = std::max(this->high_water_bytes_, this->in_use_bytes_);
+  return buf;
+}
+
+void BufferPool::give(std::vector<uint8_t> &&buf) {
+  this->forget(buf);
+  size_t cap = buf.capacity();
+  for (size_t i = 0; i < this->num_classes_; ++i) {
+    SizeClass &c = this->classes_[i];
+    if (c.size != cap) continue;
+    if (c.free.size() < c.keep) {
+      buf.clear();
+      c.free.push_back(std::move(buf));
+      return;
+    }
+    break;
+  }
+  // Of no (longer existing) class, or the class has enough spares
+  std::vector<uint8_t>().swap(buf);
+}
+
+void BufferPool::forget(const std::vector<uint8_t> &buf) {
+  this->in_use_bytes_ -= std::min(this->in_use_bytes_, buf.capacity());
+}
+
+size_t BufferPool::free_bytes() const {
+  size_t n = 0;
+  for (size_t i = 0; i < this->num_classes_; ++i) n += this->classes_[i].size * this->classes_[i].free.size();
+  return n;
+}
+
+}  // namespace usbip
+}  // namespace esphome
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace esphome {
+namespace usbip {
+
+// Recycles transfer buffers (reply payloads, streamed IN data, control
+// request buffers) so steady URB traffic stops allocating. Buffers come in
+// a few size classes, derived at run time from what the exported devices
+// use: their endpoints' wMaxPacketSize and the lengths of the URBs clients
+// submit. take() hands out a buffer of the smallest class that fits and
+// give() puts it back on that class's free list, up to a per-class limit;
+// anything beyond is freed. Once all classes exist, a size asked for more
+// often than the least used class replaces it, so sizes seen early (a
+// few control or interrupt transfers) cannot keep the bulk sizes out.
+// Not thread-safe: main loop only.
+class BufferPool {
+ public:
+  static const size_t MAX_CLASSES = 6;
+  // Smallest class and class granularity (bytes)
+  static const size_t GRANULE = 64;
+  // Free buffers kept per class: as many as fit in this many bytes, at
+  // least MIN_KEEP and at most MAX_KEEP
+  static const size_t BYTES_PER_CLASS = 16384;
+  static const size_t MIN_KEEP = 2;
+  static const size_t MAX_KEEP = 16;
+  // Use counts are halved when one reaches this, so they follow the
+  // current traffic
+  static const uint32_t DECAY_USES = 1024;
+
+  // Make sure buffers of 'size' bytes have a class of their own, unless
+  // an existing class is at most 25% larger. With all classes in use, the
+  // call counts as a use of 'size', which takes the place of the least used
+  // class (and its free buffers are freed) once it has more uses.
+  void add_size(size_t size);
+
+  // A buffer of 'len' bytes (contents unspecified). Its capacity is the
+  // class size, or exactly 'len' if no class is large enough.
+  std::vector<uint8_t> take(size_t len);
+  // Return a buffer obtained from take(); it may be empty
+  void give(std::vector<uint8_t> &&buf);
+  // A buffer obtained from take() is freed elsewhere (e.g. by the network
+  // task); stop counting it as in use
+  void forget(const std::vector<uint8_t> &buf);
+
+  size_t num_classes() const { return this->num_classes_; }
+  size_t class_size(size_t i) const { return this->classes_[i].size; }
+  // Bytes handed out and not returned yet, and the most there ever were
+  size_t in_use_bytes() const { return this->in_use_bytes_; }
+  size_t high_water_bytes() const { return this->high_water_bytes_; }
+  // Bytes held in free lists
+  size_t free_bytes() const;
+  // take() calls served from a free list / that had to allocate
+  uint32_t hits() const { return this->hits_; }
+  uint32_t misses() const { return this->misses_; }
+
+ protected:
+  struct SizeClass {
+    size_t size{0};
+    size_t keep{0};
+    // take() calls served by this class (see DECAY_USES)
+    uint32_t uses{0};
+    std::vector<std::vector<uint8_t>> free{};
+  };
+
+  void insert_class(size_t size, uint32_t uses);
+  // Count a use in 'uses' (a class's or candidate_uses_)
+  void count_use(uint32_t &uses);
+
+  SizeClass classes_[MAX_CLASSES]{};
+  size_t num_classes_{0};
+  // Size without a class waiting for a free one, and its uses
+  size_t candidate_size_{0};
+  uint32_t candidate_uses_{0};
+  size_t in_use_bytes_{0};
+  size_t high_water_bytes_{0};
+  uint32_t hits_{0};
+  uint32_t misses_{0};
+};
+
+}  // namespace usbip
+}  // namespace esphome
@@ -0,0 +1,143 @@
+#include "capture.h"
+#include "usbip_protocol.h"
+#include <cstring>
+
+namespace esphome {
+namespace usbip {
+
+// Synthesized framing of every exported PDU: Ethernet, IPv4 and TCP headers
+static const size_t FRAME_HEADER_SIZE = 14 + 20 + 20;
+static const uint32_t LINKTYPE_ETHERNET = 1;
+// 10.0.0.1 is the server, 10.0.0.2 the client; the client port tells the
+// connections apart
+static const uint8_t SERVER_ADDR[4] = {10, 0, 0, 1};
+static const uint8_t CLIENT_ADDR[4] = {10, 0, 0, 2};
+static const uint8_t SERVER_MAC[6] = {0x02, 0, 0, 0, 0, 0x01};
+static const uint8_t CLIENT_MAC[6] = {0x02, 0, 0, 0, 0, 0x02};
+
+static void put_le16(uint8_t *p, uint16_t v) {
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+}
+static void put_le32(uint8_t *p, uint32_t v) {
+  put_le16(p, (uint16_t)v);
+  put_le16(p + 2, (uint16_t)(v >> 16));
+}
+
+void CaptureRing::configure(size_t records) {
+  this->records_.reset(records ? new Record[records] : nullptr);
+  this->capacity_ = records;
+  this->clear();
+}
+
+void CaptureRing::clear() {
+  this->head_ = 0;
+  this->count_ = 0;
+}
+
+void CaptureRing::record(uint32_t now_us, uint16_t stream, Direction dir, const uint8_t *a, size_t a_len,
+                         const uint8_t *b, size_t b_len) {
+  if (this->capacity_ == 0) return;
+  if (now_us < this->last_us_) this->wraps_++;
+  this->last_us_ = now_us;
+
+  Record &r = this->records_[this->head_];
+  r.ts_us = ((uint64_t)this->wraps_ << 32) | now_us;
+  r.orig_len = (uint32_t)(a_len + b_len);
+  r.stream = stream;
+  r.dir = dir;
+  size_t n = a_len < SNAPLEN ? a_len : SNAPLEN;
+  memcpy(r.data, a, n);
+  if (b != nullptr && n < SNAPLEN) {
+    size_t m = b_len < SNAPLEN - n ? b_len : SNAPLEN - n;
+    memcpy(r.data + n, b, m);
+    n += m;
+  }
+  r.cap_len = (uint8_t)n;
+
+  this->head_ = this->head_ + 1 == this->capacity_ ? 0 : this->head_ + 1;
+  if (this->count_ < this->capacity_) this->count_++;
+  this->total_++;
+}
+
+void CaptureRing::export_pcap(std::vector<uint8_t> &out, uint16_t server_port) const {
+  size_t pos = out.size();
+  out.resize(pos + 24 + this->count_ * (16 + FRAME_HEADER_SIZE + SNAPLEN));
+  uint8_t *p = out.data() + pos;
+
+  // pcap global header (little endian, microsecond timestamps)
+  put_le32(p, 0xa1b2c3d4);
+  put_le16(p + 4, 2);
+  put_le16(p + 6, 4);
+  put_le32(p + 8, 0);
+  put_le32(p + 12, 0);
+  put_le32(p + 16, 0xFFFF);
+  put_le32(p + 20, LINKTYPE_ETHERNET);
+  p += 24;
+
+  // Next sequence number of each direction of every stream seen so far
+  struct StreamSeq {
+    uint16_t stream;
+    uint32_t seq[2];
+  };
+  std::vector<StreamSeq> seqs;
+
+  size_t start = (this->head_ + this->capacity_ - this->count_) % (this->capacity_ ? this->capacity_ : 1);
+  for (size_t i = 0; i < this->count_; ++i) {
+    const Record &r = this->records_[(start + i) % this->capacity_];
+    StreamSeq *s = nullptr;
+    for (auto &e : seqs) {
+      if (e.stream == r.stream) s = &e;
+    }
+    if (s == nullptr) {
+      seqs.push_back(StreamSeq{r.stream, {1, 1}});
+      s = &seqs.back();
+    }
+    bool rx = r.dir == Direction::RX;
+    uint16_t client_port = (uint16_t)(49152 + r.stream % 16384);
+
+    // pcap record header
+    put_le32(p, (uint32_t)(r.ts_us / 1000000));
+    put_le32(p + 4, (uint32_t)(r.ts_us % 1000000));
+    put_le32(p + 8, (uint32_t)(FRAME_HEADER_SIZE + r.cap_len));
+    put_le32(p + 12, (uint32_t)(FRAME_HEADER_SIZE + r.orig_len));
+    p += 16;
+
+    // Ethernet
+    memcpy(p, rx ? SERVER_MAC : CLIENT_MAC, 6);
+    memcpy(p + 6, rx ? CLIENT_MAC : SERVER_MAC, 6);
+    put_be16(p + 12, 0x0800);
+    p += 14;
+
+    // IPv4 (checksum left zero; Wireshark does not verify it by default)
+    uint32_t ip_len = 40 + r.orig_len;
+    memset(p, 0, 20);
+    p[0] = 0x45;
+    put_be16(p + 2, (uint16_t)(ip_len > 0xFFFF ? 0xFFFF : ip_len));
+    put_be16(p + 6, 0x4000);  // don't fragment
+    p[8] = 64;
+    p[9] = 6;  // TCP
+    memcpy(p + 12, rx ? CLIENT_ADDR : SERVER_ADDR, 4);
+    memcpy(p + 16, rx ? SERVER_ADDR : CLIENT_ADDR, 4);
+    p += 20;
+
+    // TCP
+    memset(p, 0, 20);
+    put_be16(p, rx ? client_port : server_port);
+    put_be16(p + 2, rx ? server_port : client_port);
+    put_be32(p + 4, s->seq[rx ? 0 : 1]);
+    put_be32(p + 8, s->seq[rx ? 1 : 0]);
+    p[12] = 0x50;  // 20 byte header
+    p[13] = 0x18;  // PSH, ACK
+    put_be16(p + 14, 0xFFFF);
+    p += 20;
+    s->seq[rx ? 0 : 1] += r.orig_len;
+
+    memcpy(p, r.data, r.cap_len);
+    p += r.cap_len;
+  }
+  out.resize(p - out.data());
+}
+
+}  // namespace usbip
+}  // namespace esphome
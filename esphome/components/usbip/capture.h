@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace esphome {
+namespace usbip {
+
+// Fixed-size ring of the most recent USB/IP PDUs, for debugging a device
+// after the fact. record() only stores a timestamp, the lengths and the
+// first SNAPLEN bytes of the PDU (the 48 byte URB header and the start of
+// the payload); nothing is formatted and nothing is allocated, so capturing
+// can stay enabled in production. export_pcap() turns the ring into a
+// classic pcap file in which every PDU is a TCP segment of a synthesized
+// client <-> server stream, so Wireshark's USB/IP dissector decodes it.
+class CaptureRing {
+ public:
+  // Bytes of each PDU kept
+  static const size_t SNAPLEN = 112;
+
+  enum class Direction : uint8_t {
+    RX,  // client -> server
+    TX,  // server -> client
+  };
+
+  // Allocate room for 'records' PDUs (0 disables capturing)
+  void configure(size_t records);
+  bool enabled() const { return this->capacity_ != 0; }
+  size_t capacity() const { return this->capacity_; }
+  // PDUs currently held
+  size_t size() const { return this->count_; }
+  // PDUs recorded since boot (older ones were overwritten)
+  uint32_t total() const { return this->total_; }
+  size_t memory_usage() const { return this->capacity_ * sizeof(Record); }
+  void clear();
+
+  // Store one PDU made of up to two pieces (header and payload). 'stream'
+  // identifies the connection (e.g. its epoch), 'now_us' is the microsecond
+  // clock, which may wrap.
+  void record(uint32_t now_us, uint16_t stream, Direction dir, const uint8_t *a, size_t a_len,
+              const uint8_t *b = nullptr, size_t b_len = 0);
+
+  // Append the ring, oldest PDU first, to 'out' as a pcap file. The server
+  // side of the synthesized TCP streams uses 'server_port'.
+  void export_pcap(std::vector<uint8_t> &out, uint16_t server_port) const;
+
+ protected:
+  struct Record {
+    uint64_t ts_us;
+    uint32_t orig_len;
+    uint16_t stream;
+    uint8_t cap_len;
+    Direction dir;
+    uint8_t data[SNAPLEN];
+  };
+
+  std::unique_ptr<Record[]> records_{};
+  size_t capacity_{0};
+  // Next record to write and number of valid records
+  size_t head_{0};
+  size_t count_{0};
+  uint32_t total_{0};
+  // Extends the 32 bit microsecond clock to 64 bits
+  uint32_t last_us_{0};
+  uint32_t wraps_{0};
+};
+
+}  // namespace usbip
+}  // namespace esphome
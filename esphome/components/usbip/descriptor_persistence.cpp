@@ -0,0 +1,96 @@
+#include "descriptor_persistence.h"
+#include "esphome/core/log.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#ifdef ESP_PLATFORM
+#include "esphome/core/helpers.h"
+#include "esphome/core/preferences.h"
+#endif
+
+namespace esphome {
+namespace usbip {
+
+static const char *const PERSIST_TAG = "usbip.persist";
+
+uint32_t DescriptorPersistence::digest(const std::vector<uint8_t> &record) {
+  uint32_t h = 2166136261u;
+  for (uint8_t b : record) {
+    h ^= b;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+#ifdef ESP_PLATFORM
+// Preferences store fixed-size objects
+struct PersistedRecord {
+  uint16_t len;
+  uint8_t data[DescriptorPersistence::MAX_RECORD];
+};
+
+static ESPPreferenceObject record_preference(size_t position) {
+  char key[24];
+  snprintf(key, sizeof(key), "usbip_desc_1-%u", (unsigned)(position + 1));
+  return global_preferences->make_preference<PersistedRecord>(fnv1_hash(key), true);
+}
+
+bool DescriptorPersistence::load(size_t position, std::vector<uint8_t> &out) {
+  // Too large for the loop task's stack
+  std::unique_ptr<PersistedRecord> rec(new PersistedRecord());
+  ESPPreferenceObject pref = record_preference(position);
+  if (!pref.load(rec.get()) || rec->len == 0 || rec->len > MAX_RECORD) return false;
+  out.assign(rec->data, rec->data + rec->len);
+  return true;
+}
+
+bool DescriptorPersistence::save(size_t position, const std::vector<uint8_t> &record) {
+  if (record.size() > MAX_RECORD) return false;
+  std::unique_ptr<PersistedRecord> rec(new PersistedRecord());
+  rec->len = (uint16_t)record.size();
+  memcpy(rec->data, record.data(), record.size());
+  ESPPreferenceObject pref = record_preference(position);
+  // Written to flash on the next preferences sync (at the latest before an
+  // OTA reboot)
+  return pref.save(rec.get());
+}
+#else
+std::string DescriptorPersistence::path(size_t position) const {
+  return this->directory_ + "/usbip-descriptors-1-" + std::to_string(position + 1) + ".bin";
+}
+
+bool DescriptorPersistence::load(size_t position, std::vector<uint8_t> &out) {
+  FILE *f = fopen(this->path(position).c_str(), "rb");
+  if (f == nullptr) return false;
+  out.resize(MAX_RECORD + 1);
+  size_t n = fread(out.data(), 1, out.size(), f);
+  fclose(f);
+  out.resize(n);
+  return n > 0 && n <= MAX_RECORD;
+}
+
+bool DescriptorPersistence::save(size_t position, const std::vector<uint8_t> &record) {
+  if (record.size() > MAX_RECORD) return false;
+  // Write a temporary file and rename it, so a crash never leaves half a
+  // record behind
+  std::string path = this->path(position);
+  std::string tmp = path + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "wb");
+  if (f == nullptr) {
+    ESP_LOGW(PERSIST_TAG, "Cannot open %s: %d", tmp.c_str(), errno);
+    return false;
+  }
+  bool ok = fwrite(record.data(), 1, record.size(), f) == record.size();
+  ok = fclose(f) == 0 && ok;
+  if (ok) ok = rename(tmp.c_str(), path.c_str()) == 0;
+  if (!ok) {
+    ESP_LOGW(PERSIST_TAG, "Failed to write %s", path.c_str());
+    remove(tmp.c_str());
+  }
+  return ok;
+}
+#endif
+
+}  // namespace usbip
+}  // namespace esphome
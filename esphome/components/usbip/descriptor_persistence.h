@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace esphome {
+namespace usbip {
+
+// Keeps one descriptor cache record (see DescriptorStore::serialize()) per
+// bus position across reboots: in NVS through ESPHome's preferences on ESP,
+// in one file per position on the native build. Records are opaque here;
+// whoever loads one validates it against the device before trusting it.
+class DescriptorPersistence {
+ public:
+  // Largest record kept; a preference slot is always this size
+  static const size_t MAX_RECORD = 1024;
+
+#ifndef ESP_PLATFORM
+  // Directory holding the cache files
+  void set_directory(const std::string &dir) { this->directory_ = dir; }
+#endif
+
+  // Read the record of bus position 'position' (busid 1-<position + 1>)
+  // into 'out'; false if there is none
+  bool load(size_t position, std::vector<uint8_t> &out);
+  // Replace the record of 'position'; false if it is too large or could
+  // not be written
+  bool save(size_t position, const std::vector<uint8_t> &record);
+
+  // FNV-1a of a record, to tell whether it changed since it was saved
+  static uint32_t digest(const std::vector<uint8_t> &record);
+
+ protected:
+#ifndef ESP_PLATFORM
+  std::string path(size_t position) const;
+  std::string directory_{"."};
+#endif
+};
+
+}  // namespace usbip
+}  // namespace esphome
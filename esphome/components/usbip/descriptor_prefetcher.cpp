@@ -0,0 +1,159 @@
+#include "descriptor_prefetcher.h"
+
+namespace esphome {
+namespace usbip {
+
+static const char *const PREFETCH_TAG = "usbip.prefetch";
+
+void DescriptorPrefetcher::begin(USBHostAdapter *host, void *const *clients, size_t count) {
+  this->host_ = host;
+  this->clients_ = clients;
+  this->count_ = host ? count : 0;
+  this->plans_.reset(this->count_ ? new Plan[this->count_]() : nullptr);
+  this->queued_ = 0;
+  this->in_flight_ = 0;
+  for (size_t slot = 0; slot < this->count_; ++slot) this->add(this->plans_[slot], Kind::DEVICE);
+}
+
+void DescriptorPrefetcher::restart(size_t slot) {
+  if (slot >= this->count_) return;
+  this->cancel(slot);
+  this->add(this->plans_[slot], Kind::DEVICE);
+}
+
+void DescriptorPrefetcher::cancel(size_t slot) {
+  if (slot >= this->count_) return;
+  Plan &plan = this->plans_[slot];
+  for (size_t i = 0; i < plan.count; ++i) {
+    if (plan.items[i].state == State::QUEUED) this->queued_--;
+    if (plan.items[i].state == State::IN_FLIGHT) this->in_flight_--;
+  }
+  plan.count = 0;
+  plan.config_strings_added = false;
+}
+
+void DescriptorPrefetcher::add(Plan &plan, Kind kind, uint8_t index) {
+  for (size_t i = 0; i < plan.count; ++i) {
+    if (plan.items[i].kind == kind && plan.items[i].index == index) return;
+  }
+  if (plan.count >= MAX_ITEMS) return;
+  plan.items[plan.count++] = Item{kind, State::QUEUED, index, 0, 0};
+  this->queued_++;
+}
+
+bool DescriptorPrefetcher::ready(size_t slot, const Item &item) const {
+  void *client = this->clients_[slot];
+  switch (item.kind) {
+    case Kind::DEVICE: {
+      DescriptorView d = this->host_->device_descriptor(client);
+      return d.ready && d.size() >= 18;
+    }
+    case Kind::CONFIG:
+      return this->host_->config_descriptor(client).ready;
+    case Kind::STRING:
+    default:
+      return this->host_->string_descriptor(client, item.index).ready;
+  }
+}
+
+void DescriptorPrefetcher::request(size_t slot, Item &item, uint32_t now) {
+  void *client = this->clients_[slot];
+  switch (item.kind) {
+    case Kind::DEVICE:
+      this->host_->request_device_descriptor(client);
+      break;
+    case Kind::CONFIG:
+      this->host_->request_config_descriptor(client);
+      break;
+    case Kind::STRING:
+      this->host_->request_string_descriptor(client, item.index);
+      break;
+  }
+  item.state = State::IN_FLIGHT;
+  item.attempts++;
+  item.requested_ms = now;
+  this->queued_--;
+  this->in_flight_++;
+}
+
+void DescriptorPrefetcher::add_config_strings(Plan &plan, const DescriptorView &cfg) {
+  if (cfg.size() >= 9 && cfg[6] != 0) this->add(plan, Kind::STRING, cfg[6]);  // iConfiguration
+  size_t off = 0;
+  while (off + 2 <= cfg.size()) {
+    uint8_t len = cfg[off];
+    if (len < 2 || off + len > cfg.size()) break;
+    if (cfg[off + 1] == 0x04 && len >= 9 && cfg[off + 8] != 0) this->add(plan, Kind::STRING, cfg[off + 8]);  // iInterface
+    off += len;
+  }
+  plan.config_strings_added = true;
+}
+
+bool DescriptorPrefetcher::langids_settled(const Plan &plan) const {
+  for (size_t i = 0; i < plan.count; ++i) {
+    const Item &item = plan.items[i];
+    if (item.kind == Kind::STRING && item.index == 0) return item.state == State::DONE || item.state == State::FAILED;
+  }
+  return false;
+}
+
+void DescriptorPrefetcher::run(uint32_t now) {
+  if (this->idle()) return;
+
+  // Retire finished requests and queue what they revealed
+  for (size_t slot = 0; slot < this->count_; ++slot) {
+    Plan &plan = this->plans_[slot];
+    for (size_t i = 0; i < plan.count; ++i) {
+      Item &item = plan.items[i];
+      if (item.state == State::IN_FLIGHT) {
+        if (!this->ready(slot, item)) {
+          uint32_t timeout = item.kind == Kind::DEVICE ? DEVICE_RETRY_MS : REQUEST_TIMEOUT_MS;
+          if (now - item.requested_ms < timeout) continue;
+          this->in_flight_--;
+          // The device may simply not be attached yet; keep asking for it
+          if (item.kind == Kind::DEVICE || item.attempts < MAX_ATTEMPTS) {
+            item.state = State::QUEUED;
+            this->queued_++;
+          } else {
+            item.state = State::FAILED;
+            ESP_LOGD(PREFETCH_TAG, "Client %u: giving up on descriptor (kind %u, index %u)", (unsigned)slot,
+                     (unsigned)item.kind, (unsigned)item.index);
+          }
+          continue;
+        }
+        item.state = State::DONE;
+        this->in_flight_--;
+        this->fetch_latency_ms_.record(now - item.requested_ms);
+      } else if (item.state == State::QUEUED && this->ready(slot, item)) {
+        // Already cached (or fetched on someone else's request)
+        item.state = State::DONE;
+        this->queued_--;
+      } else {
+        continue;
+      }
+      if (item.kind == Kind::DEVICE) {
+        DescriptorView d = this->host_->device_descriptor(this->clients_[slot]);
+        this->add(plan, Kind::STRING, 0);  // LANGID table
+        if (d[14]) this->add(plan, Kind::STRING, d[14]);  // iManufacturer
+        if (d[15]) this->add(plan, Kind::STRING, d[15]);  // iProduct
+        this->add(plan, Kind::CONFIG);
+        if (d[16]) this->add(plan, Kind::STRING, d[16]);  // iSerialNumber
+      } else if (item.kind == Kind::CONFIG && !plan.config_strings_added) {
+        this->add_config_strings(plan, this->host_->config_descriptor(this->clients_[slot]));
+      }
+    }
+  }
+
+  // Issue queued requests, highest priority first across all clients
+  for (size_t rank = 0; rank < MAX_ITEMS && this->queued_ > 0; ++rank) {
+    for (size_t slot = 0; slot < this->count_; ++slot) {
+      if (this->in_flight_ >= this->max_in_flight_) return;
+      Plan &plan = this->plans_[slot];
+      if (rank >= plan.count || plan.items[rank].state != State::QUEUED) continue;
+      if (plan.items[rank].kind == Kind::STRING && plan.items[rank].index != 0 && !this->langids_settled(plan)) continue;
+      this->request(slot, plan.items[rank], now);
+    }
+  }
+}
+
+}  // namespace usbip
+}  // namespace esphome
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "usb_host.h"
+#include "metrics.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace esphome {
+namespace usbip {
+
+// Background enumerator that warms the host adapter's descriptor cache so
+// an OP_REQ_DEVLIST can be answered straight away. For every exported client
+// it walks, in priority order:
+//
+//   device descriptor, LANGID table (string 0), iManufacturer, iProduct,
+//   configuration descriptor, iSerialNumber, then the iConfiguration and
+//   iInterface strings named by the configuration descriptor.
+//
+// Strings other than the LANGID table wait until it was read (or given up
+// on), since the adapter asks for them in the device's first LANGID.
+//
+// At most max_in_flight requests are outstanding across all clients, leaving
+// the host stack's request slots to URB traffic. The adapter's request_*()
+// calls are fire-and-forget, so a request counts as finished when its view
+// becomes ready, and is retried when it did not within REQUEST_TIMEOUT_MS.
+class DescriptorPrefetcher {
+ public:
+  // Largest number of descriptors tracked per client
+  static const size_t MAX_ITEMS = 16;
+  static const uint32_t REQUEST_TIMEOUT_MS = 500;
+  static const uint8_t MAX_ATTEMPTS = 3;
+  // The device descriptor is retried at this interval until the device
+  // shows up
+  static const uint32_t DEVICE_RETRY_MS = 1000;
+
+  void set_max_in_flight(uint8_t n) { this->max_in_flight_ = n ? n : 1; }
+
+  // Allocate the per-client plans and queue every client's device
+  // descriptor. 'clients' must stay valid while the prefetcher is used.
+  void begin(USBHostAdapter *host, void *const *clients, size_t count);
+  // The device in 'slot' (re)enumerated: plan all of its descriptors
+  void restart(size_t slot);
+  // The device in 'slot' was unplugged: stop fetching for it until the
+  // next restart()
+  void cancel(size_t slot);
+  // Check outstanding requests and issue new ones; cheap when idle
+  void run(uint32_t now);
+
+  // Nothing queued or outstanding
+  bool idle() const { return this->queued_ == 0 && this->in_flight_ == 0; }
+  size_t in_flight() const { return this->in_flight_; }
+  // Request to cached time (ms) of every descriptor this prefetcher asked for
+  const Histogram &fetch_latency_ms() const { return this->fetch_latency_ms_; }
+  Histogram &fetch_latency_ms() { return this->fetch_latency_ms_; }
+
+ protected:
+  enum class Kind : uint8_t { DEVICE, CONFIG, STRING };
+  enum class State : uint8_t { QUEUED, IN_FLIGHT, DONE, FAILED };
+  struct Item {
+    Kind kind;
+    State state;
+    uint8_t index;  // string index
+    uint8_t attempts;
+    uint32_t requested_ms;
+  };
+  struct Plan {
+    Item items[MAX_ITEMS];
+    uint8_t count;
+    // Strings named by the configuration descriptor were queued
+    bool config_strings_added;
+  };
+
+  void add(Plan &plan, Kind kind, uint8_t index = 0);
+  bool ready(size_t slot, const Item &item) const;
+  void request(size_t slot, Item &item, uint32_t now);
+  void add_config_strings(Plan &plan, const DescriptorView &cfg);
+  // The LANGID table request has finished, one way or the other
+  bool langids_settled(const Plan &plan) const;
+
+  USBHostAdapter *host_{nullptr};
+  void *const *clients_{nullptr};
+  std::unique_ptr<Plan[]> plans_{};
+  size_t count_{0};
+  uint8_t max_in_flight_{2};
+  size_t queued_{0};
+  size_t in_flight_{0};
+  Histogram fetch_latency_ms_{};
+};
+
+}  // namespace usbip
+}  // namespace esphome
@@ -0,0 +1,209 @@
+#include "descriptor_store.h"
+#include <cstring>
+
+namespace esphome {
+namespace usbip {
+
+void DescriptorStore::configure(size_t slots, size_t config_capacity, size_t string_capacity) {
+  // Offsets into the string area are 16 bit
+  if (string_capacity > 0xFFFF) string_capacity = 0xFFFF;
+  if (config_capacity > 0xFFFF) config_capacity = 0xFFFF;
+  this->slot_count_ = slots;
+  this->config_capacity_ = config_capacity;
+  this->string_capacity_ = string_capacity;
+  const size_t per_slot = DEVICE_SIZE + config_capacity + string_capacity;
+  this->arena_.reset(slots ? new uint8_t[slots * per_slot] : nullptr);
+  this->slot_table_.reset(slots ? new Slot[slots] : nullptr);
+  for (size_t i = 0; i < slots; ++i) {
+    Slot &s = this->slot_table_[i];
+    uint8_t *base = this->arena_.get() + i * per_slot;
+    s.device = base;
+    s.config = base + DEVICE_SIZE;
+    s.strings = base + DEVICE_SIZE + config_capacity;
+    this->clear(i);
+  }
+}
+
+size_t DescriptorStore::memory_usage() const {
+  return this->slot_count_ * (sizeof(Slot) + DEVICE_SIZE + this->config_capacity_ + this->string_capacity_);
+}
+
+void DescriptorStore::clear(size_t slot) {
+  if (slot >= this->slot_count_) return;
+  Slot &s = this->slot_table_[slot];
+  s.config_len = 0;
+  s.strings_used = 0;
+  s.device_len = 0;
+  s.has_device = false;
+  s.has_config = false;
+  s.langid = 0;
+  s.string_count = 0;
+}
+
+bool DescriptorStore::set_device(size_t slot, const uint8_t *data, size_t len) {
+  if (slot >= this->slot_count_ || len > DEVICE_SIZE) return false;
+  Slot &s = this->slot_table_[slot];
+  memcpy(s.device, data, len);
+  s.device_len = (uint8_t)len;
+  s.has_device = true;
+  return true;
+}
+
+bool DescriptorStore::set_config(size_t slot, const uint8_t *data, size_t len) {
+  if (slot >= this->slot_count_ || len > this->config_capacity_) return false;
+  Slot &s = this->slot_table_[slot];
+  memcpy(s.config, data, len);
+  s.config_len = (uint16_t)len;
+  s.has_config = true;
+  return true;
+}
+
+bool DescriptorStore::set_string(size_t slot, int index, uint16_t langid, const uint8_t *data, size_t len) {
+  if (slot >= this->slot_count_ || index < 0 || index > 0xFF || len > 0xFF) return false;
+  Slot &s = this->slot_table_[slot];
+
+  // Convert once here so lookups hand out ready UTF-8. The LANGID table
+  // is not text.
+  uint8_t utf8[3 * 0xFF / 2];
+  size_t utf8_len = index != 0 && len > 2 ? utf16le_to_utf8(data + 2, (len - 2) / 2, utf8) : 0;
+  const size_t entry_len = 1 + len + 2 + utf8_len;
+
+  StringEntry *e = nullptr;
+  for (size_t i = 0; i < s.string_count; ++i) {
+    if (s.string_entries[i].index == index && s.string_entries[i].langid == langid) e = &s.string_entries[i];
+  }
+  uint8_t *p = e != nullptr ? s.strings + e->offset : nullptr;
+  if (p != nullptr && p[0] == len && (size_t)(p[1 + len] | (p[2 + len] << 8)) == utf8_len) {
+    // Same lengths: overwrite in place
+    p = s.strings + e->offset;
+  } else {
+    // Append; the space of a replaced entry is only reclaimed by clear()
+    if (s.strings_used + entry_len > this->string_capacity_) return false;
+    if (e == nullptr) {
+      if (s.string_count >= MAX_STRINGS) return false;
+      e = &s.string_entries[s.string_count++];
+      e->index = (uint8_t)index;
+      e->langid = langid;
+    }
+    e->offset = s.strings_used;
+    p = s.strings + s.strings_used;
+    s.strings_used = (uint16_t)(s.strings_used + entry_len);
+  }
+  p[0] = (uint8_t)len;
+  memcpy(p + 1, data, len);
+  p[1 + len] = (uint8_t)utf8_len;
+  p[2 + len] = (uint8_t)(utf8_len >> 8);
+  memcpy(p + 3 + len, utf8, utf8_len);
+
+  if (index == 0 && len >= 4) s.langid = (uint16_t)(data[2] | (data[3] << 8));
+  return true;
+}
+
+DescriptorView DescriptorStore::device(size_t slot) const {
+  if (slot >= this->slot_count_ || !this->slot_table_[slot].has_device) return DescriptorView{};
+  const Slot &s = this->slot_table_[slot];
+  return DescriptorView{s.device, s.device_len, true};
+}
+
+DescriptorView DescriptorStore::config(size_t slot) const {
+  if (slot >= this->slot_count_ || !this->slot_table_[slot].has_config) return DescriptorView{};
+  const Slot &s = this->slot_table_[slot];
+  return DescriptorView{s.config, s.config_len, true};
+}
+
+// Record layout (little endian): version, device length and bytes,
+// configuration length (16 bit) and bytes, string count, then per string
+// its index, LANGID (16 bit), length and raw descriptor.
+static const uint8_t RECORD_VERSION = 1;
+
+void DescriptorStore::serialize(size_t slot, std::vector<uint8_t> &out) const {
+  if (slot >= this->slot_count_) return;
+  const Slot &s = this->slot_table_[slot];
+  out.push_back(RECORD_VERSION);
+  uint8_t device_len = s.has_device ? s.device_len : 0;
+  out.push_back(device_len);
+  out.insert(out.end(), s.device, s.device + device_len);
+  uint16_t config_len = s.has_config ? s.config_len : 0;
+  out.push_back((uint8_t)config_len);
+  out.push_back((uint8_t)(config_len >> 8));
+  out.insert(out.end(), s.config, s.config + config_len);
+  out.push_back(s.string_count);
+  for (size_t i = 0; i < s.string_count; ++i) {
+    const StringEntry &e = s.string_entries[i];
+    const uint8_t *p = s.strings + e.offset;
+    out.push_back(e.index);
+    out.push_back((uint8_t)e.langid);
+    out.push_back((uint8_t)(e.langid >> 8));
+    out.insert(out.end(), p, p + 1 + p[0]);
+  }
+}
+
+bool DescriptorStore::restore(size_t slot, const uint8_t *data, size_t len) {
+  if (slot >= this->slot_count_) return false;
+  this->clear(slot);
+  const uint8_t *p = data;
+  const uint8_t *end = data + len;
+  auto fail = [this, slot]() {
+    this->clear(slot);
+    return false;
+  };
+  if (end - p < 2 || p[0] != RECORD_VERSION) return fail();
+  size_t device_len = p[1];
+  p += 2;
+  if ((size_t)(end - p) < device_len + 2) return fail();
+  if (device_len > 0 && !this->set_device(slot, p, device_len)) return fail();
+  p += device_len;
+  size_t config_len = p[0] | (p[1] << 8);
+  p += 2;
+  if ((size_t)(end - p) < config_len + 1) return fail();
+  if (config_len > 0 && !this->set_config(slot, p, config_len)) return fail();
+  p += config_len;
+  size_t count = *p++;
+  for (size_t i = 0; i < count; ++i) {
+    if (end - p < 4 || (size_t)(end - p) < 4u + p[3]) return fail();
+    if (!this->set_string(slot, p[0], (uint16_t)(p[1] | (p[2] << 8)), p + 4, p[3])) return fail();
+    p += 4 + p[3];
+  }
+  return p == end || fail();
+}
+
+const DescriptorStore::StringEntry *DescriptorStore::find_string(size_t slot, int index) const {
+  if (slot >= this->slot_count_) return nullptr;
+  const Slot &s = this->slot_table_[slot];
+  const StringEntry *any = nullptr;
+  for (size_t i = 0; i < s.string_count; ++i) {
+    const StringEntry &e = s.string_entries[i];
+    if (e.index != index) continue;
+    if (e.langid == s.langid) return &e;
+    if (any == nullptr) any = &e;
+  }
+  return any;
+}
+
+DescriptorView DescriptorStore::string(size_t slot, int index) const {
+  const StringEntry *e = this->find_string(slot, index);
+  if (e == nullptr) return DescriptorView{};
+  const uint8_t *p = this->slot_table_[slot].strings + e->offset;
+  return DescriptorView{p + 1, p[0], true};
+}
+
+DescriptorView DescriptorStore::string(size_t slot, int index, uint16_t langid) const {
+  if (slot >= this->slot_count_) return DescriptorView{};
+  const Slot &s = this->slot_table_[slot];
+  for (size_t i = 0; i < s.string_count; ++i) {
+    const StringEntry &e = s.string_entries[i];
+    if (e.index == index && e.langid == langid) return DescriptorView{s.strings + e.offset + 1, s.strings[e.offset], true};
+  }
+  return DescriptorView{};
+}
+
+DescriptorView DescriptorStore::string_utf8(size_t slot, int index) const {
+  const StringEntry *e = this->find_string(slot, index);
+  if (e == nullptr || index == 0) return DescriptorView{};
+  const uint8_t *p = this->slot_table_[slot].strings + e->offset;
+  const uint8_t *text = p + 1 + p[0];
+  return DescriptorView{text + 2, (size_t)(text[0] | (text[1] << 8)), true};
+}
+
+}  // namespace usbip
+}  // namespace esphome
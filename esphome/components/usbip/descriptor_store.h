@@ -0,0 +1,99 @@
+#pragma once
+
+#include "usb_host.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace esphome {
+namespace usbip {
+
+// Fixed-capacity descriptor cache for the exported clients. configure()
+// allocates one arena holding a slot per client (in registration order);
+// afterwards storing or looking up a descriptor never touches the heap, and
+// lookups are plain array indexing.
+//
+// Each slot holds the device descriptor, the configuration descriptor (up
+// to config_capacity bytes) and up to MAX_STRINGS string descriptors packed
+// into a string_capacity byte area. Strings are keyed by (index, LANGID)
+// and kept both raw and converted to UTF-8, so readers never transcode.
+class DescriptorStore {
+ public:
+  static const size_t DEVICE_SIZE = 18;
+  // String descriptors cached per slot
+  static const size_t MAX_STRINGS = 16;
+
+  // Allocate the arena. Any previously stored descriptors are dropped.
+  void configure(size_t slots, size_t config_capacity, size_t string_capacity);
+
+  size_t slots() const { return this->slot_count_; }
+  size_t config_capacity() const { return this->config_capacity_; }
+  size_t string_capacity() const { return this->string_capacity_; }
+  // Total bytes owned by the store (arena plus slot headers)
+  size_t memory_usage() const;
+
+  // Store a descriptor in 'slot'. Returns false if the slot or index is out
+  // of range or the descriptor does not fit; the previous value (if any) is
+  // kept in that case.
+  bool set_device(size_t slot, const uint8_t *data, size_t len);
+  bool set_config(size_t slot, const uint8_t *data, size_t len);
+  // Index 0 is the LANGID table (stored with langid 0); its first entry
+  // becomes the slot's langid().
+  bool set_string(size_t slot, int index, uint16_t langid, const uint8_t *data, size_t len);
+
+  DescriptorView device(size_t slot) const;
+  DescriptorView config(size_t slot) const;
+  // String in the slot's langid(), or in any LANGID if that one is missing
+  DescriptorView string(size_t slot, int index) const;
+  DescriptorView string(size_t slot, int index, uint16_t langid) const;
+  // UTF-8 form of string(slot, index)
+  DescriptorView string_utf8(size_t slot, int index) const;
+  // First LANGID of the device's string descriptor 0 (0 until it is cached)
+  uint16_t langid(size_t slot) const { return slot < this->slot_count_ ? this->slot_table_[slot].langid : 0; }
+
+  // Forget everything cached for 'slot' (e.g. the device was replaced)
+  void clear(size_t slot);
+
+  // Append everything cached in 'slot' to 'out' as one record: the device
+  // and configuration descriptors and the raw string descriptors with
+  // their (index, LANGID). restore() replaces the slot's contents with such
+  // a record; if it is malformed or does not fit, the slot is left empty
+  // and false is returned.
+  void serialize(size_t slot, std::vector<uint8_t> &out) const;
+  bool restore(size_t slot, const uint8_t *data, size_t len);
+
+ protected:
+  struct StringEntry {
+    uint8_t index;
+    uint16_t langid;
+    // Offset of the entry in the string area: a length byte and the raw
+    // descriptor, then a 16 bit little endian length and the UTF-8 text
+    uint16_t offset;
+  };
+  struct Slot {
+    uint8_t *device;
+    uint8_t *config;
+    uint8_t *strings;
+    uint16_t config_len;
+    // Bytes of the string area in use
+    uint16_t strings_used;
+    uint16_t langid;
+    uint8_t device_len;
+    uint8_t string_count;
+    bool has_device;
+    bool has_config;
+    StringEntry string_entries[MAX_STRINGS];
+  };
+
+  const StringEntry *find_string(size_t slot, int index) const;
+
+  std::unique_ptr<Slot[]> slot_table_{};
+  std::unique_ptr<uint8_t[]> arena_{};
+  size_t slot_count_{0};
+  size_t config_capacity_{0};
+  size_t string_capacity_{0};
+};
+
+}  // namespace usbip
+}  // namespace esphome
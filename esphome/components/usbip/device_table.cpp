@@ -0,0 +1,49 @@
+#include "device_table.h"
+#include <cstdio>
+#include <cstring>
+
+namespace esphome {
+namespace usbip {
+
+void DeviceTable::add(void *client) {
+  Device d;
+  d.client = client;
+  d.devnum = (uint32_t)this->devices_.size() + 1;
+  snprintf(d.busid, sizeof(d.busid), "%u-%u", (unsigned)d.busnum, (unsigned)d.devnum);
+  this->devices_.push_back(std::move(d));
+  this->clients_.push_back(client);
+}
+
+int DeviceTable::find_busid(const char *busid) const {
+  for (size_t i = 0; i < this->devices_.size(); ++i) {
+    if (strncmp(this->devices_[i].busid, busid, USBIP_BUSID_SIZE) == 0) return (int)i;
+  }
+  return -1;
+}
+
+int DeviceTable::find_client(void *client) const {
+  for (size_t i = 0; i < this->clients_.size(); ++i) {
+    if (this->clients_[i] == client) return (int)i;
+  }
+  return -1;
+}
+
+bool DeviceTable::set_attached(size_t index, bool attached) {
+  Device &d = this->devices_[index];
+  if (d.attached == attached) return false;
+  d.attached = attached;
+  d.record_valid = false;
+  this->version_++;
+  return true;
+}
+
+size_t DeviceTable::attached_count() const {
+  size_t n = 0;
+  for (const auto &d : this->devices_) {
+    if (d.attached) n++;
+  }
+  return n;
+}
+
+}  // namespace usbip
+}  // namespace esphome
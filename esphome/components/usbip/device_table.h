@@ -0,0 +1,67 @@
+#pragma once
+
+#include "descriptor_store.h"
+#include "usbip_protocol.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace esphome {
+namespace usbip {
+
+// Devices exported over USB/IP, one entry per USB client registered at
+// codegen. Whether a device is plugged into a client changes at run time;
+// USBIPComponent records the host adapter's attach and detach events here.
+// Every entry gets its busid ("1-N") when it is added and keeps it while
+// its device is unplugged, replugged, or the node reboots, so a client can
+// import the same busid again. Each device's OP_REP_DEVLIST entry is kept
+// serialized and only rebuilt when that device changed, so a hotplug event
+// touches its own entry alone.
+class DeviceTable {
+ public:
+  struct Device {
+    void *client{nullptr};
+    // NUL padded, as on the wire
+    char busid[USBIP_BUSID_SIZE]{};
+    uint32_t busnum{1};
+    uint32_t devnum{0};
+    bool attached{true};
+    // Last seen device descriptor, used to notice newly enumerated devices
+    uint8_t device[DescriptorStore::DEVICE_SIZE]{};
+    uint8_t device_len{0};
+    // Serialized OP_REP_DEVLIST entry and the adapter's client_generation()
+    // it was built from
+    std::vector<uint8_t> record{};
+    bool record_valid{false};
+    uint32_t record_generation{0};
+  };
+
+  // Add an entry for 'client'; it is numbered after the entries before it
+  void add(void *client);
+  size_t size() const { return this->devices_.size(); }
+  bool empty() const { return this->devices_.empty(); }
+  Device &operator[](size_t i) { return this->devices_[i]; }
+  const Device &operator[](size_t i) const { return this->devices_[i]; }
+  // Clients in registration order, for the host adapter and the prefetcher
+  void *const *clients() const { return this->clients_.data(); }
+
+  // Index of the entry with 'busid' (not necessarily terminated within
+  // USBIP_BUSID_SIZE bytes) / of 'client'; -1 if there is none
+  int find_busid(const char *busid) const;
+  int find_client(void *client) const;
+
+  // Record an attach or detach; false if the state did not change. The
+  // entry's devlist record is rebuilt on its next use.
+  bool set_attached(size_t index, bool attached);
+  size_t attached_count() const;
+  // Changes with every attach and detach
+  uint32_t version() const { return this->version_; }
+
+ protected:
+  std::vector<Device> devices_{};
+  std::vector<void *> clients_{};
+  uint32_t version_{0};
+};
+
+}  // namespace usbip
+}  // namespace esphome
@@ -1,9 +1,11 @@
 #include "usb_host.h"
 
 #ifdef ESP_PLATFORM
+#include "descriptor_store.h"
 #include "esphome/components/usb_host/usb_host.h"
+#include <algorithm>
+#include <cstdint>
 #include <cstring>
-#include <unordered_map>
 #include <vector>
 
 namespace esphome {
@@ -23,10 +25,25 @@ class EsphomeUsbHostAdapter : public USBHostAdapter {
   void stop() override { ESP_LOGI(USB_HOST_TAG, "Esphome USB host adapter stopped"); }
 
   void poll() override {
-    if (this->host_) {
-      // Delegate to the host component loop() which will process events.
-      this->host_->loop();
+    // USBHost and the USBClients are ESPHome components whose own loop()
+    // dispatches transfer callbacks; nothing to pump here.
+    uint32_t now = host_now_ms();
+    for (auto h : this->rejected_) {
+      UsbTransferResult res;
+      res.status = USB_STATUS_INVALID;
+      this->tracker_.backend_done(h, res);
     }
+    this->rejected_.clear();
+    this->tracker_.expire(now);
+    for (size_t slot = 0; slot < this->config_fetch_.size(); ++slot) {
+      auto &f = this->config_fetch_[slot];
+      if (f.state == ConfigFetchState::RETRY && (int32_t)(now - f.retry_at_ms) >= 0) this->start_config_read(slot);
+    }
+    for (size_t slot = 0; slot < this->verify_.size(); ++slot) {
+      auto &v = this->verify_[slot];
+      if (v.state != VerifyState::NONE && !v.in_flight && (int32_t)(now - v.retry_at_ms) >= 0) this->start_verify(slot);
+    }
+    for (size_t slot = 0; slot < this->presence_.size(); ++slot) this->update_presence(slot, now);
   }
 
   void request_device_descriptor(void *client_ptr) override {
@@ -45,30 +62,29 @@ class EsphomeUsbHostAdapter : public USBHostAdapter {
     const uint16_t LENGTH = 18;  // device descriptor length
 
     // Callback to receive transfer result
-    auto extract_descriptor = [](const uint8_t *data, size_t len, uint8_t dtype, size_t minlen) -> std::vector<uint8_t> {
+    auto extract_descriptor = [](const uint8_t *data, size_t len, uint8_t dtype, size_t minlen) -> DescriptorView {
       // Look for a descriptor where bDescriptorType == dtype and bLength >= minlen
       for (size_t off = 0; off + 2 <= len; ++off) {
         uint8_t bl = data[off];
         uint8_t bt = data[off + 1];
         if (bt == dtype && bl >= minlen && off + bl <= len) {
-          return std::vector<uint8_t>(data + off, data + off + bl);
+          return DescriptorView{data + off, bl, true};
         }
       }
       return {};
     };
 
-    auto cb = [this, client_ptr, extract_descriptor](const esphome::usb_host::TransferStatus &st) {
-      if (st.success && st.data && st.data_len > 0) {
+    auto cb = [this, client_ptr, extract_descriptor](const UsbTransferResult &st) {
+      if (st.status == USB_STATUS_OK && st.data && st.actual_length > 0) {
         // Try to extract a proper device descriptor (type 1, length >= 18)
-        std::vector<uint8_t> v = extract_descriptor(st.data, st.data_len, 1, 18);
+        DescriptorView v = extract_descriptor(st.data, st.actual_length, 1, 18);
         if (v.empty()) {
           // Fallback: if the buffer length equals 18 or more, assume the start is descriptor
-          if (st.data_len >= 18) v = std::vector<uint8_t>(st.data, st.data + std::min((size_t)st.data_len, (size_t)18));
+          if (st.actual_length >= 18) v = DescriptorView{st.data, 18, true};
         }
         if (!v.empty()) {
-          auto &set = this->desc_cache_[client_ptr];
-          set.device = v;
-          ESP_LOGI(USB_HOST_TAG, "Received %u bytes device descriptor for client (cached %u)", (unsigned)st.data_len, (unsigned)v.size());
+          this->store_device(client_ptr, v);
+          ESP_LOGI(USB_HOST_TAG, "Received %u bytes device descriptor for client (cached %u)", (unsigned)st.actual_length, (unsigned)v.size());
           if (v.size() >= 18) {
             uint8_t iManufacturer = v[14];
             uint8_t iProduct = v[15];
@@ -77,80 +93,44 @@ class EsphomeUsbHostAdapter : public USBHostAdapter {
             (void)iManufacturer; (void)iProduct; (void)iSerial; (void)bNumConfigurations;
           }
         } else {
-          ESP_LOGW(USB_HOST_TAG, "GET_DESCRIPTOR returned data but no device descriptor found (len=%u)", (unsigned)st.data_len);
+          ESP_LOGW(USB_HOST_TAG, "GET_DESCRIPTOR returned data but no device descriptor found (len=%u)", (unsigned)st.actual_length);
         }
       } else {
         ESP_LOGW(USB_HOST_TAG, "GET_DESCRIPTOR failed or empty for client");
       }
     };
 
-    // Attempt the control transfer. We pass a dummy data vector sized to LENGTH
-    // to indicate the expected transfer length for IN transfers (implementation dependent).
-    std::vector<uint8_t> dummy(LENGTH);
-    bool ok = client->control_transfer(bmRequestType, REQUEST_GET_DESCRIPTOR, VALUE_DEVICE_DESCRIPTOR, INDEX, cb, dummy);
+    // Attempt the control transfer (or join one already asking for it)
+    bool ok = this->control_in(client_ptr, bmRequestType, REQUEST_GET_DESCRIPTOR, VALUE_DEVICE_DESCRIPTOR, INDEX, LENGTH, cb);
     if (!ok) {
       ESP_LOGW(USB_HOST_TAG, "control_transfer call to request descriptor returned false (client may not be ready)");
     }
   }
 
-  bool get_device_descriptor(void *client_ptr, std::vector<uint8_t> &out) override {
-    auto it = this->desc_cache_.find(client_ptr);
-    if (it == this->desc_cache_.end()) return false;
-    out = it->second.device;
-    return true;
+  DescriptorView device_descriptor(void *client_ptr) const override {
+    return this->store_.device(this->slot_of(client_ptr));
   }
 
+  // Fetch the configuration descriptor with all of its interface and
+  // endpoint descriptors (wTotalLength bytes). GET_DESCRIPTOR always returns
+  // the descriptor from its first byte, so it cannot be read in segments:
+  // the first request already asks for as much as the host accepts, which
+  // covers most devices in a single transfer, and only if wTotalLength turns
+  // out to be larger a second request reads exactly that. The descriptor is
+  // published once it is complete. Runs alongside string fetches; repeated
+  // calls while a fetch is in flight or after it finished are ignored.
   void request_config_descriptor(void *client_ptr) override {
-    if (!client_ptr) return;
-    auto client = static_cast<esphome::usb_host::USBClient *>(client_ptr);
-    if (!client) return;
-
-    // First request: read 9 bytes to learn wTotalLength
-    uint8_t bmReq = esphome::usb_host::USB_DIR_IN | esphome::usb_host::USB_TYPE_STANDARD |
-                    esphome::usb_host::USB_RECIP_DEVICE;
-    const uint8_t REQ_GET_DESCRIPTOR = 0x06;
-    const uint16_t VALUE_CFG_DESC = (2 << 8);
-    const uint16_t INDEX0 = 0;
-
-    auto probe_cb = [this, client_ptr, bmReq](const esphome::usb_host::TransferStatus &st) {
-      if (!st.success || st.data_len < 9) {
-        ESP_LOGW(USB_HOST_TAG, "Config probe failed");
-        return;
-      }
-      uint16_t total_len = st.data[2] | (st.data[3] << 8);
-      ESP_LOGI(USB_HOST_TAG, "Config total length=%u, fetching in segments", (unsigned)total_len);
-
-      // Fetch in segments up to 255 bytes
-      std::vector<uint8_t> full; full.resize(total_len);
-      size_t offset = 0;
-      const size_t chunk = 255;
-      while (offset < total_len) {
-        size_t want = std::min(chunk, (size_t)total_len - offset);
-        std::vector<uint8_t> buf(want);
-        auto seg_cb = [this, client_ptr, &full, offset](const esphome::usb_host::TransferStatus &st2) mutable {
-          if (st2.success && st2.data_len > 0) {
-            size_t copy_len = std::min((size_t)st2.data_len, full.size() - offset);
-            memcpy(full.data() + offset, st2.data, copy_len);
-          } else {
-            ESP_LOGW(USB_HOST_TAG, "Config segment fetch failed at offset %u", (unsigned)offset);
-          }
-        };
-        auto client2 = static_cast<esphome::usb_host::USBClient *>(client_ptr);
-        client2->control_transfer(bmReq, REQ_GET_DESCRIPTOR, VALUE_CFG_DESC, INDEX0, seg_cb, buf);
-        offset += want;
-      }
-      // Cache the assembled descriptor
-      auto &set = this->desc_cache_[client_ptr];
-      set.config = std::move(full);
-      ESP_LOGI(USB_HOST_TAG, "Cached full configuration descriptor (%u bytes)", (unsigned)set.config.size());
-    };
-
-    std::vector<uint8_t> probe(9);
-    client->control_transfer(bmReq, REQ_GET_DESCRIPTOR, VALUE_CFG_DESC, INDEX0, probe_cb, probe);
+    size_t slot = this->slot_of(client_ptr);
+    if (slot >= this->config_fetch_.size()) return;
+    auto &f = this->config_fetch_[slot];
+    if (f.state != ConfigFetchState::IDLE && f.state != ConfigFetchState::FAILED) return;
+    f.attempts = 0;
+    f.total_len = 0;
+    this->start_config_read(slot);
   }
-
   void request_string_descriptor(void *client_ptr, int index) override {
-    if (!client_ptr || index <= 0) return;
+    // Index 0 is the LANGID table
+    if (!client_ptr || index < 0) return;
     auto client = static_cast<esphome::usb_host::USBClient *>(client_ptr);
     if (!client) return;
 
@@ -158,49 +138,52 @@ class EsphomeUsbHostAdapter : public USBHostAdapter {
                     esphome::usb_host::USB_RECIP_DEVICE;
     const uint8_t REQ_GET_DESCRIPTOR = 0x06;
     const uint16_t VALUE_STR_DESC = (3 << 8) | (index & 0xFF);
-    const uint16_t INDEX0 = 0;
+    // Strings are read in the device's first LANGID; en-US until string 0
+    // (read first by the prefetcher) says otherwise
+    const size_t slot = this->slot_of(client_ptr);
+    const uint16_t langid = index == 0 ? 0 : (this->store_.langid(slot) ? this->store_.langid(slot) : LANGID_EN_US);
 
     // First fetch 2 bytes to read bLength
-    auto extract_descriptor = [](const uint8_t *data, size_t len, uint8_t dtype, size_t minlen) -> std::vector<uint8_t> {
+    auto extract_descriptor = [](const uint8_t *data, size_t len, uint8_t dtype, size_t minlen) -> DescriptorView {
       for (size_t off = 0; off + 2 <= len; ++off) {
         uint8_t bl = data[off];
         uint8_t bt = data[off + 1];
         if (bt == dtype && bl >= minlen && off + bl <= len) {
-          return std::vector<uint8_t>(data + off, data + off + bl);
+          return DescriptorView{data + off, bl, true};
         }
       }
       return {};
     };
 
-    auto probe_cb = [this, client_ptr, index, bmReq, extract_descriptor](const esphome::usb_host::TransferStatus &st) {
-      if (!st.success || st.data_len < 2) {
+    auto probe_cb = [this, client_ptr, index, langid, bmReq, extract_descriptor](const UsbTransferResult &st) {
+      if (st.status != USB_STATUS_OK || st.actual_length < 2) {
         ESP_LOGW(USB_HOST_TAG, "String descriptor probe failed for index %d", index);
         return;
       }
       // Try to extract string descriptor (type 3)
-      std::vector<uint8_t> found = extract_descriptor(st.data, st.data_len, 3, 2);
+      DescriptorView found = extract_descriptor(st.data, st.actual_length, 3, 2);
       if (found.empty()) {
         // No clean descriptor found; log first bytes for debugging
         std::string hex;
-        size_t show = std::min((size_t)32, (size_t)st.data_len);
+        size_t show = std::min((size_t)32, (size_t)st.actual_length);
         hex.reserve(show * 3);
         for (size_t bi = 0; bi < show; ++bi) {
           char tmp[4];
           snprintf(tmp, sizeof(tmp), "%02X ", st.data[bi]);
           hex += tmp;
         }
-        ESP_LOGW(USB_HOST_TAG, "String descriptor probe returned unexpected data (len=%u) for index %d: %s", (unsigned)st.data_len, index, hex.c_str());
+        ESP_LOGW(USB_HOST_TAG, "String descriptor probe returned unexpected data (len=%u) for index %d: %s", (unsigned)st.actual_length, index, hex.c_str());
         // Try an immediate retry. If the probe includes a partial descriptor
         // header (bLength, bDescriptorType) we can use the reported length to
         // request exactly that many bytes which is less likely to trigger host
         // stack errors than a large fixed buffer.
         size_t want = 0;
-        for (size_t off = 0; off + 2 <= st.data_len; ++off) {
+        for (size_t off = 0; off + 2 <= st.actual_length; ++off) {
           uint8_t bl = st.data[off];
           uint8_t bt = st.data[off + 1];
           if (bt == 3 /* STRING */ && bl >= 2) {
             // If the descriptor would extend past the probe buffer, use it
-            if (off + bl > st.data_len) {
+            if (off + bl > st.actual_length) {
               want = bl;
               break;
             }
@@ -211,98 +194,698 @@ class EsphomeUsbHostAdapter : public USBHostAdapter {
   // Clamp to a safe maximum to avoid asking for absurdly-large transfers
   const size_t WANT_MAX = 512;
   if (want > WANT_MAX) want = WANT_MAX;
-        auto retry_cb = [this, client_ptr, index, extract_descriptor](const esphome::usb_host::TransferStatus &st2) mutable {
-          if (st2.success && st2.data_len > 0) {
-            std::vector<uint8_t> v = extract_descriptor(st2.data, st2.data_len, 3, 2);
-            if (v.empty()) v = std::vector<uint8_t>(st2.data, st2.data + st2.data_len);
-            auto &set = this->desc_cache_[client_ptr];
-            auto it = set.strings.find(index);
-            if (it == set.strings.end() || it->second != v) {
-              set.strings[index] = std::move(v);
-              ESP_LOGI(USB_HOST_TAG, "Cached string descriptor index %d after retry (%u bytes)", index, (unsigned)set.strings[index].size());
-            } else {
-              // Already cached identical content; no new log
+        auto retry_cb = [this, client_ptr, index, langid, extract_descriptor](const UsbTransferResult &st2) mutable {
+          if (st2.status == USB_STATUS_OK && st2.actual_length > 0) {
+            DescriptorView v = extract_descriptor(st2.data, st2.actual_length, 3, 2);
+            if (v.empty()) v = DescriptorView{st2.data, st2.actual_length, true};
+            if (this->store_string(client_ptr, index, langid, v)) {
+              ESP_LOGI(USB_HOST_TAG, "Cached string descriptor index %d after retry (%u bytes)", index, (unsigned)v.size());
             }
           } else {
-            // Immediate retry failed; schedule an async request instead and return
-            ESP_LOGW(USB_HOST_TAG, "String descriptor retry failed for index %d; scheduling async fetch", index);
-            auto client3 = static_cast<esphome::usb_host::USBClient *>(client_ptr);
-            // Fire off an asynchronous request with a small probe; it will cache when ready
-            std::vector<uint8_t> small(2);
-            client3->control_transfer(esphome::usb_host::USB_DIR_IN | esphome::usb_host::USB_TYPE_STANDARD | esphome::usb_host::USB_RECIP_DEVICE,
-                                      REQ_GET_DESCRIPTOR, (3 << 8) | (index & 0xFF), INDEX0,
-                                      [this, client_ptr, index](const esphome::usb_host::TransferStatus &st3) {
-                                        // The probe handler path will handle caching via another request
-                                        (void)st3; (void)client_ptr; (void)index;
-                                      }, small);
+            // The prefetcher requests the string again once its fetch times out
+            ESP_LOGW(USB_HOST_TAG, "String descriptor retry failed for index %d", index);
           }
         };
-  std::vector<uint8_t> buf2(want);
-        auto client2 = static_cast<esphome::usb_host::USBClient *>(client_ptr);
-        bool ok = client2->control_transfer(bmReq, REQ_GET_DESCRIPTOR, (3 << 8) | (index & 0xFF), INDEX0, retry_cb, buf2);
-        if (!ok) {
-          ESP_LOGW(USB_HOST_TAG, "String descriptor retry control_transfer returned false for index %d; scheduling async fetch", index);
-          // Schedule an async probe (small) to try later
-          std::vector<uint8_t> small(2);
-          client2->control_transfer(bmReq, REQ_GET_DESCRIPTOR, (3 << 8) | (index & 0xFF), INDEX0,
-                                    [this, client_ptr, index](const esphome::usb_host::TransferStatus &st3) {
-                                      (void)st3; (void)client_ptr; (void)index;
-                                    }, small);
+        if (!this->control_in(client_ptr, bmReq, REQ_GET_DESCRIPTOR, (3 << 8) | (index & 0xFF), langid, want,
+                              retry_cb)) {
+          ESP_LOGW(USB_HOST_TAG, "String descriptor retry for index %d refused; left to the prefetcher", index);
         }
         return;
       }
       // Request full descriptor using its reported length
       size_t want = found.size();
-      auto seg_cb = [this, client_ptr, index, extract_descriptor](const esphome::usb_host::TransferStatus &st2) mutable {
-          if (st2.success && st2.data_len > 0) {
+      auto seg_cb = [this, client_ptr, index, langid, extract_descriptor](const UsbTransferResult &st2) mutable {
+          if (st2.status == USB_STATUS_OK && st2.actual_length > 0) {
           // Try to extract clean descriptor
-          std::vector<uint8_t> v = extract_descriptor(st2.data, st2.data_len, 3, 2);
-          if (v.empty()) v = std::vector<uint8_t>(st2.data, st2.data + st2.data_len);
-          auto &set = this->desc_cache_[client_ptr];
-          auto it = set.strings.find(index);
-          if (it == set.strings.end() || it->second != v) {
-            set.strings[index] = std::move(v);
-            ESP_LOGI(USB_HOST_TAG, "Cached string descriptor index %d (%u bytes)", index, (unsigned)set.strings[index].size());
-          } else {
-            // Already cached identical content; suppress duplicate log
+          DescriptorView v = extract_descriptor(st2.data, st2.actual_length, 3, 2);
+          if (v.empty()) v = DescriptorView{st2.data, st2.actual_length, true};
+          if (this->store_string(client_ptr, index, langid, v)) {
+            ESP_LOGI(USB_HOST_TAG, "Cached string descriptor index %d (%u bytes)", index, (unsigned)v.size());
           }
         } else {
           ESP_LOGW(USB_HOST_TAG, "String descriptor fetch failed for index %d", index);
         }
       };
-      std::vector<uint8_t> buf(want);
-      auto client2 = static_cast<esphome::usb_host::USBClient *>(client_ptr);
-      client2->control_transfer(bmReq, REQ_GET_DESCRIPTOR, (3 << 8) | (index & 0xFF), INDEX0, seg_cb, buf);
+      this->control_in(client_ptr, bmReq, REQ_GET_DESCRIPTOR, (3 << 8) | (index & 0xFF), langid, want, seg_cb);
     };
 
-    std::vector<uint8_t> probe(2);
-    client->control_transfer(bmReq, REQ_GET_DESCRIPTOR, VALUE_STR_DESC, INDEX0, probe_cb, probe);
+    this->control_in(client_ptr, bmReq, REQ_GET_DESCRIPTOR, VALUE_STR_DESC, langid, 2, probe_cb);
+  }
+
+  DescriptorView config_descriptor(void *client_ptr) const override {
+    return this->store_.config(this->slot_of(client_ptr));
+  }
+
+  DescriptorView string_descriptor(void *client_ptr, int index) const override {
+    return this->store_.string(this->slot_of(client_ptr), index);
+  }
+
+  DescriptorView string_utf8(void *client_ptr, int index) const override {
+    return this->store_.string_utf8(this->slot_of(client_ptr), index);
+  }
+
+  DescriptorView string_descriptor_langid(void *client_ptr, int index, uint16_t langid) const override {
+    // The LANGID table is stored under langid 0
+    return this->store_.string(this->slot_of(client_ptr), index, index == 0 ? 0 : langid);
+  }
+
+  uint32_t descriptor_generation() const override { return this->generation_; }
+
+  uint32_t client_generation(void *client_ptr) const override {
+    size_t slot = this->slot_of(client_ptr);
+    return slot < this->slot_generation_.size() ? this->slot_generation_[slot] : 0;
+  }
+
+  // Until the first probe settles it, a client counts as attached
+  bool device_attached(void *client_ptr) const override {
+    size_t slot = this->slot_of(client_ptr);
+    return slot < this->presence_.size() && this->presence_[slot].state != Presence::DETACHED;
+  }
+
+  void register_clients(void *const *clients, size_t count, size_t config_capacity, size_t string_capacity) override {
+    this->clients_.assign(clients, clients + count);
+    this->store_.configure(count, config_capacity, string_capacity);
+    this->config_fetch_.assign(count, ConfigFetch{});
+    this->verify_.assign(count, Verify{});
+    this->slot_generation_.assign(count, 1);
+    this->presence_.assign(count, PresenceState{});
+    this->requests_in_use_.assign(count, 0);
+    this->generation_++;
   }
 
-  bool get_config_descriptor(void *client_ptr, std::vector<uint8_t> &out) override {
-    auto it = this->desc_cache_.find(client_ptr);
-    if (it == this->desc_cache_.end()) return false;
-    out = it->second.config;
+  bool save_descriptors(void *client_ptr, std::vector<uint8_t> &out) const override {
+    size_t slot = this->slot_of(client_ptr);
+    // Nothing new to save before a restored record was confirmed
+    if (slot >= this->verify_.size() || this->verify_[slot].state != VerifyState::NONE ||
+        !this->store_.device(slot).ready)
+      return false;
+    this->store_.serialize(slot, out);
     return true;
   }
 
-  bool get_string_descriptor(void *client_ptr, int index, std::vector<uint8_t> &out) override {
-    auto it = this->desc_cache_.find(client_ptr);
-    if (it == this->desc_cache_.end()) return false;
-    auto sit = it->second.strings.find(index);
-    if (sit == it->second.strings.end()) return false;
-    out = sit->second;
+  bool restore_descriptors(void *client_ptr, const uint8_t *data, size_t len) override {
+    size_t slot = this->slot_of(client_ptr);
+    if (slot >= this->verify_.size()) return false;
+    if (!this->store_.restore(slot, data, len) || this->store_.device(slot).size() < 18) {
+      this->store_.clear(slot);
+      return false;
+    }
+    if (this->store_.config(slot).ready) this->config_fetch_[slot].state = ConfigFetchState::DONE;
+    this->verify_[slot] = Verify{VerifyState::DEVICE, false, 0};
+    this->changed(slot);
     return true;
   }
 
+  size_t descriptor_memory() const override {
+    return this->store_.memory_usage() + this->clients_.capacity() * sizeof(void *);
+  }
+
+  transfer_handle_t submit_transfer(void *client_ptr, const UsbTransfer &xfer, transfer_done_t done) override {
+    // USBClient only offers control and bulk/interrupt requests; there is no
+    // way to queue isochronous packets through it
+    if (!client_ptr || xfer.type == TransferType::ISOCHRONOUS) return INVALID_TRANSFER;
+    auto &e = this->tracker_.add(client_ptr, xfer, std::move(done), host_now_ms());
+    transfer_handle_t handle = e.handle;
+    if (!this->representable(xfer)) {
+      this->reject(e);
+      return handle;
+    }
+    this->pump(client_ptr);
+    return handle;
+  }
+
+  bool cancel_transfer(transfer_handle_t handle) override {
+    // USBClient offers no way to abort a request it already queued; the
+    // caller is completed right away and the request slot is reclaimed when
+    // the host stack finishes with it.
+    return this->tracker_.abort(handle, USB_STATUS_CONNRESET);
+  }
+
+  size_t transfers_in_flight() const override { return this->tracker_.pending(); }
+
  protected:
-  struct DescriptorSet {
-    std::vector<uint8_t> device;
-    std::vector<uint8_t> config;
-    std::unordered_map<int, std::vector<uint8_t>> strings;
+  // Longest bulk or interrupt transfer USBClient can carry
+  static const size_t MAX_TRANSFER_LENGTH = 0xFFFF;
+  // USBClient has a fixed pool of MAX_REQUESTS request slots per client.
+  // When it is exhausted transfer_in()/transfer_out() drop the request
+  // without calling back, so every request this adapter hands over (URB
+  // transfers and its own control_in() requests alike) takes a slot from
+  // requests_in_use_ first and gives it back from its callback. Queued URB
+  // transfers leave RESERVED_REQUESTS slots for descriptor fetches and
+  // presence probes.
+  static const uint8_t RESERVED_REQUESTS = 2;
+
+  // USBClient takes a 16-bit bulk/interrupt length
+  static bool representable(const UsbTransfer &xfer) {
+    return xfer.type == TransferType::CONTROL || xfer.length <= MAX_TRANSFER_LENGTH;
+  }
+  // Never hand 'e' to the host stack: marked started so pump() passes it
+  // by, it completes with -EINVAL from the next poll()
+  void reject(TransferTracker::Entry &e) {
+    this->tracker_.mark_started(e);
+    this->rejected_.push_back(e.handle);
+  }
+
+  bool claim_request(size_t slot, uint8_t reserve) {
+    if (slot >= this->requests_in_use_.size()) return false;
+    if (this->requests_in_use_[slot] + reserve >= esphome::usb_host::MAX_REQUESTS) return false;
+    this->requests_in_use_[slot]++;
+    return true;
+  }
+  void release_request(size_t slot) {
+    if (slot < this->requests_in_use_.size() && this->requests_in_use_[slot] > 0) this->requests_in_use_[slot]--;
+  }
+
+  // Hand queued transfers of 'client_ptr' to the host stack while it has
+  // free request slots.
+  void pump(void *client_ptr) {
+    while (auto *e = this->tracker_.next_waiting(client_ptr)) {
+      if (!this->start_transfer(*e)) break;
+    }
+  }
+
+  bool start_transfer(TransferTracker::Entry &e) {
+    if (!representable(e.xfer)) {
+      this->reject(e);
+      return true;
+    }
+    auto client = static_cast<esphome::usb_host::USBClient *>(e.client);
+    transfer_handle_t handle = e.handle;
+    void *client_ptr = e.client;
+    size_t slot = this->slot_of(client_ptr);
+    auto done = [this, handle, client_ptr](const UsbTransferResult &res) {
+      this->tracker_.backend_done(handle, res);
+      // A request slot may have been freed; start the next queued transfer
+      this->pump(client_ptr);
+    };
+    auto cb = [this, done, client_ptr, slot](const esphome::usb_host::TransferStatus &st) {
+      this->release_request(slot);
+      UsbTransferResult res = result_of(st);
+      this->observe(client_ptr, res.status);
+      done(res);
+    };
+
+    const UsbTransfer &xfer = e.xfer;
+    bool shared = xfer.type == TransferType::CONTROL && ControlRequestManager::shareable(xfer.setup);
+    // control_in() claims its own slot
+    if (!shared && !this->claim_request(slot, RESERVED_REQUESTS)) return false;
+    // Mark before handing over: the host stack may complete (and release
+    // the entry) before the call returns.
+    this->tracker_.mark_started(e);
+    if (xfer.type == TransferType::CONTROL) {
+      const uint8_t *s = xfer.setup;
+      uint8_t bmRequestType = s[0];
+      uint8_t bRequest = s[1];
+      uint16_t wValue = s[2] | (s[3] << 8);
+      uint16_t wIndex = s[4] | (s[5] << 8);
+      if (ControlRequestManager::shareable(s)) {
+        // A client reading what another request already asks for (say
+        // GET_DESCRIPTOR while the prefetcher fetches the same string)
+        // rides along with it and holds no request slot of its own.
+        if (this->control_in(e.client, bmRequestType, bRequest, wValue, wIndex, (uint16_t)xfer.length, done,
+                             RESERVED_REQUESTS))
+          return true;
+        e.started = false;
+        return false;
+      }
+      // For IN requests the vector only conveys the expected length; for OUT
+      // requests it carries the payload. Either way USBClient copies what
+      // it needs into its own transfer before returning.
+      std::vector<uint8_t> data = this->take_buffer(xfer.length);
+      if (!xfer.is_in() && xfer.length > 0) {
+        if (xfer.data != nullptr) {
+          memcpy(data.data(), xfer.data, xfer.length);
+        } else {
+          data.clear();
+        }
+      }
+      // Returns false when the client has no free request slot
+      bool ok = client->control_transfer(bmRequestType, bRequest, wValue, wIndex, cb, data);
+      this->give_buffer(std::move(data));
+      if (!ok) {
+        this->release_request(slot);
+        e.started = false;
+        return false;
+      }
+    } else if (xfer.is_in()) {
+      client->transfer_in(xfer.endpoint, cb, (uint16_t)xfer.length);
+    } else {
+      client->transfer_out(xfer.endpoint, cb, xfer.data, (uint16_t)xfer.length);
+    }
+    return true;
+  }
+
+  // Issue a standard control IN request (GET_DESCRIPTOR etc.), or attach
+  // 'done' to an identical one in flight (see ControlRequestManager), so
+  // the bus sees it once however many callers want it. Returns false if
+  // the client has no free request slot (keeping 'reserve' free for
+  // others); 'done' is not called then.
+  bool control_in(void *client_ptr, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                  uint16_t wLength, transfer_done_t done, uint8_t reserve = 0) {
+    const uint8_t setup[8] = {bmRequestType,   bRequest,
+                              (uint8_t) wValue, (uint8_t)(wValue >> 8),
+                              (uint8_t) wIndex, (uint8_t)(wIndex >> 8),
+                              (uint8_t) wLength, (uint8_t)(wLength >> 8)};
+    size_t slot = this->slot_of(client_ptr);
+    if (!this->control_.joinable(client_ptr, setup) && !this->claim_request(slot, reserve)) return false;
+    uint32_t id = this->control_.add(client_ptr, setup, std::move(done));
+    if (id == 0) {
+      ESP_LOGV(USB_HOST_TAG, "Control request %02X/%02X %04X/%04X joins one in flight", bmRequestType, bRequest,
+               wValue, wIndex);
+      return true;
+    }
+    auto cb = [this, id, client_ptr, slot](const esphome::usb_host::TransferStatus &st) {
+      this->release_request(slot);
+      UsbTransferResult res = result_of(st);
+      this->observe(client_ptr, res.status);
+      this->control_.complete(id, res);
+      // Queued URB transfers may have waited for the slot
+      this->pump(client_ptr);
+    };
+    // The vector only conveys the expected length; USBClient copies what
+    // it needs before returning, so the buffer goes straight back
+    std::vector<uint8_t> buf = this->take_buffer(wLength);
+    auto client = static_cast<esphome::usb_host::USBClient *>(client_ptr);
+    bool ok = client->control_transfer(bmRequestType, bRequest, wValue, wIndex, cb, buf);
+    this->give_buffer(std::move(buf));
+    if (!ok) {
+      this->release_request(slot);
+      this->control_.drop(id);
+    }
+    return ok;
+  }
+
+  static UsbTransferResult result_of(const esphome::usb_host::TransferStatus &st) {
+    UsbTransferResult res;
+    res.status = st.success ? USB_STATUS_OK : map_transfer_error(st.error_code);
+    if (st.success) {
+      res.data = st.data;
+      res.actual_length = st.data_len;
+    }
+    return res;
+  }
+
+  // Translate an ESP-IDF usb_transfer_status_t into a USB_STATUS_* code.
+  static int32_t map_transfer_error(uint16_t error_code) {
+    switch (error_code) {
+      case 2:  // USB_TRANSFER_STATUS_TIMED_OUT
+        return USB_STATUS_TIMEDOUT;
+      case 3:  // USB_TRANSFER_STATUS_CANCELED
+        return USB_STATUS_CONNRESET;
+      case 4:  // USB_TRANSFER_STATUS_STALL
+        return USB_STATUS_STALL;
+      case 5:  // USB_TRANSFER_STATUS_NO_DEVICE
+        return USB_STATUS_NODEV;
+      case 6:  // USB_TRANSFER_STATUS_OVERFLOW
+        return USB_STATUS_OVERFLOW;
+      default:
+        return USB_STATUS_PROTO;
+    }
+  }
+
+  // Registration index of a client, i.e. its slot in store_. The table
+  // holds a handful of pointers, so a scan beats hashing. Unknown clients
+  // map to an out-of-range slot, which the store treats as empty.
+  size_t slot_of(void *client_ptr) const {
+    for (size_t i = 0; i < this->clients_.size(); ++i) {
+      if (this->clients_[i] == client_ptr) return i;
+    }
+    return SIZE_MAX;
+  }
+
+  static bool same(const DescriptorView &cached, const DescriptorView &v) {
+    return cached.ready && cached.size() == v.size() && std::equal(v.begin(), v.end(), cached.begin());
+  }
+
+  // Store a fetched descriptor. Returns true if the cached value changed.
+  bool store_device(void *client_ptr, const DescriptorView &v) {
+    size_t slot = this->slot_of(client_ptr);
+    if (same(this->store_.device(slot), v)) return false;
+    if (!this->store_.set_device(slot, v.data, v.len)) return false;
+    this->changed(slot);
+    return true;
+  }
+
+  // Issue the next GET_DESCRIPTOR(CONFIGURATION) of a fetch: wTotalLength
+  // bytes once known, otherwise as much as we could keep.
+  void start_config_read(size_t slot) {
+    auto &f = this->config_fetch_[slot];
+    size_t want = f.total_len ? f.total_len : std::min(this->store_.config_capacity(), MAX_CONTROL_IN_LENGTH);
+    uint8_t bmReq = esphome::usb_host::USB_DIR_IN | esphome::usb_host::USB_TYPE_STANDARD |
+                    esphome::usb_host::USB_RECIP_DEVICE;
+    const uint8_t REQ_GET_DESCRIPTOR = 0x06;
+    const uint16_t VALUE_CFG_DESC = (2 << 8);
+    // Completions of an abandoned fetch (e.g. one that was retried) are
+    // recognised by their sequence number and dropped
+    uint8_t seq = ++f.seq;
+    auto cb = [this, slot, seq, want](const UsbTransferResult &st) { this->on_config_data(slot, seq, want, st); };
+    f.state = ConfigFetchState::READING;
+    bool ok = this->control_in(this->clients_[slot], bmReq, REQ_GET_DESCRIPTOR, VALUE_CFG_DESC, 0, (uint16_t)want, cb);
+    if (!ok) {
+      // Typically all request slots are busy; try again from poll()
+      this->retry_config_read(slot, "host stack busy");
+    }
+  }
+
+  void on_config_data(size_t slot, uint8_t seq, size_t want, const UsbTransferResult &st) {
+    auto &f = this->config_fetch_[slot];
+    if (f.state != ConfigFetchState::READING || f.seq != seq) return;
+    if (st.status != USB_STATUS_OK || st.data == nullptr) {
+      this->retry_config_read(slot, "transfer failed");
+      return;
+    }
+    // Locate the configuration descriptor header (bLength 9, type 2)
+    size_t off = 0;
+    while (off + 4 <= st.actual_length && !(st.data[off] == 9 && st.data[off + 1] == 0x02)) off++;
+    if (off + 4 > st.actual_length) {
+      this->retry_config_read(slot, "no configuration descriptor in reply");
+      return;
+    }
+    size_t total = st.data[off + 2] | (st.data[off + 3] << 8);
+    size_t got = st.actual_length - off;
+    if (total < 9 || total > this->store_.config_capacity() || total > MAX_CONTROL_IN_LENGTH) {
+      ESP_LOGW(USB_HOST_TAG, "Configuration descriptor wTotalLength %u is invalid or exceeds the %u byte limit",
+               (unsigned)total, (unsigned)std::min(this->store_.config_capacity(), MAX_CONTROL_IN_LENGTH));
+      f.state = ConfigFetchState::FAILED;
+      return;
+    }
+    if (got >= total) {
+      f.state = ConfigFetchState::DONE;
+      if (this->store_config(slot, st.data + off, total)) {
+        ESP_LOGI(USB_HOST_TAG, "Cached configuration descriptor (%u bytes)", (unsigned)total);
+      }
+      return;
+    }
+    if (want < total) {
+      // First read was shorter than wTotalLength; read exactly that now
+      f.total_len = (uint16_t)total;
+      this->start_config_read(slot);
+      return;
+    }
+    this->retry_config_read(slot, "short reply");
+  }
+
+  void retry_config_read(size_t slot, const char *reason) {
+    auto &f = this->config_fetch_[slot];
+    if (++f.attempts >= CONFIG_FETCH_ATTEMPTS) {
+      ESP_LOGW(USB_HOST_TAG, "Configuration descriptor fetch for client %u failed (%s)", (unsigned)slot, reason);
+      f.state = ConfigFetchState::FAILED;
+      return;
+    }
+    ESP_LOGD(USB_HOST_TAG, "Configuration descriptor fetch for client %u: %s, retrying", (unsigned)slot, reason);
+    f.state = ConfigFetchState::RETRY;
+    f.retry_at_ms = host_now_ms() + CONFIG_FETCH_RETRY_MS * f.attempts;
+  }
+
+  // Revalidate a restored record: re-read the device descriptor (VID, PID,
+  // bcdDevice, ...) and then the serial number string, and compare them
+  // with what the record holds
+  void start_verify(size_t slot) {
+    auto &v = this->verify_[slot];
+    uint8_t bmReq = esphome::usb_host::USB_DIR_IN | esphome::usb_host::USB_TYPE_STANDARD |
+                    esphome::usb_host::USB_RECIP_DEVICE;
+    bool ok;
+    if (v.state == VerifyState::DEVICE) {
+      ok = this->control_in(this->clients_[slot], bmReq, 0x06, 0x0100, 0, DescriptorStore::DEVICE_SIZE,
+                            [this, slot](const UsbTransferResult &res) { this->on_verify_device(slot, res); });
+    } else {
+      uint8_t serial = this->store_.device(slot)[16];
+      uint16_t langid = this->store_.langid(slot) ? this->store_.langid(slot) : LANGID_EN_US;
+      ok = this->control_in(this->clients_[slot], bmReq, 0x06, 0x0300 | serial, langid, 0xFF,
+                            [this, slot](const UsbTransferResult &res) { this->on_verify_serial(slot, res); });
+    }
+    v.in_flight = ok;
+    // Typically the device has not been enumerated yet
+    if (!ok) v.retry_at_ms = host_now_ms() + VERIFY_RETRY_MS;
+  }
+
+  void on_verify_device(size_t slot, const UsbTransferResult &res) {
+    auto &v = this->verify_[slot];
+    v.in_flight = false;
+    if (v.state != VerifyState::DEVICE) return;
+    if (res.status != USB_STATUS_OK || res.actual_length < DescriptorStore::DEVICE_SIZE) {
+      v.retry_at_ms = host_now_ms() + VERIFY_RETRY_MS;
+      return;
+    }
+    DescriptorView fresh{res.data, DescriptorStore::DEVICE_SIZE, true};
+    if (!same(this->store_.device(slot), fresh)) {
+      ESP_LOGI(USB_HOST_TAG, "Client %u: a different device is attached; dropping its saved descriptors",
+               (unsigned)slot);
+      this->drop_restored(slot);
+      // Keep what was just read; the rest is fetched again
+      this->store_device(this->clients_[slot], fresh);
+      return;
+    }
+    uint8_t serial = fresh[16];
+    uint16_t langid = this->store_.langid(slot) ? this->store_.langid(slot) : LANGID_EN_US;
+    if (serial != 0 && this->store_.string(slot, serial, langid).ready) {
+      v.state = VerifyState::SERIAL;
+      v.retry_at_ms = host_now_ms();
+      return;
+    }
+    v.state = VerifyState::NONE;
+    ESP_LOGD(USB_HOST_TAG, "Client %u: saved descriptors confirmed", (unsigned)slot);
+  }
+
+  void on_verify_serial(size_t slot, const UsbTransferResult &res) {
+    auto &v = this->verify_[slot];
+    v.in_flight = false;
+    if (v.state != VerifyState::SERIAL) return;
+    if (res.status != USB_STATUS_OK || res.actual_length < 2) {
+      v.retry_at_ms = host_now_ms() + VERIFY_RETRY_MS;
+      return;
+    }
+    uint8_t serial = this->store_.device(slot)[16];
+    uint16_t langid = this->store_.langid(slot) ? this->store_.langid(slot) : LANGID_EN_US;
+    DescriptorView fresh{res.data, std::min<size_t>(res.data[0], res.actual_length), true};
+    if (!same(this->store_.string(slot, serial, langid), fresh)) {
+      ESP_LOGI(USB_HOST_TAG, "Client %u: serial number changed; dropping its saved descriptors", (unsigned)slot);
+      this->drop_restored(slot);
+      return;
+    }
+    v.state = VerifyState::NONE;
+    ESP_LOGD(USB_HOST_TAG, "Client %u: saved descriptors confirmed", (unsigned)slot);
+  }
+
+  // Forget a restored record that does not match the attached device
+  void drop_restored(size_t slot) {
+    this->verify_[slot] = Verify{};
+    this->store_.clear(slot);
+    this->config_fetch_[slot] = ConfigFetch{};
+    this->changed(slot);
+  }
+
+  // Note what a completion says about the client's device; update_presence()
+  // acts on it from poll(), outside of any completion
+  void observe(void *client_ptr, int32_t status) {
+    size_t slot = this->slot_of(client_ptr);
+    if (slot >= this->presence_.size()) return;
+    auto &p = this->presence_[slot];
+    if (status == USB_STATUS_NODEV) {
+      p.gone = true;
+    } else if (status == USB_STATUS_OK || status == USB_STATUS_STALL || status == USB_STATUS_OVERFLOW) {
+      // The device answered, if only with a STALL
+      p.seen = true;
+      p.last_seen_ms = host_now_ms();
+    }
+  }
+
+  void update_presence(size_t slot, uint32_t now) {
+    auto &p = this->presence_[slot];
+    if (p.gone) {
+      p.gone = false;
+      p.seen = false;
+      if (p.state != Presence::DETACHED) this->detach(slot);
+    }
+    if (p.seen) {
+      p.seen = false;
+      p.failures = 0;
+      if (p.state != Presence::ATTACHED) this->attach(slot);
+    }
+    if (p.probing) {
+      if ((int32_t)(now - p.probe_at_ms) < 0) return;
+      p.probing = false;
+      this->probe_failed(slot, now, "no answer");
+      return;
+    }
+    // An attached device is only probed once it has been quiet for a while
+    uint32_t due = p.probe_at_ms;
+    if (p.state == Presence::ATTACHED && (int32_t)(p.last_seen_ms + PRESENCE_PROBE_MS - due) > 0)
+      due = p.last_seen_ms + PRESENCE_PROBE_MS;
+    if ((int32_t)(now - due) >= 0) this->start_probe(slot, now);
+  }
+
+  // GET_STATUS to an attached device, GET_DESCRIPTOR(DEVICE) to one that is
+  // not (yet); both are standard requests without side effects
+  void start_probe(size_t slot, uint32_t now) {
+    auto &p = this->presence_[slot];
+    if (this->requests_in_use_[slot] >= esphome::usb_host::MAX_REQUESTS) {
+      // Every request slot is taken by transfers still in flight; that is
+      // not an unanswered probe
+      p.probe_at_ms = now + PRESENCE_PROBE_MS;
+      return;
+    }
+    uint8_t seq = ++p.probe_seq;
+    uint8_t bmReq = esphome::usb_host::USB_DIR_IN | esphome::usb_host::USB_TYPE_STANDARD |
+                    esphome::usb_host::USB_RECIP_DEVICE;
+    bool attached = p.state == Presence::ATTACHED;
+    auto cb = [this, slot, seq](const UsbTransferResult &res) {
+      auto &q = this->presence_[slot];
+      if (!q.probing || q.probe_seq != seq) return;
+      q.probing = false;
+      // observe() already noted an answer or a NO_DEVICE
+      if (res.status != USB_STATUS_OK && res.status != USB_STATUS_STALL && res.status != USB_STATUS_NODEV)
+        this->probe_failed(slot, host_now_ms(), "transfer failed");
+    };
+    bool ok = attached ? this->control_in(this->clients_[slot], bmReq, 0x00, 0, 0, 2, cb)
+                       : this->control_in(this->clients_[slot], bmReq, 0x06, 0x0100, 0, DescriptorStore::DEVICE_SIZE, cb);
+    p.probe_at_ms = now + (ok ? PRESENCE_PROBE_TIMEOUT_MS : PRESENCE_PROBE_MS);
+    if (ok) {
+      p.probing = true;
+    } else {
+      // USBClient refuses requests while no device is open
+      this->probe_failed(slot, now, "refused");
+    }
+  }
+
+  void probe_failed(size_t slot, uint32_t now, const char *reason) {
+    auto &p = this->presence_[slot];
+    p.probe_at_ms = now + PRESENCE_PROBE_MS;
+    if (p.state == Presence::DETACHED) return;
+    // Right after boot the host stack may still be enumerating the device
+    uint8_t limit = p.state == Presence::UNKNOWN ? PRESENCE_BOOT_FAILURES : PRESENCE_FAILURES;
+    if (++p.failures < limit) return;
+    ESP_LOGD(USB_HOST_TAG, "Client %u: presence probe %s", (unsigned)slot, reason);
+    this->detach(slot);
+  }
+
+  void attach(size_t slot) {
+    auto &p = this->presence_[slot];
+    bool was_detached = p.state == Presence::DETACHED;
+    p.state = Presence::ATTACHED;
+    p.probe_at_ms = host_now_ms() + PRESENCE_PROBE_MS;
+    ESP_LOGI(USB_HOST_TAG, "Client %u: device attached", (unsigned)slot);
+    if (was_detached) this->notify_device(this->clients_[slot], true);
+  }
+
+  // The device is gone: nothing the host stack holds for it will complete,
+  // so answer it all now, and forget its descriptors
+  void detach(size_t slot) {
+    void *client = this->clients_[slot];
+    ESP_LOGI(USB_HOST_TAG, "Client %u: device detached", (unsigned)slot);
+    UsbTransferResult gone;
+    gone.status = USB_STATUS_NODEV;
+    this->control_.fail_client(client, gone);
+    this->tracker_.fail_client(client, USB_STATUS_NODEV);
+    // Reset after failing: the fetches' completions schedule retries
+    auto &p = this->presence_[slot];
+    p = PresenceState{};
+    p.state = Presence::DETACHED;
+    p.probe_at_ms = host_now_ms() + PRESENCE_PROBE_MS;
+    this->verify_[slot] = Verify{};
+    this->config_fetch_[slot] = ConfigFetch{};
+    this->store_.clear(slot);
+    this->changed(slot);
+    this->notify_device(client, false);
+  }
+
+  // A cached descriptor of 'slot' was added, replaced or dropped
+  void changed(size_t slot) {
+    this->generation_++;
+    if (slot < this->slot_generation_.size()) this->slot_generation_[slot]++;
+  }
+
+  bool store_config(size_t slot, const uint8_t *data, size_t len) {
+    DescriptorView cached = this->store_.config(slot);
+    if (cached.ready && cached.size() == len && std::equal(data, data + len, cached.begin())) return false;
+    if (!this->store_.set_config(slot, data, len)) return false;
+    this->changed(slot);
+    return true;
+  }
+
+  bool store_string(void *client_ptr, int index, uint16_t langid, const DescriptorView &v) {
+    size_t slot = this->slot_of(client_ptr);
+    if (same(this->store_.string(slot, index, langid), v)) return false;
+    if (!this->store_.set_string(slot, index, langid, v.data, v.len)) {
+      ESP_LOGW(USB_HOST_TAG, "String descriptor %d (%u bytes) does not fit the descriptor cache", index,
+               (unsigned)v.size());
+      return false;
+    }
+    this->changed(slot);
+    return true;
+  }
+
+  // Largest control IN data stage requested from the host stack
+  static constexpr size_t MAX_CONTROL_IN_LENGTH = 512;
+  // Used for string requests when the device has no LANGID table
+  static constexpr uint16_t LANGID_EN_US = 0x0409;
+  static const uint8_t CONFIG_FETCH_ATTEMPTS = 5;
+  static const uint32_t CONFIG_FETCH_RETRY_MS = 100;
+
+  enum class ConfigFetchState : uint8_t { IDLE, READING, RETRY, DONE, FAILED };
+  // Configuration descriptor fetch progress per client slot
+  struct ConfigFetch {
+    ConfigFetchState state{ConfigFetchState::IDLE};
+    // Tags the transfer currently in flight
+    uint8_t seq{0};
+    uint8_t attempts{0};
+    // wTotalLength once the first read revealed it to be longer than read
+    uint16_t total_len{0};
+    uint32_t retry_at_ms{0};
+  };
+  std::vector<ConfigFetch> config_fetch_{};
+
+  static const uint32_t VERIFY_RETRY_MS = 1000;
+  enum class VerifyState : uint8_t { NONE, DEVICE, SERIAL };
+  // Revalidation of a restored record per client slot (see
+  // restore_descriptors())
+  struct Verify {
+    VerifyState state{VerifyState::NONE};
+    bool in_flight{false};
+    uint32_t retry_at_ms{0};
+  };
+  std::vector<Verify> verify_{};
+
+  // Presence of the device behind each client slot. USBClient tells no one
+  // else when its device comes or goes, so it is inferred: a completion
+  // with NO_DEVICE, or probes going unanswered, mean it went away; any
+  // answer means it is there. An attached device is probed only after
+  // PRESENCE_PROBE_MS without a completion.
+  static const uint32_t PRESENCE_PROBE_MS = 1000;
+  static const uint32_t PRESENCE_PROBE_TIMEOUT_MS = 500;
+  static const uint8_t PRESENCE_FAILURES = 2;
+  static const uint8_t PRESENCE_BOOT_FAILURES = 5;
+  enum class Presence : uint8_t { UNKNOWN, ATTACHED, DETACHED };
+  struct PresenceState {
+    Presence state{Presence::UNKNOWN};
+    // Noted by observe(), handled in poll()
+    bool seen{false};
+    bool gone{false};
+    bool probing{false};
+    // Tags the probe in flight
+    uint8_t probe_seq{0};
+    uint8_t failures{0};
+    uint32_t last_seen_ms{0};
+    // Next probe, or the deadline of the one in flight
+    uint32_t probe_at_ms{0};
   };
+  std::vector<PresenceState> presence_{};
 
-  std::unordered_map<void *, DescriptorSet> desc_cache_{};
+  // Exported clients in registration order (see register_clients())
+  std::vector<void *> clients_{};
+  DescriptorStore store_{};
+  // Bumped on every store_ update (see descriptor_generation()), in total
+  // and per client slot
+  uint32_t generation_{0};
+  std::vector<uint32_t> slot_generation_{};
+  TransferTracker tracker_{};
+  // USBClient request slots held per client slot (see claim_request())
+  std::vector<uint8_t> requests_in_use_{};
+  // Oversized transfers to complete with -EINVAL on the next poll(); see
+  // reject()
+  std::vector<transfer_handle_t> rejected_{};
+  // Control requests in flight, shared by identical requests
+  ControlRequestManager control_{};
  protected:
   esphome::usb_host::USBHost *host_{nullptr};
 };
@@ -0,0 +1,151 @@
+#include "in_stream.h"
+#include <cstring>
+
+namespace esphome {
+namespace usbip {
+
+void InStream::start(USBHostAdapter *host, void *client, uint8_t endpoint, TransferType type, size_t transfer_length,
+                     uint8_t depth, uint32_t interval_ms, deliver_t deliver) {
+  this->stop();
+  this->host_ = host;
+  this->client_ = client;
+  this->endpoint_ = endpoint;
+  this->type_ = type;
+  this->transfer_length_ = transfer_length;
+  this->interval_ms_ = interval_ms;
+  this->depth_ = depth > MAX_DEPTH ? MAX_DEPTH : depth;
+  this->deliver_ = std::move(deliver);
+  this->arm();
+}
+
+void InStream::stop() {
+  // Bump the generation first: cancelling may run the completions right away
+  this->generation_++;
+  if (this->host_ != nullptr) {
+    for (auto &h : this->handles_) {
+      if (h != INVALID_TRANSFER) this->host_->cancel_transfer(h);
+    }
+  }
+  for (auto &h : this->handles_) h = INVALID_TRANSFER;
+  for (auto &c : this->completed_) {
+    if (this->pool_ != nullptr) {
+      this->pool_->give(std::move(c.data));
+    } else {
+      c.data.clear();
+    }
+  }
+  this->in_flight_ = 0;
+  this->completed_head_ = 0;
+  this->completed_count_ = 0;
+  this->pending_.clear();
+  this->halted_ = false;
+  this->holdoff_ = false;
+  this->host_ = nullptr;
+}
+
+void InStream::fail(int32_t status) {
+  // Delivering may queue and flush replies, but never touches the stream
+  std::deque<PendingUrb> pending;
+  pending.swap(this->pending_);
+  for (const auto &urb : pending) this->deliver_(urb.seqnum, urb.tag, status, std::vector<uint8_t>(), host_now_us());
+  this->stop();
+}
+
+void InStream::submit(uint32_t seqnum, size_t length, uint32_t tag) {
+  this->pending_.push_back(PendingUrb{seqnum, tag, length});
+  this->match();
+  this->arm();
+}
+
+bool InStream::unlink(uint32_t seqnum) {
+  for (auto it = this->pending_.begin(); it != this->pending_.end(); ++it) {
+    if (it->seqnum == seqnum) {
+      this->pending_.erase(it);
+      return true;
+    }
+  }
+  return false;
+}
+
+void InStream::poll(uint32_t now_ms) {
+  if (this->holdoff_ && (int32_t)(now_ms - this->holdoff_until_ms_) >= 0) this->arm();
+}
+
+void InStream::arm() {
+  if (this->host_ == nullptr) return;
+  if (this->halted_) {
+    // Resume once the failure was handed out and the client still asks
+    if (this->in_flight_ != 0 || this->completed_count_ != 0 || this->pending_.empty()) return;
+    this->halted_ = false;
+  }
+  if (this->holdoff_) {
+    if ((int32_t)(host_now_ms() - this->holdoff_until_ms_) < 0) return;
+    this->holdoff_ = false;
+  }
+  UsbTransfer xfer;
+  xfer.type = this->type_;
+  xfer.endpoint = this->endpoint_;
+  xfer.length = this->transfer_length_;
+  for (uint8_t i = 0; i < this->depth_ && this->in_flight_ + this->completed_count_ < this->depth_; ++i) {
+    if (this->handles_[i] != INVALID_TRANSFER) continue;
+    uint32_t gen = this->generation_;
+    transfer_handle_t h = this->host_->submit_transfer(this->client_, xfer, [this, i, gen](const UsbTransferResult &res) {
+      if (gen == this->generation_) this->on_complete(i, res);
+    });
+    // The adapter is out of room; try again on the next submit or completion
+    if (h == INVALID_TRANSFER) break;
+    this->handles_[i] = h;
+    this->in_flight_++;
+  }
+}
+
+void InStream::on_complete(uint8_t index, const UsbTransferResult &res) {
+  this->handles_[index] = INVALID_TRANSFER;
+  this->in_flight_--;
+  Completion &c = this->completed_[(this->completed_head_ + this->completed_count_) % MAX_DEPTH];
+  c.status = res.status;
+  c.ready_us = host_now_us();
+  if (res.data != nullptr && res.actual_length > 0) {
+    if (this->pool_ != nullptr) {
+      c.data = this->pool_->take(res.actual_length);
+      memcpy(c.data.data(), res.data, res.actual_length);
+    } else {
+      c.data.assign(res.data, res.data + res.actual_length);
+    }
+  } else {
+    c.data.clear();
+  }
+  this->completed_count_++;
+  if (res.status != USB_STATUS_OK) {
+    this->halted_ = true;
+  } else if (res.actual_length == 0 && this->type_ == TransferType::INTERRUPT) {
+    // Nothing to report this time; poll again after bInterval
+    this->holdoff_ = true;
+    this->holdoff_until_ms_ = host_now_ms() + this->interval_ms_;
+  }
+  this->match();
+  this->arm();
+}
+
+void InStream::match() {
+  while (this->completed_count_ > 0 && !this->pending_.empty()) {
+    Completion &c = this->completed_[this->completed_head_];
+    PendingUrb urb = this->pending_.front();
+    this->pending_.pop_front();
+    int32_t status = c.status;
+    if (c.data.size() > urb.length) {
+      // The transfer read more than this CMD_SUBMIT has room for (babble)
+      status = USB_STATUS_OVERFLOW;
+      c.data.resize(urb.length);
+    }
+    std::vector<uint8_t> data = std::move(c.data);
+    uint32_t ready_us = c.ready_us;
+    c.data.clear();
+    this->completed_head_ = (uint8_t)((this->completed_head_ + 1) % MAX_DEPTH);
+    this->completed_count_--;
+    this->deliver_(urb.seqnum, urb.tag, status, std::move(data), ready_us);
+  }
+}
+
+}  // namespace usbip
+}  // namespace esphome
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "usb_host.h"
+#include "buffer_pool.h"
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <vector>
+
+namespace esphome {
+namespace usbip {
+
+// Transfers kept queued on one bulk or interrupt IN endpoint. Instead of
+// issuing one host transfer per CMD_SUBMIT after the client asked for it,
+// the stream keeps 'depth' transfers queued on the host adapter so the
+// device is read while the previous data is still on its way over the
+// network. Completed transfers are handed to the client's CMD_SUBMITs in
+// order; at most 'depth' transfers are in flight or waiting for a
+// CMD_SUBMIT, so the device is never read further ahead than that.
+//
+// Bulk streaming is meant for devices that stream (serial adapters,
+// sniffers); a device that expects a bulk IN request only after a command
+// may see it early. Interrupt endpoints (HID) are polled this way so a
+// report is answered the moment it arrives. The host controller polls at
+// the endpoint's bInterval while a transfer is queued; a transfer that
+// completes without data is re-queued no earlier than 'interval_ms' later.
+class InStream {
+ public:
+  static const uint8_t MAX_DEPTH = 8;
+
+  // Answer the CMD_SUBMIT 'seqnum' that was queued with 'tag'. 'ready_us'
+  // is when the host stack delivered the data (host_now_us()).
+  using deliver_t = std::function<void(uint32_t seqnum, uint32_t tag, int32_t status, std::vector<uint8_t> &&data,
+                                       uint32_t ready_us)>;
+
+  // Start reading 'endpoint' (with the 0x80 bit) of 'client' with host
+  // transfers of 'transfer_length' bytes
+  void start(USBHostAdapter *host, void *client, uint8_t endpoint, TransferType type, size_t transfer_length,
+             uint8_t depth, uint32_t interval_ms, deliver_t deliver);
+  // Cancel the queued host transfers and forget pending CMD_SUBMITs
+  void stop();
+  // Answer every pending CMD_SUBMIT with 'status' (no data), then stop()
+  void fail(int32_t status);
+  // Take completion buffers from 'pool'; the data passed to 'deliver' then
+  // belongs to it
+  void set_pool(BufferPool *pool) { this->pool_ = pool; }
+  bool active() const { return this->host_ != nullptr; }
+  uint8_t endpoint() const { return this->endpoint_; }
+  TransferType type() const { return this->type_; }
+  size_t in_flight() const { return this->in_flight_; }
+
+  // Queue a CMD_SUBMIT of up to 'length' bytes; answered through 'deliver'
+  void submit(uint32_t seqnum, size_t length, uint32_t tag);
+  // Drop a queued CMD_SUBMIT. False if it is not queued (already answered
+  // or unknown).
+  bool unlink(uint32_t seqnum);
+  // Re-queue transfers held back by the polling interval
+  void poll(uint32_t now_ms);
+
+ protected:
+  struct PendingUrb {
+    uint32_t seqnum;
+    uint32_t tag;
+    size_t length;
+  };
+  struct Completion {
+    int32_t status;
+    uint32_t ready_us;
+    std::vector<uint8_t> data;
+  };
+
+  void on_complete(uint8_t index, const UsbTransferResult &res);
+  // Keep 'depth' transfers queued or buffered
+  void arm();
+  // Pair buffered completions with queued CMD_SUBMITs
+  void match();
+
+  USBHostAdapter *host_{nullptr};
+  BufferPool *pool_{nullptr};
+  void *client_{nullptr};
+  uint8_t endpoint_{0};
+  TransferType type_{TransferType::BULK};
+  uint8_t depth_{0};
+  size_t transfer_length_{0};
+  uint32_t interval_ms_{0};
+  deliver_t deliver_{};
+  // Invalidates completions of transfers queued before the last stop()
+  uint32_t generation_{0};
+  // A transfer failed; stop queueing new ones until the client asks again
+  bool halted_{false};
+  // An empty completion holds re-queueing back until this time (ms)
+  bool holdoff_{false};
+  uint32_t holdoff_until_ms_{0};
+
+  transfer_handle_t handles_[MAX_DEPTH]{};
+  size_t in_flight_{0};
+  // Completions in the order the host stack reported them (ring)
+  Completion completed_[MAX_DEPTH]{};
+  uint8_t completed_head_{0};
+  uint8_t completed_count_{0};
+  std::deque<PendingUrb> pending_{};
+};
+
+}  // namespace usbip
+}  // namespace esphome
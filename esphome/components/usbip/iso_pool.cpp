@@ -0,0 +1,73 @@
+#include "iso_pool.h"
+#include "usbip_protocol.h"
+
+namespace esphome {
+namespace usbip {
+
+// seal() rewrites each packet as a wire descriptor in the same memory
+static_assert(sizeof(UsbIsoPacket) == USBIP_ISO_DESC_SIZE, "UsbIsoPacket must match usbip_iso_packet_descriptor");
+
+void IsoUrbPool::allocate() {
+  if (this->urbs_ == nullptr) this->urbs_.reset(new Urb[MAX_URBS]);
+}
+
+void IsoUrbPool::release(USBHostAdapter *host) {
+  if (this->urbs_ == nullptr) return;
+  for (size_t i = 0; i < MAX_URBS; ++i) {
+    Urb &u = this->urbs_[i];
+    // Cancelling runs the completion at once; the caller has already made
+    // sure it is ignored
+    if (u.busy && host != nullptr) host->cancel_transfer(u.handle);
+  }
+  this->urbs_.reset();
+}
+
+size_t IsoUrbPool::memory_usage() const {
+  if (this->urbs_ == nullptr) return 0;
+  size_t n = MAX_URBS * sizeof(Urb);
+  for (size_t i = 0; i < MAX_URBS; ++i) n += this->urbs_[i].buffer.capacity();
+  return n;
+}
+
+IsoUrbPool::Urb *IsoUrbPool::acquire(uint32_t tx_retired) {
+  if (this->urbs_ == nullptr) return nullptr;
+  for (size_t i = 0; i < MAX_URBS; ++i) {
+    Urb &u = this->urbs_[i];
+    if (u.busy) continue;
+    if (u.sending && (int32_t)(tx_retired - u.release_at) < 0) continue;
+    u.sending = false;
+    return &u;
+  }
+  return nullptr;
+}
+
+bool IsoUrbPool::load(Urb &urb, const uint8_t *desc, size_t num_packets, size_t length) {
+  if (num_packets == 0 || num_packets > MAX_PACKETS) return false;
+  for (size_t i = 0; i < num_packets; ++i) {
+    const uint8_t *d = desc + i * USBIP_ISO_DESC_SIZE;
+    UsbIsoPacket &p = urb.packets[i];
+    p.offset = get_be32(d);
+    p.length = get_be32(d + 4);
+    p.actual_length = 0;
+    p.status = 0;
+    if (p.offset > length || p.length > length - p.offset) return false;
+  }
+  urb.num_packets = (uint16_t)num_packets;
+  urb.buffer.resize(length);
+  return true;
+}
+
+const uint8_t *IsoUrbPool::seal(Urb &urb) {
+  for (size_t i = 0; i < urb.num_packets; ++i) {
+    UsbIsoPacket p = urb.packets[i];
+    uint8_t *d = reinterpret_cast<uint8_t *>(&urb.packets[i]);
+    put_be32(d, p.offset);
+    put_be32(d + 4, p.length);
+    put_be32(d + 8, p.actual_length);
+    put_be32(d + 12, (uint32_t)p.status);
+  }
+  return reinterpret_cast<const uint8_t *>(urb.packets);
+}
+
+}  // namespace usbip
+}  // namespace esphome
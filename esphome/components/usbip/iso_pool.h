@@ -0,0 +1,70 @@
+#pragma once
+
+#include "usb_host.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace esphome {
+namespace usbip {
+
+// Preallocated state of the isochronous URBs of one connection. Every slot
+// holds the packet array the host adapter fills in and the URB's data
+// buffer, so an isochronous URB is submitted, completed and answered
+// without allocating: the adapter writes IN data straight into the slot's
+// buffer, the reply is sent from there, and the packet array is turned in
+// place into the RET_SUBMIT's iso descriptor trailer. A slot is reused once
+// the connection's TxQueue has written (or dropped) everything that points
+// into it.
+class IsoUrbPool {
+ public:
+  // Isochronous URBs in flight per connection. Audio class drivers keep
+  // around 8-12 queued, video class drivers about 5.
+  static const size_t MAX_URBS = 12;
+  // Packets per URB (one per 1 ms frame at full speed)
+  static const size_t MAX_PACKETS = 32;
+
+  struct Urb {
+    uint32_t seqnum{0};
+    transfer_handle_t handle{INVALID_TRANSFER};
+    bool in{false};
+    // Host transfer outstanding
+    bool busy{false};
+    // A reply pointing into this slot was queued; the slot is free again
+    // once TxQueue::retired() passes 'release_at' (TxQueue::end() after it)
+    bool sending{false};
+    uint32_t release_at{0};
+    uint16_t num_packets{0};
+    UsbIsoPacket packets[MAX_PACKETS];
+    // Grows to the largest URB seen and keeps its capacity
+    std::vector<uint8_t> buffer;
+  };
+
+  // Allocate the slots (on a connection's first isochronous URB)
+  void allocate();
+  // Cancel outstanding transfers and free the slots
+  void release(USBHostAdapter *host);
+  bool allocated() const { return this->urbs_ != nullptr; }
+  size_t memory_usage() const;
+
+  // A slot that is neither in flight nor referenced by queued TX data, given
+  // the connection's TxQueue::retired(); nullptr if all are in use
+  Urb *acquire(uint32_t tx_retired);
+  Urb &at(size_t index) { return this->urbs_[index]; }
+  size_t index_of(const Urb &urb) const { return (size_t)(&urb - this->urbs_.get()); }
+
+  // Fill 'urb' from the 'num_packets' wire iso descriptors at 'desc' of a
+  // CMD_SUBMIT with 'length' bytes of transfer buffer. False if a packet
+  // lies outside the buffer.
+  static bool load(Urb &urb, const uint8_t *desc, size_t num_packets, size_t length);
+  // Convert the completed packet array in place to wire iso descriptors and
+  // return them (num_packets * USBIP_ISO_DESC_SIZE bytes)
+  static const uint8_t *seal(Urb &urb);
+
+ protected:
+  std::unique_ptr<Urb[]> urbs_{};
+};
+
+}  // namespace usbip
+}  // namespace esphome
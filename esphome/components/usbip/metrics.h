@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace esphome {
+namespace usbip {
+
+// Histogram with fixed power-of-two buckets. Bucket 0 counts zero samples,
+// bucket i (i > 0) counts samples in [2^(i-1), 2^i); the last bucket is open
+// ended. Recording is a handful of integer operations and never allocates,
+// so it can be used on the hot path.
+class Histogram {
+ public:
+  static const size_t BUCKETS = 16;
+
+  void record(uint32_t value) {
+    size_t b = value == 0 ? 0 : 32 - __builtin_clz(value);
+    if (b >= BUCKETS) b = BUCKETS - 1;
+    this->buckets_[b]++;
+    this->count_++;
+    this->sum_ += value;
+    if (value > this->max_) this->max_ = value;
+  }
+
+  uint32_t count() const { return this->count_; }
+  uint64_t sum() const { return this->sum_; }
+  uint32_t max() const { return this->max_; }
+  uint32_t bucket(size_t i) const { return this->buckets_[i]; }
+
+  // Upper bound of the bucket holding the q-quantile (0 < q <= 1) of all
+  // samples so far; 0 without samples
+  uint32_t quantile_bound(float q) const {
+    if (this->count_ == 0) return 0;
+    uint32_t target = (uint32_t)(q * (float)this->count_);
+    if (target == 0) target = 1;
+    uint32_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; ++i) {
+      seen += this->buckets_[i];
+      if (seen >= target) return i == BUCKETS - 1 ? this->max_ : (i == 0 ? 0 : (1u << i) - 1);
+    }
+    return this->max_;
+  }
+
+  // Start a new maximum (e.g. at every metrics publish)
+  void reset_max() { this->max_ = 0; }
+
+ protected:
+  uint32_t buckets_[BUCKETS]{};
+  uint32_t count_{0};
+  uint64_t sum_{0};
+  uint32_t max_{0};
+};
+
+// Runtime counters of a USBIPComponent. Everything is cumulative since boot
+// except the histogram maxima, which restart at every metrics publish.
+struct UsbipMetrics {
+  // loop() duration (us)
+  Histogram loop_us{};
+  uint64_t rx_bytes{0};
+  uint64_t tx_bytes{0};
+  // sendmsg() calls that found the socket buffer full
+  uint32_t tx_eagain{0};
+  // sendmsg() calls that took only part of what was offered
+  uint32_t tx_short_writes{0};
+  uint32_t connections_accepted{0};
+  uint32_t urbs_submitted{0};
+  // GET_DESCRIPTOR URBs answered from the adapter's descriptor cache
+  uint32_t urbs_from_cache{0};
+  // CMD_SUBMIT received to RET_SUBMIT queued (us)
+  Histogram urb_rtt_us{};
+  // Interrupt IN data delivered by the host stack to RET_SUBMIT handed to
+  // the socket (us)
+  Histogram interrupt_latency_us{};
+};
+
+}  // namespace usbip
+}  // namespace esphome
@@ -0,0 +1,359 @@
+#include "net_task.h"
+#include "esphome/core/log.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <cstring>
+
+namespace esphome {
+namespace usbip {
+
+static const char *TAG = "usbip.net";
+
+// Bounds of the adaptive per-connection recv() size (as in the main loop)
+static const size_t RX_CHUNK_MIN = 512;
+static const size_t RX_CHUNK_MAX = 8192;
+// poll() timeout; wake() normally ends the wait much earlier
+static const int POLL_TIMEOUT_MS = 100;
+#ifdef ESP_PLATFORM
+static const uint32_t TASK_STACK_SIZE = 4096;
+#endif
+
+static void set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags >= 0) fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Non-blocking UDP socket on the loopback interface that sends to itself
+static int open_wake_socket() {
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0) return -1;
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  socklen_t len = sizeof(addr);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || getsockname(fd, (struct sockaddr *)&addr, &len) < 0 ||
+      connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  set_nonblocking(fd);
+  return fd;
+}
+
+void apply_socket_options(int fd, const SocketOptions &options) {
+  int nodelay = options.nodelay ? 1 : 0;
+  if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) < 0) {
+    ESP_LOGD(TAG, "TCP_NODELAY not set: %d", errno);
+  }
+  if (options.send_buffer != 0) {
+    int size = (int)options.send_buffer;
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) < 0) ESP_LOGD(TAG, "SO_SNDBUF not set: %d", errno);
+  }
+  if (options.receive_buffer != 0) {
+    int size = (int)options.receive_buffer;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0) ESP_LOGD(TAG, "SO_RCVBUF not set: %d", errno);
+  }
+}
+
+bool NetTask::start(int listen_fd, size_t max_connections, int8_t core, uint8_t priority) {
+  if (this->running()) return true;
+  this->wake_fd_ = open_wake_socket();
+  if (this->wake_fd_ < 0) {
+    ESP_LOGE(TAG, "Cannot create wake-up socket: %d", errno);
+    return false;
+  }
+  this->max_connections_ = max_connections;
+  this->conns_.reset(new NetConn[max_connections]);
+  this->close_epoch_.reset(new std::atomic<uint32_t>[max_connections]);
+  for (size_t i = 0; i < max_connections; ++i) this->close_epoch_[i].store(0);
+  // Wake-up socket, listening socket and one per connection
+  this->pollfds_.resize(max_connections + 2);
+  this->listen_fd_ = listen_fd;
+  this->running_.store(true, std::memory_order_release);
+
+#ifdef ESP_PLATFORM
+  this->exited_.store(false);
+  BaseType_t affinity = core < 0 ? tskNO_AFFINITY : (BaseType_t)core;
+  if (xTaskCreatePinnedToCore(&NetTask::task_entry, "usbip_net", TASK_STACK_SIZE, this, priority, &this->task_,
+                              affinity) != pdPASS) {
+    ESP_LOGE(TAG, "Cannot create network task");
+    this->running_.store(false);
+    this->listen_fd_ = -1;
+    ::close(this->wake_fd_);
+    this->wake_fd_ = -1;
+    return false;
+  }
+#else
+  (void)core;
+  (void)priority;
+  this->thread_ = std::thread([this]() { this->run(); });
+#endif
+  return true;
+}
+
+#ifdef ESP_PLATFORM
+void NetTask::task_entry(void *arg) {
+  auto *self = static_cast<NetTask *>(arg);
+  self->run();
+  self->exited_.store(true, std::memory_order_release);
+  vTaskDelete(nullptr);
+}
+#endif
+
+void NetTask::stop() {
+  if (!this->running_.exchange(false)) return;
+  this->wake();
+#ifdef ESP_PLATFORM
+  while (!this->exited_.load(std::memory_order_acquire)) vTaskDelay(1);
+  this->task_ = nullptr;
+#else
+  if (this->thread_.joinable()) this->thread_.join();
+#endif
+  for (size_t i = 0; i < this->max_connections_; ++i) {
+    if (this->conns_[i].fd >= 0) ::close(this->conns_[i].fd);
+    this->conns_[i] = NetConn{};
+  }
+  if (this->listen_fd_ >= 0) ::close(this->listen_fd_);
+  this->listen_fd_ = -1;
+  if (this->wake_fd_ >= 0) ::close(this->wake_fd_);
+  this->wake_fd_ = -1;
+}
+
+bool NetTask::pop_event(Event &event) { return this->events_.pop(event); }
+
+bool NetTask::send(uint8_t slot, uint32_t epoch, TxQueue &&data) {
+  Command cmd;
+  cmd.slot = slot;
+  cmd.epoch = epoch;
+  cmd.data = std::move(data);
+  return this->commands_.push(std::move(cmd));
+}
+
+bool NetTask::set_socket_options(uint8_t slot, uint32_t epoch, const SocketOptions &options) {
+  Command cmd;
+  cmd.type = Command::Type::SOCKET_OPTIONS;
+  cmd.slot = slot;
+  cmd.epoch = epoch;
+  cmd.options = options;
+  return this->commands_.push(std::move(cmd));
+}
+
+void NetTask::close(uint8_t slot, uint32_t epoch) {
+  if (slot >= this->max_connections_) return;
+  this->close_epoch_[slot].store(epoch, std::memory_order_release);
+}
+
+void NetTask::wake() {
+  if (this->wake_fd_ < 0) return;
+  uint8_t b = 0;
+  ::send(this->wake_fd_, &b, 1, 0);
+}
+
+void NetTask::run() {
+  ESP_LOGD(TAG, "Network task running");
+  while (this->running_.load(std::memory_order_acquire)) {
+    this->service();
+    for (size_t i = 0; i < this->max_connections_; ++i) {
+      NetConn &c = this->conns_[i];
+      if (c.fd >= 0 && !c.tx_blocked && !c.tx.empty()) this->flush(i);
+    }
+
+    // pollfds_[0] is the wake-up socket, [1] the listener, then one per
+    // open connection. Connections are not read while the event ring is
+    // full; the main loop wakes the task once it has made room.
+    bool room = this->events_.space() > 0;
+    size_t nfds = 0;
+    this->pollfds_[nfds++] = {this->wake_fd_, POLLIN, 0};
+    this->pollfds_[nfds++] = {room ? this->listen_fd_ : -1, POLLIN, 0};
+    for (size_t i = 0; i < this->max_connections_; ++i) {
+      NetConn &c = this->conns_[i];
+      short events = (room ? POLLIN : 0) | (c.tx_blocked ? POLLOUT : 0);
+      this->pollfds_[nfds++] = {c.fd >= 0 && events != 0 ? c.fd : -1, events, 0};
+    }
+    if (!room) this->starved_.store(true, std::memory_order_release);
+    int ready = ::poll(this->pollfds_.data(), nfds, POLL_TIMEOUT_MS);
+    if (ready < 0 && errno != EINTR) ESP_LOGD(TAG, "poll() failed: %d", errno);
+    if (ready <= 0) continue;
+
+    if (this->pollfds_[0].revents & POLLIN) {
+      uint8_t buf[16];
+      while (recv(this->wake_fd_, buf, sizeof(buf), 0) > 0) {
+      }
+    }
+    if (this->pollfds_[1].revents & POLLIN) this->accept_client();
+    for (size_t i = 0; i < this->max_connections_; ++i) {
+      NetConn &c = this->conns_[i];
+      short revents = this->pollfds_[i + 2].revents;
+      if (c.fd < 0 || revents == 0) continue;
+      if (revents & POLLOUT) c.tx_blocked = false;
+      if (!(revents & (POLLIN | POLLERR | POLLHUP))) continue;
+      while (this->receive(i)) {
+      }
+    }
+  }
+  ESP_LOGD(TAG, "Network task stopped");
+}
+
+void NetTask::service() {
+  for (size_t i = 0; i < this->max_connections_; ++i) {
+    NetConn &c = this->conns_[i];
+    if (c.fd >= 0 && this->close_epoch_[i].load(std::memory_order_acquire) == c.epoch) this->drop(i, false);
+  }
+  while (this->commands_.pop(this->command_)) {
+    Command &cmd = this->command_;
+    if (cmd.slot < this->max_connections_) {
+      NetConn &c = this->conns_[cmd.slot];
+      // Commands for a connection that has gone are dropped
+      if (c.fd >= 0 && c.epoch == cmd.epoch) {
+        if (cmd.type == Command::Type::SOCKET_OPTIONS) {
+          apply_socket_options(c.fd, cmd.options);
+        } else {
+          c.tx.append(std::move(cmd.data));
+        }
+      }
+    }
+    cmd.data.clear();
+  }
+  for (size_t i = 0; i < this->max_connections_; ++i) {
+    NetConn &c = this->conns_[i];
+    if (!c.notify_closed) continue;
+    Event ev;
+    ev.type = Event::Type::CLOSED;
+    ev.slot = (uint8_t)i;
+    ev.epoch = c.epoch;
+    if (this->events_.push(std::move(ev))) c.notify_closed = false;
+  }
+}
+
+void NetTask::accept_client() {
+  struct sockaddr_in client_addr;
+  socklen_t client_len = sizeof(client_addr);
+  int fd = accept(this->listen_fd_, (struct sockaddr *)&client_addr, &client_len);
+  if (fd < 0) {
+    if (errno != EWOULDBLOCK && errno != EAGAIN) ESP_LOGD(TAG, "accept() returned %d (errno=%d)", fd, errno);
+    return;
+  }
+  size_t slot = this->max_connections_;
+  for (size_t i = 0; i < this->max_connections_; ++i) {
+    if (this->conns_[i].fd < 0 && !this->conns_[i].notify_closed) {
+      slot = i;
+      break;
+    }
+  }
+  if (slot == this->max_connections_) {
+    ESP_LOGW(TAG, "Rejecting client %s:%u: all %u connections in use", inet_ntoa(client_addr.sin_addr),
+             ntohs(client_addr.sin_port), (unsigned)this->max_connections_);
+    ::close(fd);
+    return;
+  }
+  set_nonblocking(fd);
+  NetConn &c = this->conns_[slot];
+  c.fd = fd;
+  // Epoch 0 marks "no connection" in close requests
+  if (++this->next_epoch_ == 0) ++this->next_epoch_;
+  c.epoch = this->next_epoch_;
+  c.rx_chunk = RX_CHUNK_MIN;
+  this->counters_.accepted.fetch_add(1, std::memory_order_relaxed);
+
+  // The listener is only polled while the event ring has room
+  Event ev;
+  ev.type = Event::Type::OPENED;
+  ev.slot = (uint8_t)slot;
+  ev.epoch = c.epoch;
+  ev.fd = fd;
+  this->events_.push(std::move(ev));
+  ESP_LOGI(TAG, "Accepted client %s:%u (connection %u)", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port),
+           (unsigned)slot);
+}
+
+bool NetTask::receive(size_t slot) {
+  NetConn &c = this->conns_[slot];
+  if (c.fd < 0) return false;
+  if (this->events_.space() == 0) {
+    this->starved_.store(true, std::memory_order_release);
+    return false;
+  }
+  // The chunk adapts to the traffic like the main loop's receive() does
+  Event ev;
+  ev.type = Event::Type::DATA;
+  ev.slot = (uint8_t)slot;
+  ev.epoch = c.epoch;
+  size_t chunk = c.rx_chunk;
+  ev.data.resize(chunk);
+  ssize_t r = recv(c.fd, ev.data.data(), chunk, 0);
+  if (r > 0) {
+    ev.data.resize((size_t)r);
+    this->counters_.rx_bytes.fetch_add((uint32_t)r, std::memory_order_relaxed);
+    if ((size_t)r == chunk && chunk < RX_CHUNK_MAX) {
+      c.rx_chunk = (uint16_t)(chunk * 2);
+    } else if ((size_t)r < chunk / 4 && chunk > RX_CHUNK_MIN) {
+      c.rx_chunk = (uint16_t)(chunk / 2);
+    }
+    this->events_.push(std::move(ev));
+    return (size_t)r == chunk;
+  }
+  if (r == 0) {
+    ESP_LOGI(TAG, "Client disconnected");
+    this->drop(slot, true);
+  } else if (errno != EWOULDBLOCK && errno != EAGAIN) {
+    ESP_LOGW(TAG, "recv() error: %d", errno);
+    this->drop(slot, true);
+  }
+  return false;
+}
+
+void NetTask::flush(size_t slot) {
+  NetConn &c = this->conns_[slot];
+  while (true) {
+    size_t sent = 0;
+    TxQueue::FlushResult result = c.tx.flush(c.fd, sent);
+    this->counters_.tx_bytes.fetch_add((uint32_t)sent, std::memory_order_relaxed);
+    switch (result) {
+      case TxQueue::FlushResult::PARTIAL:
+        continue;
+      case TxQueue::FlushResult::SHORT_WRITE:
+        // The socket buffer is full; go on when poll() reports POLLOUT
+        this->counters_.tx_short_writes.fetch_add(1, std::memory_order_relaxed);
+        c.tx_blocked = true;
+        return;
+      case TxQueue::FlushResult::WOULD_BLOCK:
+        this->counters_.tx_eagain.fetch_add(1, std::memory_order_relaxed);
+        c.tx_blocked = true;
+        return;
+      case TxQueue::FlushResult::ERROR:
+        ESP_LOGW(TAG, "sendmsg() failed: %d", errno);
+        this->drop(slot, true);
+        return;
+      case TxQueue::FlushResult::IDLE:
+      case TxQueue::FlushResult::DRAINED:
+        return;
+    }
+  }
+}
+
+void NetTask::drop(size_t slot, bool notify) {
+  NetConn &c = this->conns_[slot];
+  if (c.fd >= 0) ::close(c.fd);
+  c.fd = -1;
+  c.tx.clear();
+  c.tx_blocked = false;
+  c.rx_chunk = RX_CHUNK_MIN;
+  // The slot is reused only after the main loop has been told
+  c.notify_closed = notify;
+  if (!notify) return;
+  Event ev;
+  ev.type = Event::Type::CLOSED;
+  ev.slot = (uint8_t)slot;
+  ev.epoch = c.epoch;
+  if (this->events_.push(std::move(ev))) c.notify_closed = false;
+}
+
+}  // namespace usbip
+}  // namespace esphome
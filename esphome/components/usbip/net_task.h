@@ -0,0 +1,164 @@
+#pragma once
+
+#include "spsc_ring.h"
+#include "tx_queue.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <poll.h>
+#ifdef ESP_PLATFORM
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#else
+#include <thread>
+#endif
+
+namespace esphome {
+namespace usbip {
+
+// Options set on a client socket once the transmit policy of the device it
+// imported is known (see TxPolicy)
+struct SocketOptions {
+  bool nodelay{false};
+  // SO_SNDBUF / SO_RCVBUF in bytes; 0 keeps the stack's default
+  uint32_t send_buffer{0};
+  uint32_t receive_buffer{0};
+};
+// Apply 'options' to the socket 'fd'. Options the TCP stack does not
+// support (lwIP has no SO_SNDBUF) are skipped.
+void apply_socket_options(int fd, const SocketOptions &options);
+
+// Socket I/O of the USB/IP server in its own task (a FreeRTOS task, pinnable
+// to a core, on ESP; a std::thread elsewhere), so accepting, receiving and
+// writing no longer wait for the next USBIPComponent::loop(). The task owns
+// the listening socket and every client socket. Received bytes travel to
+// the main loop, which parses PDUs and talks to the host adapter, through an
+// event ring; replies come back through a command ring. Each ring has
+// exactly one producer and one consumer, so neither side takes a lock.
+//
+// Connection slots are shared by index with the main loop's connection
+// table. The task numbers each accepted connection with an epoch; commands
+// and close requests carry it, so stale ones aimed at a slot that has been
+// reused are dropped.
+class NetTask {
+ public:
+  // Net task -> main loop
+  struct Event {
+    enum class Type : uint8_t {
+      OPENED,  // a client connected; 'fd' is its socket (for logging only)
+      DATA,    // bytes received
+      CLOSED,  // the client went away or a socket call failed
+    };
+    Type type{Type::DATA};
+    uint8_t slot{0};
+    uint32_t epoch{0};
+    int fd{-1};
+    std::vector<uint8_t> data{};
+  };
+  // Main loop -> net task
+  struct Command {
+    enum class Type : uint8_t {
+      SEND,            // write 'data'
+      SOCKET_OPTIONS,  // apply 'options' to the socket
+    };
+    Type type{Type::SEND};
+    uint8_t slot{0};
+    uint32_t epoch{0};
+    TxQueue data{};
+    SocketOptions options{};
+  };
+
+  // Counters kept by the task; the main loop collects them with exchange(0)
+  struct Counters {
+    std::atomic<uint32_t> rx_bytes{0};
+    std::atomic<uint32_t> tx_bytes{0};
+    std::atomic<uint32_t> tx_eagain{0};
+    std::atomic<uint32_t> tx_short_writes{0};
+    std::atomic<uint32_t> accepted{0};
+  };
+
+  ~NetTask() { this->stop(); }
+
+  // Start serving 'listen_fd' (ownership moves to the task) with
+  // 'max_connections' slots. 'core' < 0 leaves the task unpinned; 'core' and
+  // 'priority' only apply to the FreeRTOS task.
+  bool start(int listen_fd, size_t max_connections, int8_t core, uint8_t priority);
+  // Ask the task to exit, wait for it and close every socket
+  void stop();
+  bool running() const { return this->running_.load(std::memory_order_acquire); }
+
+  // Main loop side
+  bool pop_event(Event &event);
+  // Whether send() will accept another command and still leave 'reserve'
+  // commands of room
+  bool can_send(size_t reserve = 0) const { return this->commands_.space() > reserve; }
+  bool send(uint8_t slot, uint32_t epoch, TxQueue &&data);
+  bool set_socket_options(uint8_t slot, uint32_t epoch, const SocketOptions &options);
+  // Close connection 'epoch' in 'slot'; never lost, even when the command
+  // ring is full. No CLOSED event follows.
+  void close(uint8_t slot, uint32_t epoch);
+  // Wake the task so commands and close requests are handled now
+  void wake();
+  // True once after the task stopped reading because the event ring was
+  // full; the main loop then wakes it after making room
+  bool take_starved() { return this->starved_.exchange(false, std::memory_order_acq_rel); }
+  Counters &counters() { return this->counters_; }
+
+ protected:
+  struct NetConn {
+    int fd{-1};
+    uint32_t epoch{0};
+    TxQueue tx{};
+    bool tx_blocked{false};
+    uint16_t rx_chunk{512};
+    // Closed by the peer; the slot stays taken until the main loop has been
+    // sent its CLOSED event
+    bool notify_closed{false};
+  };
+
+  void run();
+  // Close requests, commands and pending CLOSED events
+  void service();
+  void accept_client();
+  // Read one chunk into a DATA event; true if it filled the chunk
+  bool receive(size_t slot);
+  void flush(size_t slot);
+  // Close the socket; 'notify' sends a CLOSED event
+  void drop(size_t slot, bool notify);
+
+#ifdef ESP_PLATFORM
+  static void task_entry(void *arg);
+  TaskHandle_t task_{nullptr};
+  std::atomic<bool> exited_{false};
+#else
+  std::thread thread_{};
+#endif
+  std::atomic<bool> running_{false};
+  std::atomic<bool> starved_{false};
+  int listen_fd_{-1};
+  // Loopback UDP socket connected to itself; a datagram wakes poll()
+  int wake_fd_{-1};
+
+  // Owned by the task
+  std::unique_ptr<NetConn[]> conns_{};
+  size_t max_connections_{0};
+  uint32_t next_epoch_{0};
+  std::vector<struct pollfd> pollfds_{};
+  // Receives popped commands; kept so its queue storage is reused
+  Command command_{};
+
+  // Epoch the main loop wants closed, per slot (0: none)
+  std::unique_ptr<std::atomic<uint32_t>[]> close_epoch_{};
+  // Every connection hands its replies over once per main loop iteration;
+  // completions that write at once (interrupt reports, the LATENCY policy)
+  // may send more, but only into the room beyond one command per
+  // connection, so the per-loop sends always fit
+  SpscRing<Event, 32> events_{};
+  SpscRing<Command, 32> commands_{};
+  Counters counters_{};
+};
+
+}  // namespace usbip
+}  // namespace esphome
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+namespace esphome {
+namespace usbip {
+
+// Bounded lock-free queue for exactly one producer and one consumer thread.
+// Elements are moved in and out of a fixed array, so the ring itself never
+// allocates after construction. N must be a power of two; one slot is not
+// wasted, the ring holds N elements.
+template<typename T, size_t N> class SpscRing {
+  static_assert(N >= 2 && (N & (N - 1)) == 0, "SpscRing size must be a power of two");
+
+ public:
+  // Producer side. False (and 'value' untouched) if the ring is full.
+  bool push(T &&value) {
+    size_t tail = this->tail_.load(std::memory_order_relaxed);
+    if (tail - this->head_.load(std::memory_order_acquire) == N) return false;
+    this->slots_[tail & (N - 1)] = std::move(value);
+    this->tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+  // Free slots as seen by the producer (only grows until its next push)
+  size_t space() const {
+    return N - (this->tail_.load(std::memory_order_relaxed) - this->head_.load(std::memory_order_acquire));
+  }
+
+  // Consumer side. False if the ring is empty.
+  bool pop(T &value) {
+    size_t head = this->head_.load(std::memory_order_relaxed);
+    if (head == this->tail_.load(std::memory_order_acquire)) return false;
+    value = std::move(this->slots_[head & (N - 1)]);
+    this->head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+  bool empty() const {
+    return this->head_.load(std::memory_order_acquire) == this->tail_.load(std::memory_order_acquire);
+  }
+
+ protected:
+  T slots_[N]{};
+  // Free-running counters; head_ is written by the consumer only, tail_ by
+  // the producer only
+  std::atomic<size_t> head_{0};
+  std::atomic<size_t> tail_{0};
+};
+
+}  // namespace usbip
+}  // namespace esphome
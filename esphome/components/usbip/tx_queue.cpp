@@ -0,0 +1,181 @@
+#include "tx_queue.h"
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <cstring>
+
+namespace esphome {
+namespace usbip {
+
+// Never raise SIGPIPE when the peer has gone away; the error is reported
+// through the return value instead.
+#ifdef MSG_NOSIGNAL
+static const int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+static const int SEND_FLAGS = 0;
+#endif
+
+void TxQueue::push_inline(const uint8_t *data, size_t len) {
+  if (len == 0) return;
+  if (len > INLINE_SIZE) {
+    this->push_buffer(std::vector<uint8_t>(data, data + len));
+    return;
+  }
+  this->segments_.emplace_back();
+  Segment &seg = this->segments_.back();
+  memcpy(seg.inline_data, data, len);
+  seg.data = seg.inline_data;
+  seg.len = len;
+  this->bytes_ += len;
+}
+
+void TxQueue::push_buffer(std::vector<uint8_t> &&buf) {
+  if (buf.empty()) return;
+  this->segments_.emplace_back();
+  Segment &seg = this->segments_.back();
+  seg.owned = std::move(buf);
+  seg.data = seg.owned.data();
+  seg.len = seg.owned.size();
+  this->bytes_ += seg.len;
+}
+
+void TxQueue::push_pooled(std::vector<uint8_t> &&buf) {
+  if (this->pool_ == nullptr) {
+    this->push_buffer(std::move(buf));
+    return;
+  }
+  if (buf.empty()) {
+    this->pool_->give(std::move(buf));
+    return;
+  }
+  this->push_buffer(std::move(buf));
+  this->segments_.back().pooled = true;
+}
+
+void TxQueue::push_shared(std::shared_ptr<const std::vector<uint8_t>> buf) {
+  if (!buf || buf->empty()) return;
+  this->segments_.emplace_back();
+  Segment &seg = this->segments_.back();
+  seg.shared = std::move(buf);
+  seg.data = seg.shared->data();
+  seg.len = seg.shared->size();
+  this->bytes_ += seg.len;
+}
+
+void TxQueue::push_borrowed(const uint8_t *data, size_t len) {
+  if (len == 0) return;
+  this->segments_.emplace_back();
+  Segment &seg = this->segments_.back();
+  seg.data = data;
+  seg.len = len;
+  this->bytes_ += len;
+}
+
+void TxQueue::pop_front() {
+  Segment &front = this->segments_.front();
+  if (front.pooled) this->pool_->give(std::move(front.owned));
+  this->segments_.pop_front();
+}
+
+void TxQueue::clear() {
+  this->retired_ += (uint32_t)this->bytes_;
+  while (!this->segments_.empty()) this->pop_front();
+  this->head_offset_ = 0;
+  this->bytes_ = 0;
+}
+
+void TxQueue::append(TxQueue &&other) {
+  if (other.segments_.empty()) return;
+  if (this->segments_.empty()) {
+    // Take the whole deque; its segments stay where they are, so inline
+    // data pointers remain valid
+    this->segments_.swap(other.segments_);
+    this->head_offset_ = other.head_offset_;
+    this->bytes_ = other.bytes_;
+  } else {
+    bool first = true;
+    for (auto &seg : other.segments_) {
+      size_t off = first ? other.head_offset_ : 0;
+      first = false;
+      this->segments_.emplace_back(std::move(seg));
+      Segment &moved = this->segments_.back();
+      // Owned buffers keep their storage when moved; inline data does not
+      if (seg.data == seg.inline_data) moved.data = moved.inline_data;
+      moved.data += off;
+      moved.len -= off;
+      this->bytes_ += moved.len;
+    }
+    other.segments_.clear();
+  }
+  other.retired_ += (uint32_t)other.bytes_;
+  other.head_offset_ = 0;
+  other.bytes_ = 0;
+}
+
+TxQueue TxQueue::detach() {
+  TxQueue out;
+  for (auto &seg : this->segments_) {
+    if (seg.pooled) {
+      this->pool_->forget(seg.owned);
+      seg.pooled = false;
+    }
+    bool borrowed = seg.data != seg.inline_data && seg.owned.empty() && !seg.shared;
+    if (!borrowed) continue;
+    seg.owned.assign(seg.data, seg.data + seg.len);
+    seg.data = seg.owned.data();
+  }
+  out.segments_.swap(this->segments_);
+  out.head_offset_ = this->head_offset_;
+  out.bytes_ = this->bytes_;
+  this->retired_ += (uint32_t)this->bytes_;
+  this->head_offset_ = 0;
+  this->bytes_ = 0;
+  return out;
+}
+
+TxQueue::FlushResult TxQueue::flush(int fd, size_t &sent) {
+  sent = 0;
+  if (this->segments_.empty()) return FlushResult::IDLE;
+
+  struct iovec iov[MAX_IOV];
+  size_t n = 0;
+  for (auto it = this->segments_.begin(); it != this->segments_.end() && n < MAX_IOV; ++it, ++n) {
+    size_t off = n == 0 ? this->head_offset_ : 0;
+    iov[n].iov_base = const_cast<uint8_t *>(it->data) + off;
+    iov[n].iov_len = it->len - off;
+  }
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = n;
+
+  ssize_t w = sendmsg(fd, &msg, SEND_FLAGS);
+  if (w < 0) {
+    return (errno == EWOULDBLOCK || errno == EAGAIN) ? FlushResult::WOULD_BLOCK : FlushResult::ERROR;
+  }
+
+  sent = (size_t)w;
+  size_t offered = 0;
+  for (size_t i = 0; i < n; ++i) offered += iov[i].iov_len;
+  this->bytes_ -= sent;
+  this->retired_ += (uint32_t)sent;
+  // Retire fully written segments; a partially written one stays at the
+  // front with head_offset_ marking how far it got.
+  size_t left = sent;
+  while (left > 0) {
+    Segment &front = this->segments_.front();
+    size_t remaining = front.len - this->head_offset_;
+    if (left < remaining) {
+      this->head_offset_ += left;
+      break;
+    }
+    left -= remaining;
+    this->head_offset_ = 0;
+    this->pop_front();
+  }
+  if (this->segments_.empty()) return FlushResult::DRAINED;
+  return sent < offered ? FlushResult::SHORT_WRITE : FlushResult::PARTIAL;
+}
+
+}  // namespace usbip
+}  // namespace esphome
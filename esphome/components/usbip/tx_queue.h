@@ -0,0 +1,95 @@
+#pragma once
+
+#include "buffer_pool.h"
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+
+namespace esphome {
+namespace usbip {
+
+// Per-connection transmit queue of scatter-gather segments. Small headers are
+// copied into inline slots; payload buffers are moved in and handed to the
+// socket as they are, so a reply is never flattened into an intermediate
+// byte buffer. flush() writes the queue with a single sendmsg() and keeps
+// track of partially written segments.
+class TxQueue {
+ public:
+  // Largest segment stored inline (a USB/IP URB header)
+  static const size_t INLINE_SIZE = 48;
+  // Maximum number of iovecs passed to one sendmsg() call
+  static const size_t MAX_IOV = 16;
+
+  enum class FlushResult : uint8_t {
+    IDLE,         // nothing queued
+    PARTIAL,      // everything offered was written, more remains queued
+    SHORT_WRITE,  // the socket took only part of what was offered
+    DRAINED,      // queue is empty now
+    WOULD_BLOCK,  // socket buffer full, nothing written
+    ERROR,        // send failed; errno is set
+  };
+
+  // Queue a copy of 'len' bytes (meant for headers of up to INLINE_SIZE)
+  void push_inline(const uint8_t *data, size_t len);
+  // Queue a buffer; ownership moves into the queue and no copy is made
+  void push_buffer(std::vector<uint8_t> &&buf);
+  // Same for a buffer taken from the queue's pool (see set_pool()); it is
+  // given back once written or dropped
+  void push_pooled(std::vector<uint8_t> &&buf);
+  void set_pool(BufferPool *pool) { this->pool_ = pool; }
+  // Queue a buffer shared with other queues (e.g. a pre-serialized reply);
+  // it stays alive until written
+  void push_shared(std::shared_ptr<const std::vector<uint8_t>> buf);
+  // Queue 'len' bytes the caller keeps owning. They must stay unchanged until
+  // retired() has reached the end() value read right after this call.
+  void push_borrowed(const uint8_t *data, size_t len);
+
+  bool empty() const { return this->segments_.empty(); }
+  // Bytes queued and not yet written
+  size_t bytes() const { return this->bytes_; }
+  // Bytes that have left the queue (written or dropped by clear()) since it
+  // was created, and that count plus the bytes still queued. Both wrap.
+  uint32_t retired() const { return this->retired_; }
+  uint32_t end() const { return this->retired_ + (uint32_t)this->bytes_; }
+  void clear();
+
+  // Move everything queued in 'other' to the end of this queue
+  void append(TxQueue &&other);
+  // Hand the queued bytes over to a queue that owns all of them (borrowed
+  // segments are copied), for a writer on another thread. This queue is
+  // left empty with everything counted as retired, so the owners of
+  // borrowed segments may reuse them at once. Pooled buffers leave the
+  // pool and are freed by the new owner.
+  TxQueue detach();
+
+  // Write as much of the queue as one sendmsg() accepts on the non-blocking
+  // socket 'fd'. 'sent' receives the number of bytes written.
+  FlushResult flush(int fd, size_t &sent);
+
+ protected:
+  // Segments never move once queued (std::deque keeps references stable on
+  // push_back/pop_front), so 'data' may point into inline_data.
+  struct Segment {
+    uint8_t inline_data[INLINE_SIZE];
+    std::vector<uint8_t> owned;
+    std::shared_ptr<const std::vector<uint8_t>> shared;
+    const uint8_t *data{nullptr};
+    size_t len{0};
+    // 'owned' came from pool_
+    bool pooled{false};
+  };
+  // Return the front segment's buffer to the pool and drop the segment
+  void pop_front();
+
+  std::deque<Segment> segments_{};
+  // Bytes of the front segment that have already been written
+  size_t head_offset_{0};
+  size_t bytes_{0};
+  uint32_t retired_{0};
+  BufferPool *pool_{nullptr};
+};
+
+}  // namespace usbip
+}  // namespace esphome
@@ -0,0 +1,61 @@
+#include "urb_table.h"
+
+namespace esphome {
+namespace usbip {
+
+static_assert((UrbTable::CAPACITY & (UrbTable::CAPACITY - 1)) == 0, "UrbTable::CAPACITY must be a power of two");
+
+UrbTable::Entry *UrbTable::insert(uint32_t seqnum, Kind kind, uint8_t index) {
+  if (this->size_ == CAPACITY) return nullptr;
+  size_t i = home(seqnum);
+  while (this->entries_[i].used) i = (i + 1) & (CAPACITY - 1);
+  Entry &e = this->entries_[i];
+  e.seqnum = seqnum;
+  e.handle = INVALID_TRANSFER;
+  e.kind = kind;
+  e.index = index;
+  e.used = true;
+  e.unlinked = false;
+  this->size_++;
+  return &e;
+}
+
+UrbTable::Entry *UrbTable::find(uint32_t seqnum) {
+  size_t i = home(seqnum);
+  for (size_t n = 0; n < CAPACITY && this->entries_[i].used; ++n) {
+    if (this->entries_[i].seqnum == seqnum) return &this->entries_[i];
+    i = (i + 1) & (CAPACITY - 1);
+  }
+  return nullptr;
+}
+
+void UrbTable::remove(Entry *e) {
+  if (e == nullptr || !e->used) return;
+  // Backward shift: move later entries of the probe run into the hole so
+  // lookups never have to skip deleted slots
+  size_t hole = (size_t)(e - this->entries_);
+  this->entries_[hole].used = false;
+  size_t i = hole;
+  while (true) {
+    i = (i + 1) & (CAPACITY - 1);
+    Entry &next = this->entries_[i];
+    if (!next.used) break;
+    size_t h = home(next.seqnum);
+    // 'next' may move into the hole only if its home slot is not in the
+    // cyclic range (hole, i]
+    bool stays = hole <= i ? (hole < h && h <= i) : (hole < h || h <= i);
+    if (stays) continue;
+    this->entries_[hole] = next;
+    next.used = false;
+    hole = i;
+  }
+  this->size_--;
+}
+
+void UrbTable::clear() {
+  for (auto &e : this->entries_) e.used = false;
+  this->size_ = 0;
+}
+
+}  // namespace usbip
+}  // namespace esphome
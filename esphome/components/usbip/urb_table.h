@@ -0,0 +1,59 @@
+#pragma once
+
+#include "usb_host.h"
+#include <cstddef>
+#include <cstdint>
+
+namespace esphome {
+namespace usbip {
+
+// URBs of one connection that were submitted and not answered yet, indexed
+// by seqnum, so CMD_UNLINK finds its victim and the host transfer behind it
+// in constant time. Fixed-size open addressing table (linear probing,
+// backward shift deletion); nothing is allocated per URB. Clients number
+// their URBs consecutively, so the URBs in flight land in distinct slots
+// and probes stay short.
+class UrbTable {
+ public:
+  // Power of two
+  static const size_t CAPACITY = 64;
+
+  enum class Kind : uint8_t {
+    HOST,    // single host transfer ('handle')
+    STREAM,  // waiting for data of in_streams['index']
+    ISO,     // isochronous URB in iso slot 'index' ('handle')
+  };
+
+  struct Entry {
+    uint32_t seqnum{0};
+    transfer_handle_t handle{INVALID_TRANSFER};
+    Kind kind{Kind::HOST};
+    uint8_t index{0};
+    bool used{false};
+    // CMD_UNLINK cancelled it; its completion sends no RET_SUBMIT
+    bool unlinked{false};
+  };
+
+  // Add 'seqnum'; nullptr if the table is full (the URB then simply cannot
+  // be unlinked)
+  Entry *insert(uint32_t seqnum, Kind kind, uint8_t index = 0);
+  Entry *find(uint32_t seqnum);
+  void remove(Entry *e);
+  void clear();
+  size_t size() const { return this->size_; }
+
+  template<typename F> void for_each(F f) {
+    for (auto &e : this->entries_) {
+      if (e.used) f(e);
+    }
+  }
+
+ protected:
+  static size_t home(uint32_t seqnum) { return seqnum & (CAPACITY - 1); }
+
+  Entry entries_[CAPACITY]{};
+  size_t size_{0};
+};
+
+}  // namespace usbip
+}  // namespace esphome
@@ -1,12 +1,304 @@
 #include "usb_host.h"
+#include "descriptor_store.h"
+#include <algorithm>
 #include <chrono>
+#include <cstring>
 #include <thread>
+#ifdef ESP_PLATFORM
+#include "esp_timer.h"
+#endif
 
 namespace esphome {
 namespace usbip {
 
+uint32_t host_now_ms() {
+#ifdef ESP_PLATFORM
+  return (uint32_t)(esp_timer_get_time() / 1000ULL);
+#else
+  using namespace std::chrono;
+  return (uint32_t)duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+uint32_t host_now_us() {
+#ifdef ESP_PLATFORM
+  return (uint32_t)esp_timer_get_time();
+#else
+  using namespace std::chrono;
+  return (uint32_t)duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+size_t utf16le_to_utf8(const uint8_t *src, size_t units, uint8_t *out) {
+  uint8_t *p = out;
+  for (size_t i = 0; i < units; ++i) {
+    uint32_t cp = src[2 * i] | (src[2 * i + 1] << 8);
+    if (cp >= 0xD800 && cp <= 0xDFFF) {
+      uint32_t low = i + 1 < units ? (uint32_t)(src[2 * i + 2] | (src[2 * i + 3] << 8)) : 0;
+      if (cp <= 0xDBFF && low >= 0xDC00 && low <= 0xDFFF) {
+        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+        i++;
+      } else {
+        cp = 0xFFFD;
+      }
+    }
+    if (cp < 0x80) {
+      *p++ = (uint8_t)cp;
+    } else if (cp < 0x800) {
+      *p++ = (uint8_t)(0xC0 | (cp >> 6));
+      *p++ = (uint8_t)(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+      *p++ = (uint8_t)(0xE0 | (cp >> 12));
+      *p++ = (uint8_t)(0x80 | ((cp >> 6) & 0x3F));
+      *p++ = (uint8_t)(0x80 | (cp & 0x3F));
+    } else {
+      *p++ = (uint8_t)(0xF0 | (cp >> 18));
+      *p++ = (uint8_t)(0x80 | ((cp >> 12) & 0x3F));
+      *p++ = (uint8_t)(0x80 | ((cp >> 6) & 0x3F));
+      *p++ = (uint8_t)(0x80 | (cp & 0x3F));
+    }
+  }
+  return (size_t)(p - out);
+}
+
+void string_descriptor_to_utf8(const DescriptorView &desc, std::string &out) {
+  out.clear();
+  if (desc.size() < 2) return;
+  size_t units = (desc.size() - 2) / 2;
+  out.resize(3 * units);
+  out.resize(utf16le_to_utf8(desc.data + 2, units, (uint8_t *)&out[0]));
+}
+
+TransferTracker::Entry &TransferTracker::add(void *client, const UsbTransfer &xfer, transfer_done_t done,
+                                             uint32_t now) {
+  uint16_t slot;
+  if (!this->free_.empty()) {
+    slot = this->free_.back();
+    this->free_.pop_back();
+  } else {
+    slot = (uint16_t)this->entries_.size();
+    this->entries_.emplace_back();
+  }
+  // Low 16 bits select the slot (+1 so a handle is never 0), the high bits
+  // make stale handles of a reused slot detectable.
+  this->seq_++;
+  Entry &e = this->entries_[slot];
+  e.handle = ((transfer_handle_t)this->seq_ << 16) | (transfer_handle_t)(slot + 1);
+  e.client = client;
+  e.xfer = xfer;
+  e.out.clear();
+  if (!xfer.is_in() && xfer.data != nullptr && xfer.length > 0) {
+    e.out.assign(xfer.data, xfer.data + xfer.length);
+  }
+  e.xfer.data = e.out.empty() ? nullptr : e.out.data();
+  e.done = std::move(done);
+  e.deadline_ms = xfer.timeout_ms ? now + xfer.timeout_ms : 0;
+  e.started = false;
+  this->waiting_.push_back(e.handle);
+  this->pending_++;
+  return e;
+}
+
+TransferTracker::Entry *TransferTracker::find(transfer_handle_t handle) {
+  size_t slot = (handle & 0xFFFF);
+  if (slot == 0 || slot > this->entries_.size()) return nullptr;
+  Entry &e = this->entries_[slot - 1];
+  return e.handle == handle ? &e : nullptr;
+}
+
+TransferTracker::Entry *TransferTracker::next_waiting(void *client) {
+  // Drop handles that completed (cancelled/expired) while waiting
+  while (!this->waiting_.empty()) {
+    Entry *e = this->find(this->waiting_.front());
+    if (e != nullptr && !e->started && e->done) break;
+    this->waiting_.pop_front();
+  }
+  for (auto h : this->waiting_) {
+    Entry *e = this->find(h);
+    if (e != nullptr && !e->started && e->done && e->client == client) return e;
+  }
+  return nullptr;
+}
+
+void TransferTracker::mark_started(Entry &e) { e.started = true; }
+
+void TransferTracker::release(Entry &e) {
+  size_t slot = (e.handle & 0xFFFF) - 1;
+  e.handle = INVALID_TRANSFER;
+  e.client = nullptr;
+  e.done = nullptr;
+  e.started = false;
+  this->free_.push_back((uint16_t)slot);
+}
+
+void TransferTracker::backend_done(transfer_handle_t handle, const UsbTransferResult &res) {
+  Entry *e = this->find(handle);
+  if (e == nullptr) return;
+  transfer_done_t done = std::move(e->done);
+  if (done) this->pending_--;
+  this->release(*e);
+  // The callback may submit new transfers (and grow entries_), so it runs
+  // after the entry has been released.
+  if (done) done(res);
+}
+
+bool TransferTracker::abort(transfer_handle_t handle, int32_t status) {
+  Entry *e = this->find(handle);
+  if (e == nullptr || !e->done) return false;
+  transfer_done_t done = std::move(e->done);
+  e->done = nullptr;
+  this->pending_--;
+  // If the host stack still owns the request the slot is kept until it
+  // reports back through backend_done()
+  if (!e->started) this->release(*e);
+  UsbTransferResult res;
+  res.status = status;
+  done(res);
+  return true;
+}
+
+void TransferTracker::expire(uint32_t now) {
+  if (this->pending_ == 0) return;
+  for (size_t i = 0; i < this->entries_.size(); ++i) {
+    Entry &e = this->entries_[i];
+    if (e.handle == INVALID_TRANSFER || !e.done || e.deadline_ms == 0) continue;
+    if ((int32_t)(now - e.deadline_ms) >= 0) {
+      ESP_LOGD(USB_HOST_TAG, "Transfer on ep 0x%02X timed out", e.xfer.endpoint);
+      this->abort(e.handle, USB_STATUS_TIMEDOUT);
+    }
+  }
+}
+
+void TransferTracker::fail_client(void *client, int32_t status) {
+  // Callbacks may submit new transfers (and grow entries_); only the ones
+  // present now are failed
+  std::vector<transfer_handle_t> handles;
+  for (const auto &e : this->entries_) {
+    if (e.handle != INVALID_TRANSFER && e.client == client) handles.push_back(e.handle);
+  }
+  for (auto h : handles) {
+    Entry *e = this->find(h);
+    if (e == nullptr) continue;
+    transfer_done_t done = std::move(e->done);
+    if (done) this->pending_--;
+    this->release(*e);
+    if (!done) continue;
+    UsbTransferResult res;
+    res.status = status;
+    done(res);
+  }
+}
+
+const ControlRequestManager::Request *ControlRequestManager::match(void *client, const uint8_t *setup) const {
+  uint16_t length = setup[6] | (setup[7] << 8);
+  for (const auto &r : this->requests_) {
+    // Same client and SETUP packet up to wLength, which may be smaller
+    if (r.id != 0 && r.client == client && memcmp(r.setup, setup, 6) == 0 &&
+        (r.setup[6] | (r.setup[7] << 8)) >= length)
+      return &r;
+  }
+  return nullptr;
+}
+
+uint32_t ControlRequestManager::add(void *client, const uint8_t *setup, transfer_done_t done) {
+  uint16_t length = setup[6] | (setup[7] << 8);
+  if (const Request *m = this->match(client, setup)) {
+    Request &r = this->requests_[m - this->requests_.data()];
+    r.waiters.push_back(Waiter{length, std::move(done)});
+    this->shared_++;
+    return 0;
+  }
+  Request *slot = nullptr;
+  for (auto &r : this->requests_) {
+    if (r.id == 0) {
+      slot = &r;
+      break;
+    }
+  }
+  if (slot == nullptr) {
+    this->requests_.emplace_back();
+    slot = &this->requests_.back();
+  }
+  this->seq_++;
+  slot->id = ((uint32_t)this->seq_ << 16) | (uint32_t)(slot - this->requests_.data() + 1);
+  slot->client = client;
+  memcpy(slot->setup, setup, sizeof(slot->setup));
+  slot->waiters.clear();
+  slot->waiters.push_back(Waiter{length, std::move(done)});
+  return slot->id;
+}
+
+ControlRequestManager::Request *ControlRequestManager::find(uint32_t id) {
+  size_t index = id & 0xFFFF;
+  if (index == 0 || index > this->requests_.size()) return nullptr;
+  Request &r = this->requests_[index - 1];
+  return r.id == id ? &r : nullptr;
+}
+
+void ControlRequestManager::complete(uint32_t id, const UsbTransferResult &res) {
+  Request *r = this->find(id);
+  if (r == nullptr) return;
+  // Waiters may issue new requests (and grow requests_), so the entry is
+  // freed before any of them runs
+  std::vector<Waiter> waiters;
+  waiters.swap(r->waiters);
+  r->id = 0;
+  r->client = nullptr;
+  for (auto &w : waiters) {
+    UsbTransferResult mine = res;
+    mine.actual_length = std::min(res.actual_length, (size_t)w.length);
+    w.done(mine);
+  }
+  // Hand the waiter list's storage back to the entry if it is still free
+  r = &this->requests_[(id & 0xFFFF) - 1];
+  if (r->id == 0 && r->waiters.capacity() < waiters.capacity()) {
+    waiters.clear();
+    r->waiters.swap(waiters);
+  }
+}
+
+void ControlRequestManager::drop(uint32_t id) {
+  Request *r = this->find(id);
+  if (r == nullptr) return;
+  r->waiters.clear();
+  r->id = 0;
+  r->client = nullptr;
+}
+
+void ControlRequestManager::fail_client(void *client, const UsbTransferResult &res) {
+  // complete() tolerates waiters adding requests; index, do not iterate
+  for (size_t i = 0; i < this->requests_.size(); ++i) {
+    Request &r = this->requests_[i];
+    if (r.id != 0 && r.client == client) this->complete(r.id, res);
+  }
+}
+
+size_t ControlRequestManager::in_flight() const {
+  size_t n = 0;
+  for (const auto &r : this->requests_) {
+    if (r.id != 0) n++;
+  }
+  return n;
+}
+
 class DummyUSBHost : public USBHostAdapter {
  public:
+  DummyUSBHost() {
+    // String descriptor 0 lists the supported LANGIDs (en-US only)
+    this->strings_[0] = {4, 0x03, 0x09, 0x04};
+    const char *const texts[] = {"ESPHome", "USB/IP loopback device", "0001"};
+    for (int i = 0; i < 3; ++i) {
+      auto &d = this->strings_[i + 1];
+      d.push_back(0);
+      d.push_back(0x03);
+      for (const char *c = texts[i]; *c; ++c) {
+        d.push_back((uint8_t)*c);
+        d.push_back(0);
+      }
+      d[0] = (uint8_t)d.size();
+    }
+  }
+
   bool begin() override {
     ESP_LOGI(USB_HOST_TAG, "Dummy USB host started");
     return true;
@@ -15,60 +307,283 @@ class DummyUSBHost : public USBHostAdapter {
   void stop() override { ESP_LOGI(USB_HOST_TAG, "Dummy USB host stopped"); }
 
   void poll() override {
-    // Nothing to do; in a real host this would process events
+    this->tracker_.expire(host_now_ms());
+    // Complete started transfers. IN transfers on a loopback endpoint stay
+    // queued (like a device NAKing) until data was written to the matching
+    // OUT endpoint; isochronous ones wait for their bus frames to pass.
+    // Callbacks may submit new transfers, so work on a copy.
+    std::vector<transfer_handle_t> work;
+    work.swap(this->started_);
+    for (auto h : work) {
+      auto *e = this->tracker_.find(h);
+      if (e == nullptr) continue;
+      UsbTransferResult res;
+      if (e->done && !this->try_complete(*e, res)) {
+        this->started_.push_back(h);
+        continue;
+      }
+      if (e->xfer.type == TransferType::ISOCHRONOUS) this->unschedule_iso(h);
+      // Aborted transfers (no callback left) are simply released here
+      this->tracker_.backend_done(h, res);
+    }
   }
 
+  // Every client has the same emulated device, which answers at once:
+  // a request copies the descriptor into the client's cache slot
   void request_device_descriptor(void *client_ptr) override {
-    (void)client_ptr;
-    // Nothing to do for dummy; descriptor will be provided on get
+    size_t slot = this->slot_of(client_ptr);
+    if (this->cache_.device(slot).ready) return;
+    if (this->cache_.set_device(slot, DEVICE_DESC, sizeof(DEVICE_DESC))) this->generation_++;
   }
 
   void request_config_descriptor(void *client_ptr) override {
-    (void)client_ptr;
-    // Dummy: no-op
+    size_t slot = this->slot_of(client_ptr);
+    if (this->cache_.config(slot).ready) return;
+    if (this->cache_.set_config(slot, CONFIG_DESC, sizeof(CONFIG_DESC))) this->generation_++;
   }
 
   void request_string_descriptor(void *client_ptr, int index) override {
-    (void)client_ptr; (void)index;
-    // Dummy: no-op
+    size_t slot = this->slot_of(client_ptr);
+    if (index < 0 || index >= NUM_STRINGS || this->cache_.string(slot, index).ready) return;
+    // The strings exist in en-US only
+    const auto &d = this->strings_[index];
+    if (this->cache_.set_string(slot, index, index == 0 ? 0 : 0x0409, d.data(), d.size())) this->generation_++;
   }
 
-  bool get_device_descriptor(void *client_ptr, std::vector<uint8_t> &out) override {
-    (void)client_ptr;
-    // Return a minimal fake device descriptor (18 bytes)
-    const uint8_t desc[18] = {
-        18, // bLength
-        0x01, // bDescriptorType = Device
-        0x00, 0x02, // bcdUSB 2.00
-        0x00, // bDeviceClass
-        0x00, // bDeviceSubClass
-        0x00, // bDeviceProtocol
-        64,   // bMaxPacketSize0
-        0x34, 0x12, // idVendor = 0x1234
-        0x78, 0x56, // idProduct = 0x5678
-        0x00, 0x01, // bcdDevice
-        1, // iManufacturer
-        2, // iProduct
-        3, // iSerialNumber
-        1  // bNumConfigurations
-    };
-    out.assign(desc, desc + sizeof(desc));
+  DescriptorView device_descriptor(void *client_ptr) const override {
+    return this->cache_.device(this->slot_of(client_ptr));
+  }
+
+  DescriptorView config_descriptor(void *client_ptr) const override {
+    return this->cache_.config(this->slot_of(client_ptr));
+  }
+
+  DescriptorView string_descriptor(void *client_ptr, int index) const override {
+    return this->cache_.string(this->slot_of(client_ptr), index);
+  }
+
+  DescriptorView string_utf8(void *client_ptr, int index) const override {
+    return this->cache_.string_utf8(this->slot_of(client_ptr), index);
+  }
+
+  DescriptorView string_descriptor_langid(void *client_ptr, int index, uint16_t langid) const override {
+    return this->cache_.string(this->slot_of(client_ptr), index, index == 0 ? 0 : langid);
+  }
+
+  void register_clients(void *const *clients, size_t count, size_t config_capacity,
+                        size_t string_capacity) override {
+    this->clients_.assign(clients, clients + count);
+    this->cache_.configure(count, config_capacity, string_capacity);
+    this->generation_++;
+  }
+
+  size_t descriptor_memory() const override { return this->cache_.memory_usage(); }
+
+  // Records are the cache slot's DescriptorStore::serialize() form. The
+  // emulated device never changes, so a restored record needs no check
+  bool save_descriptors(void *client_ptr, std::vector<uint8_t> &out) const override {
+    size_t slot = this->slot_of(client_ptr);
+    if (!this->cache_.device(slot).ready) return false;
+    this->cache_.serialize(slot, out);
     return true;
   }
 
-  bool get_config_descriptor(void *client_ptr, std::vector<uint8_t> &out) override {
-    (void)client_ptr;
-    out.clear();
-    return false;
+  bool restore_descriptors(void *client_ptr, const uint8_t *data, size_t len) override {
+    size_t slot = this->slot_of(client_ptr);
+    if (slot >= this->clients_.size()) return false;
+    bool ok = this->cache_.restore(slot, data, len);
+    this->generation_++;
+    return ok;
   }
 
-  bool get_string_descriptor(void *client_ptr, int index, std::vector<uint8_t> &out) override {
-    (void)client_ptr; (void)index;
-    out.clear();
-    return false;
+  uint32_t descriptor_generation() const override { return this->generation_; }
+
+  transfer_handle_t submit_transfer(void *client_ptr, const UsbTransfer &xfer, transfer_done_t done) override {
+    if (xfer.type == TransferType::ISOCHRONOUS &&
+        (xfer.num_iso_packets == 0 || xfer.iso_packets == nullptr || (xfer.length > 0 && xfer.iso_buffer == nullptr)))
+      return INVALID_TRANSFER;
+    auto &e = this->tracker_.add(client_ptr, xfer, std::move(done), host_now_ms());
+    if (xfer.type == TransferType::ISOCHRONOUS) this->schedule_iso(e);
+    // The dummy device has no request limit; every transfer starts at once
+    this->tracker_.mark_started(e);
+    this->started_.push_back(e.handle);
+    return e.handle;
+  }
+
+  bool cancel_transfer(transfer_handle_t handle) override {
+    return this->tracker_.abort(handle, USB_STATUS_CONNRESET);
+  }
+
+  size_t transfers_in_flight() const override { return this->tracker_.pending(); }
+
+ protected:
+  // Return a minimal fake device descriptor (18 bytes)
+  static constexpr uint8_t DEVICE_DESC[18] = {
+      18, // bLength
+      0x01, // bDescriptorType = Device
+      0x00, 0x02, // bcdUSB 2.00
+      0x00, // bDeviceClass
+      0x00, // bDeviceSubClass
+      0x00, // bDeviceProtocol
+      64,   // bMaxPacketSize0
+      0x34, 0x12, // idVendor = 0x1234
+      0x78, 0x56, // idProduct = 0x5678
+      0x00, 0x01, // bcdDevice
+      1, // iManufacturer
+      2, // iProduct
+      3, // iSerialNumber
+      1  // bNumConfigurations
+  };
+
+  // One vendor specific interface with a bulk IN/OUT pair on endpoint 1,
+  // which the dummy implements as a loopback
+  static constexpr uint8_t CONFIG_DESC[32] = {
+      9, 0x02, 32, 0,  // bLength, CONFIGURATION, wTotalLength
+      1,               // bNumInterfaces
+      1,               // bConfigurationValue
+      0,               // iConfiguration
+      0x80,            // bmAttributes (bus powered)
+      50,              // bMaxPower (100 mA)
+      9, 0x04, 0, 0,   // bLength, INTERFACE, bInterfaceNumber, bAlternateSetting
+      2,               // bNumEndpoints
+      0xFF, 0, 0,      // vendor specific class
+      0,               // iInterface
+      7, 0x05, 0x81, 0x02, 64, 0, 0,  // EP1 IN bulk, 64 bytes
+      7, 0x05, 0x01, 0x02, 64, 0, 0,  // EP1 OUT bulk, 64 bytes
+  };
+
+  // LANGID table plus iManufacturer, iProduct and iSerialNumber
+  static const int NUM_STRINGS = 4;
+
+  // An isochronous transfer occupies one full speed frame (1 ms) per packet.
+  // Transfers on an endpoint are scheduled back to back, as the host
+  // controller does for a client that keeps its queue filled.
+  struct IsoSlot {
+    transfer_handle_t handle;
+    uint32_t start_frame;
+    uint32_t end_frame;
+  };
+
+  void schedule_iso(const TransferTracker::Entry &e) {
+    uint32_t now = host_now_ms();
+    uint32_t &next = this->iso_next_frame_[(e.xfer.endpoint & 0x0F) + (e.xfer.is_in() ? 16 : 0)];
+    // A client that fell behind restarts at the current frame
+    uint32_t start = (int32_t)(next - now) > 0 ? next : now;
+    next = start + e.xfer.num_iso_packets;
+    this->iso_schedule_.push_back(IsoSlot{e.handle, start, next});
+  }
+
+  void unschedule_iso(transfer_handle_t handle) {
+    for (auto it = this->iso_schedule_.begin(); it != this->iso_schedule_.end(); ++it) {
+      if (it->handle == handle) {
+        this->iso_schedule_.erase(it);
+        return;
+      }
+    }
   }
+
+  // Isochronous loopback: OUT packets append to the endpoint's loopback
+  // data, IN packets take what is there. Packets never wait for data; an IN
+  // packet without data completes empty, as with a real device.
+  bool try_complete_iso(TransferTracker::Entry &e, UsbTransferResult &res) {
+    const IsoSlot *slot = nullptr;
+    for (const auto &s : this->iso_schedule_) {
+      if (s.handle == e.handle) slot = &s;
+    }
+    if (slot == nullptr) return true;
+    if ((int32_t)(host_now_ms() - slot->end_frame) < 0) return false;
+    auto &loop = this->loopback_[e.xfer.endpoint & 0x0F];
+    bool in = e.xfer.is_in();
+    for (uint16_t i = 0; i < e.xfer.num_iso_packets; ++i) {
+      UsbIsoPacket &p = e.xfer.iso_packets[i];
+      p.status = USB_STATUS_OK;
+      if (in) {
+        size_t n = std::min((size_t)p.length, loop.size());
+        std::copy(loop.begin(), loop.begin() + n, e.xfer.iso_buffer + p.offset);
+        loop.erase(loop.begin(), loop.begin() + n);
+        p.actual_length = (uint32_t)n;
+      } else {
+        loop.insert(loop.end(), e.xfer.iso_buffer + p.offset, e.xfer.iso_buffer + p.offset + p.length);
+        p.actual_length = p.length;
+      }
+      res.actual_length += p.actual_length;
+    }
+    res.data = e.xfer.iso_buffer;
+    res.start_frame = slot->start_frame;
+    return true;
+  }
+
+  // Fill 'res' for a started transfer. Returns false if it has to stay queued.
+  bool try_complete(TransferTracker::Entry &e, UsbTransferResult &res) {
+    if (e.xfer.type == TransferType::ISOCHRONOUS) return this->try_complete_iso(e, res);
+    if (e.xfer.type == TransferType::CONTROL) {
+      // Only standard GET_DESCRIPTOR is answered; other IN requests stall and
+      // OUT requests (SET_* etc.) are accepted.
+      const uint8_t *setup = e.xfer.setup;
+      DescriptorView d;
+      if (setup[0] == 0x80 && setup[1] == 0x06) {
+        if (setup[3] == 0x01) {
+          d = DescriptorView{DEVICE_DESC, sizeof(DEVICE_DESC), true};
+        } else if (setup[3] == 0x02) {
+          d = DescriptorView{CONFIG_DESC, sizeof(CONFIG_DESC), true};
+        } else if (setup[3] == 0x03 && setup[2] < NUM_STRINGS) {
+          const auto &s = this->strings_[setup[2]];
+          d = DescriptorView{s.data(), s.size(), true};
+        }
+      }
+      if (d.ready) {
+        res.data = d.data;
+        res.actual_length = std::min(e.xfer.length, d.size());
+      } else if (e.xfer.is_in()) {
+        res.status = USB_STATUS_STALL;
+      }
+      return true;
+    }
+    auto &loop = this->loopback_[e.xfer.endpoint & 0x0F];
+    if (!e.xfer.is_in()) {
+      loop.insert(loop.end(), e.out.begin(), e.out.end());
+      res.actual_length = e.out.size();
+      return true;
+    }
+    if (loop.empty()) return false;
+    size_t n = std::min(e.xfer.length, loop.size());
+    this->in_buf_.assign(loop.begin(), loop.begin() + n);
+    loop.erase(loop.begin(), loop.begin() + n);
+    res.data = this->in_buf_.data();
+    res.actual_length = n;
+    return true;
+  }
+
+  // Cache slot of a client (registration index); out of range if unknown
+  size_t slot_of(void *client_ptr) const {
+    for (size_t i = 0; i < this->clients_.size(); ++i) {
+      if (this->clients_[i] == client_ptr) return i;
+    }
+    return this->clients_.size();
+  }
+
+  // The emulated device's string descriptors
+  std::vector<uint8_t> strings_[NUM_STRINGS]{};
+  // What the host has read from each client's device so far
+  std::vector<void *> clients_{};
+  DescriptorStore cache_{};
+  uint32_t generation_{1};
+  TransferTracker tracker_{};
+  // Started transfers in submission order
+  std::vector<transfer_handle_t> started_{};
+  // Data written to OUT endpoint N is returned by IN endpoint N
+  std::vector<uint8_t> loopback_[16]{};
+  // Backing store for the data of the IN transfer being completed
+  std::vector<uint8_t> in_buf_{};
+  // Isochronous transfers in flight and the next free frame per endpoint
+  // (endpoint number, +16 for IN)
+  std::vector<IsoSlot> iso_schedule_{};
+  uint32_t iso_next_frame_[32]{};
 };
 
+constexpr uint8_t DummyUSBHost::DEVICE_DESC[18];
+constexpr uint8_t DummyUSBHost::CONFIG_DESC[32];
+
 std::unique_ptr<USBHostAdapter> make_dummy_usb_host() {
   return std::unique_ptr<USBHostAdapter>(new DummyUSBHost());
 }
@@ -106,20 +621,39 @@ class EspIdfUSBHost : public USBHostAdapter {
     // TODO: implement when ESP-IDF adapter is ready
   }
 
-  bool get_device_descriptor(void *client_ptr, std::vector<uint8_t> &out) override {
+  DescriptorView device_descriptor(void *client_ptr) const override {
     (void)client_ptr;
-    return false;
+    return DescriptorView{};
   }
 
-  bool get_config_descriptor(void *client_ptr, std::vector<uint8_t> &out) override {
+  DescriptorView config_descriptor(void *client_ptr) const override {
     (void)client_ptr;
-    return false;
+    return DescriptorView{};
   }
 
-  bool get_string_descriptor(void *client_ptr, int index, std::vector<uint8_t> &out) override {
+  DescriptorView string_descriptor(void *client_ptr, int index) const override {
+    (void)client_ptr; (void)index;
+    return DescriptorView{};
+  }
+  DescriptorView string_utf8(void *client_ptr, int index) const override {
     (void)client_ptr; (void)index;
+    return DescriptorView{};
+  }
+
+  uint32_t descriptor_generation() const override { return 0; }
+
+  transfer_handle_t submit_transfer(void *client_ptr, const UsbTransfer &xfer, transfer_done_t done) override {
+    (void)client_ptr; (void)xfer; (void)done;
+    // TODO: implement when ESP-IDF adapter is ready
+    return INVALID_TRANSFER;
+  }
+
+  bool cancel_transfer(transfer_handle_t handle) override {
+    (void)handle;
     return false;
   }
+
+  size_t transfers_in_flight() const override { return 0; }
 };
 
 std::unique_ptr<USBHostAdapter> make_esp_idf_usb_host() {
@@ -1,9 +1,13 @@
 #pragma once
 
 #include "esphome/core/log.h"
+#include "buffer_pool.h"
 #include <memory>
 #include <vector>
 #include <cstdint>
+#include <deque>
+#include <functional>
+#include <string>
 
 // Forward declarations for esphome usb_host types (placed at top-level so
 // they are available to adapters without nesting issues).
@@ -17,7 +21,232 @@ class USBClient;
 namespace esphome {
 namespace usbip {
 
-static const char *USB_HOST_TAG = "usbip.host";
+// Not every file that includes this header logs
+[[maybe_unused]] static const char *USB_HOST_TAG = "usbip.host";
+
+// Transfer status codes. These are the negative Linux errno values that the
+// USB/IP wire protocol carries (newlib numbers several of them differently,
+// so the platform's errno constants must not be used here).
+static const int32_t USB_STATUS_OK = 0;
+static const int32_t USB_STATUS_NOENT = -2;         // -ENOENT
+static const int32_t USB_STATUS_NODEV = -19;        // -ENODEV
+static const int32_t USB_STATUS_INVALID = -22;      // -EINVAL
+static const int32_t USB_STATUS_NOSPC = -28;        // -ENOSPC
+static const int32_t USB_STATUS_STALL = -32;        // -EPIPE
+static const int32_t USB_STATUS_PROTO = -71;        // -EPROTO
+static const int32_t USB_STATUS_OVERFLOW = -75;     // -EOVERFLOW
+static const int32_t USB_STATUS_NOT_SUPPORTED = -95;  // -EOPNOTSUPP
+static const int32_t USB_STATUS_CONNRESET = -104;   // -ECONNRESET
+static const int32_t USB_STATUS_SHUTDOWN = -108;    // -ESHUTDOWN
+static const int32_t USB_STATUS_TIMEDOUT = -110;    // -ETIMEDOUT
+
+// Read-only view of a descriptor cached by a USBHostAdapter. 'ready' is false
+// while the descriptor has not been fetched yet. The bytes stay valid until
+// the adapter's descriptor_generation() changes; copy them to keep them
+// longer.
+struct DescriptorView {
+  const uint8_t *data{nullptr};
+  size_t len{0};
+  bool ready{false};
+
+  size_t size() const { return this->len; }
+  bool empty() const { return this->len == 0; }
+  uint8_t operator[](size_t i) const { return this->data[i]; }
+  const uint8_t *begin() const { return this->data; }
+  const uint8_t *end() const { return this->data + this->len; }
+};
+
+// Endpoint transfer types (same values as bmAttributes in an endpoint
+// descriptor).
+enum class TransferType : uint8_t { CONTROL = 0, ISOCHRONOUS = 1, BULK = 2, INTERRUPT = 3 };
+
+// Opaque handle identifying a submitted transfer; INVALID_TRANSFER is never
+// returned for an accepted transfer.
+using transfer_handle_t = uint32_t;
+static const transfer_handle_t INVALID_TRANSFER = 0;
+
+// One packet of an isochronous transfer. The caller sets 'offset' (into the
+// transfer's buffer) and 'length'; the adapter fills in 'actual_length' and
+// 'status' on completion. Same fields as a USB/IP iso packet descriptor.
+struct UsbIsoPacket {
+  uint32_t offset{0};
+  uint32_t length{0};
+  uint32_t actual_length{0};
+  int32_t status{0};
+};
+
+// A single transfer submitted through USBHostAdapter::submit_transfer().
+struct UsbTransfer {
+  TransferType type{TransferType::CONTROL};
+  // Endpoint address including the direction bit (0x80 = IN). Endpoint 0
+  // is the default control pipe and uses 'setup'.
+  uint8_t endpoint{0};
+  // SETUP packet for control transfers (bmRequestType, bRequest, wValue,
+  // wIndex, wLength as on the wire)
+  uint8_t setup[8]{};
+  // Payload for OUT transfers (may be null when length is 0)
+  const uint8_t *data{nullptr};
+  // Bytes to send (OUT) or maximum number of bytes to receive (IN)
+  size_t length{0};
+  // Complete with USB_STATUS_TIMEDOUT if the transfer has not finished
+  // after this many ms (0 = wait forever, as for a bulk IN pipe)
+  uint32_t timeout_ms{0};
+  // Isochronous transfers only: 'num_iso_packets' packets in 'iso_packets'
+  // whose data lives in 'iso_buffer' ('length' bytes: the OUT payload, or
+  // room for IN data at each packet's offset). Both stay owned by the
+  // caller and must remain valid until the completion callback ran. The
+  // adapter updates the packets and writes IN data in place, so nothing is
+  // copied; 'data' is unused.
+  UsbIsoPacket *iso_packets{nullptr};
+  uint16_t num_iso_packets{0};
+  uint8_t *iso_buffer{nullptr};
+
+  bool is_in() const { return this->endpoint == 0 ? (this->setup[0] & 0x80) != 0 : (this->endpoint & 0x80) != 0; }
+};
+
+// Outcome of a transfer. 'status' is one of the USB_STATUS_* codes above. For IN
+// transfers 'data' points at 'actual_length' received bytes and is only
+// valid for the duration of the callback.
+//
+// For isochronous transfers 'data' is the caller's iso_buffer,
+// 'actual_length' the sum of the packets' actual lengths, 'error_count' the
+// number of packets that failed and 'start_frame' the bus frame the first
+// packet was scheduled in.
+struct UsbTransferResult {
+  int32_t status{0};
+  const uint8_t *data{nullptr};
+  size_t actual_length{0};
+  uint32_t start_frame{0};
+  uint32_t error_count{0};
+};
+
+using transfer_done_t = std::function<void(const UsbTransferResult &)>;
+// The device behind an exported client was plugged in (true) or removed
+using device_event_t = std::function<void(void *client_ptr, bool attached)>;
+
+// Milliseconds since boot (monotonic), used for transfer deadlines.
+uint32_t host_now_ms();
+// Microseconds since boot (monotonic, wraps after about 71 minutes)
+uint32_t host_now_us();
+
+// Convert 'units' UTF-16LE code units at 'src' to UTF-8. Surrogate pairs
+// become one 4 byte sequence; unpaired surrogates are replaced by U+FFFD.
+// 'out' must have room for 3 * units bytes. Returns the bytes written.
+size_t utf16le_to_utf8(const uint8_t *src, size_t units, uint8_t *out);
+
+// Convert a raw USB string descriptor (bLength, bDescriptorType, UTF-16LE
+// characters) to UTF-8, replacing the contents of 'out'.
+void string_descriptor_to_utf8(const DescriptorView &desc, std::string &out);
+
+// Book-keeping shared by adapter implementations: hands out handles, keeps
+// the caller's completion until the host stack reports back and applies
+// timeouts and cancellation. Lookups by handle are O(1).
+//
+// A transfer that timed out or was cancelled after it was handed to the host
+// stack completes towards the caller immediately but keeps its entry until
+// the host stack releases it through backend_done(), since the stack still
+// owns a request slot for it.
+class TransferTracker {
+ public:
+  struct Entry {
+    transfer_handle_t handle{INVALID_TRANSFER};
+    void *client{nullptr};
+    UsbTransfer xfer{};
+    // OUT payload owned by the tracker; xfer.data points here
+    std::vector<uint8_t> out{};
+    transfer_done_t done{};
+    uint32_t deadline_ms{0};
+    // Handed to the host stack
+    bool started{false};
+  };
+
+  // Register a transfer. OUT data is copied so the caller's buffer may be
+  // released as soon as submit_transfer() returns (isochronous transfers
+  // keep using the caller's iso_buffer instead).
+  Entry &add(void *client, const UsbTransfer &xfer, transfer_done_t done, uint32_t now);
+  Entry *find(transfer_handle_t handle);
+  // Oldest transfer for 'client' that has not been handed to the host stack
+  Entry *next_waiting(void *client);
+  void mark_started(Entry &e);
+
+  // Report completion from the host stack; invokes the callback unless the
+  // transfer already timed out or was cancelled, then frees the entry.
+  void backend_done(transfer_handle_t handle, const UsbTransferResult &res);
+  // Complete a transfer towards the caller with 'status' ahead of the host
+  // stack. Returns false if the handle already completed.
+  bool abort(transfer_handle_t handle, int32_t status);
+  // Abort every transfer whose deadline has passed
+  void expire(uint32_t now);
+  // Complete every transfer of 'client' with 'status' and free its entry,
+  // also those the host stack still owns: its device went away, so the
+  // stack will not report back (a late report finds no entry)
+  void fail_client(void *client, int32_t status);
+
+  // Transfers whose callback has not run yet
+  size_t pending() const { return this->pending_; }
+
+ protected:
+  void release(Entry &e);
+
+  std::vector<Entry> entries_{};
+  std::vector<uint16_t> free_{};
+  std::deque<transfer_handle_t> waiting_{};
+  uint16_t seq_{0};
+  size_t pending_{0};
+};
+
+// Control requests an adapter has handed to the host stack, keyed by
+// (client, bmRequestType, bRequest, wValue, wIndex), so identical requests
+// share one transfer on the bus. A request asking for no more data than
+// one in flight (wLength) attaches to it instead of being issued; when the
+// transfer completes every waiter is called with the result, its data cut
+// to the waiter's own wLength. Only standard device-to-host requests
+// (GET_DESCRIPTOR, GET_STATUS, ...) are shared: they have no side effects,
+// so one answer serves all. The table holds a few entries; lookups scan it.
+class ControlRequestManager {
+ public:
+  // Whether requests with this SETUP packet may share a transfer
+  static bool shareable(const uint8_t *setup) { return (setup[0] & 0xE0) == 0x80; }
+
+  // Register 'done' for the request in 'setup'. Returns 0 if it was attached
+  // to an identical request in flight; otherwise the id of a new request,
+  // which the caller issues and later passes to complete() (or to drop() if
+  // the host stack refused it).
+  uint32_t add(void *client, const uint8_t *setup, transfer_done_t done);
+  // Whether add() would attach a request to one in flight
+  bool joinable(void *client, const uint8_t *setup) const { return this->match(client, setup) != nullptr; }
+  // Call every waiter of request 'id' with 'res' and forget the request.
+  // Unknown ids are ignored.
+  void complete(uint32_t id, const UsbTransferResult &res);
+  // Forget request 'id' without calling its waiters
+  void drop(uint32_t id);
+  // Complete every request of 'client' with 'res' (its device went away)
+  void fail_client(void *client, const UsbTransferResult &res);
+
+  // Requests in flight, and requests that attached to one over time
+  size_t in_flight() const;
+  uint32_t shared() const { return this->shared_; }
+
+ protected:
+  struct Waiter {
+    uint16_t length;
+    transfer_done_t done;
+  };
+  struct Request {
+    // 0 while the entry is free; the low 16 bits are the entry's index + 1
+    uint32_t id{0};
+    void *client{nullptr};
+    uint8_t setup[8]{};
+    std::vector<Waiter> waiters{};
+  };
+  Request *find(uint32_t id);
+  // In-flight request an identical one with up to the same wLength can join
+  const Request *match(void *client, const uint8_t *setup) const;
+
+  std::vector<Request> requests_{};
+  uint16_t seq_{0};
+  uint32_t shared_{0};
+};
 
 // Abstract USB host adapter interface. Implement this for a real USB host
 // backend (ESP-IDF, TinyUSB, etc.). The dummy implementation provided in
@@ -40,28 +269,125 @@ class USBHostAdapter {
   // cache the descriptor once retrieved.
   virtual void request_device_descriptor(void *client_ptr) = 0;
 
-  // Retrieve a cached device descriptor for a client. Returns true if a
-  // cached descriptor is available and copied into 'out'.
-  virtual bool get_device_descriptor(void *client_ptr, std::vector<uint8_t> &out) = 0;
+  // View of the cached device descriptor of a client. Never allocates or
+  // copies, so it is cheap enough to poll every loop.
+  virtual DescriptorView device_descriptor(void *client_ptr) const = 0;
 
   // Request the configuration descriptor for the client (asynchronous). The
   // implementation may fetch it in segments and cache the full descriptor.
   virtual void request_config_descriptor(void *client_ptr) = 0;
 
-  // Retrieve a cached configuration descriptor for a client. Returns true if
-  // a cached configuration descriptor is available and copied into 'out'.
-  virtual bool get_config_descriptor(void *client_ptr, std::vector<uint8_t> &out) = 0;
+  // View of the cached configuration descriptor (all wTotalLength bytes).
+  virtual DescriptorView config_descriptor(void *client_ptr) const = 0;
 
   // Request a string descriptor (by index) for the client. Asynchronous;
   // implementations should cache the raw string descriptor bytes when ready.
   virtual void request_string_descriptor(void *client_ptr, int index) = 0;
 
-  // Retrieve a cached string descriptor for the client. Returns true if a
-  // cached descriptor is available and copied into 'out'. The returned data
-  // should be the raw USB string descriptor bytes (UTF-16LE encoded).
-  virtual bool get_string_descriptor(void *client_ptr, int index, std::vector<uint8_t> &out) = 0;
+  // View of a cached string descriptor: the raw USB string descriptor bytes
+  // (bLength, bDescriptorType, UTF-16LE characters), in the device's first
+  // LANGID from string descriptor 0.
+  virtual DescriptorView string_descriptor(void *client_ptr, int index) const = 0;
+
+  // The same string converted to UTF-8 once when it was cached (no
+  // terminator). Not available for index 0.
+  virtual DescriptorView string_utf8(void *client_ptr, int index) const = 0;
+
+  // A cached string in exactly LANGID 'langid' (ignored for index 0), for
+  // answering a GET_DESCRIPTOR from the cache; not ready if that LANGID
+  // was never read. Adapters without a cache keep the default.
+  virtual DescriptorView string_descriptor_langid(void *client_ptr, int index, uint16_t langid) const {
+    return DescriptorView{};
+  }
+
+  // Announce the exported clients, in registration order, before any other
+  // call that names a client. Adapters that cache descriptors reserve their
+  // storage here: per client up to 'config_capacity' bytes of configuration
+  // descriptor and 'string_capacity' bytes of string descriptors.
+  virtual void register_clients(void *const *clients, size_t count, size_t config_capacity,
+                                size_t string_capacity) {}
+
+  // Bytes reserved for cached descriptors
+  virtual size_t descriptor_memory() const { return 0; }
+
+  // Persistent descriptor cache. save_descriptors() appends what is cached
+  // for a client to 'out' as one record; restore_descriptors() loads a
+  // record saved before a reboot. Restored descriptors are served at once
+  // while the adapter re-reads the device descriptor and serial number in
+  // the background; if the device turns out to be a different one, the
+  // record is dropped and everything is fetched again. Adapters without a
+  // cache keep the defaults.
+  virtual bool save_descriptors(void *client_ptr, std::vector<uint8_t> &out) const { return false; }
+  virtual bool restore_descriptors(void *client_ptr, const uint8_t *data, size_t len) { return false; }
+
+  // Incremented whenever any cached descriptor is added or replaced. Callers
+  // can skip re-reading descriptors while the value is unchanged.
+  virtual uint32_t descriptor_generation() const = 0;
+  // Same for the descriptors of one client only, so callers can tell which
+  // client changed. Adapters without per-client tracking keep the default.
+  virtual uint32_t client_generation(void *client_ptr) const { return this->descriptor_generation(); }
+
+  // Hotplug. Adapters that can tell whether a client's device is plugged in
+  // report changes to the listener, from poll(). Before reporting a removal
+  // they complete the client's outstanding transfers with
+  // USB_STATUS_NODEV and drop its cached descriptors. device_attached() is
+  // the current state; adapters without hotplug report every client as
+  // attached and never call the listener.
+  virtual bool device_attached(void *client_ptr) const { return true; }
+  void set_device_listener(device_event_t listener) { this->device_listener_ = std::move(listener); }
+
+  // Copying accessors. Return true if the descriptor is cached and copied
+  // into 'out'.
+  bool get_device_descriptor(void *client_ptr, std::vector<uint8_t> &out) const {
+    return copy_view(this->device_descriptor(client_ptr), out);
+  }
+  bool get_config_descriptor(void *client_ptr, std::vector<uint8_t> &out) const {
+    return copy_view(this->config_descriptor(client_ptr), out);
+  }
+  bool get_string_descriptor(void *client_ptr, int index, std::vector<uint8_t> &out) const {
+    return copy_view(this->string_descriptor(client_ptr, index), out);
+  }
+
+  // Submit a control, bulk, interrupt or isochronous transfer to the given
+  // client (asynchronous). Adapters whose host stack has no isochronous
+  // support reject those with INVALID_TRANSFER. Any number of transfers may be outstanding per client;
+  // those the host stack cannot accept yet are queued in submission order.
+  // 'done' is invoked exactly once, from poll() or the host stack's event
+  // context. Returns INVALID_TRANSFER if the transfer was rejected, in which
+  // case 'done' is never called.
+  virtual transfer_handle_t submit_transfer(void *client_ptr, const UsbTransfer &xfer, transfer_done_t done) = 0;
+
+  // Cancel an outstanding transfer; its callback runs with
+  // USB_STATUS_CONNRESET. Returns false if the transfer already completed.
+  virtual bool cancel_transfer(transfer_handle_t handle) = 0;
+
+  // Number of submitted transfers that have not completed yet
+  virtual size_t transfers_in_flight() const = 0;
+
+  // Draw request buffers from 'pool' (shared with the USB/IP engine; used
+  // from the main loop only)
+  void set_buffer_pool(BufferPool *pool) { this->pool_ = pool; }
+
+ protected:
+  // A buffer of 'len' bytes for a request, and its return once the host
+  // stack no longer needs it
+  std::vector<uint8_t> take_buffer(size_t len) {
+    return this->pool_ != nullptr ? this->pool_->take(len) : std::vector<uint8_t>(len);
+  }
+  void give_buffer(std::vector<uint8_t> &&buf) {
+    if (this->pool_ != nullptr) this->pool_->give(std::move(buf));
+  }
+  static bool copy_view(const DescriptorView &v, std::vector<uint8_t> &out) {
+    if (!v.ready) return false;
+    out.assign(v.begin(), v.end());
+    return true;
+  }
+  void notify_device(void *client_ptr, bool attached) {
+    if (this->device_listener_) this->device_listener_(client_ptr, attached);
+  }
 
-  // TODO: add methods to enumerate devices and submit transfers.
+  BufferPool *pool_{nullptr};
+  device_event_t device_listener_{};
 };
 
 // Factory to create a simple dummy host implementation (no real USB access).
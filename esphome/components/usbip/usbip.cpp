@@ -6,8 +6,11 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
+#include <algorithm>
 #include <cstdio>
 #include <cstring>
+#include <cmath>
 #include <chrono>
 #ifdef ESP_PLATFORM
 #include "esphome/components/usb_host/usb_host.h"
@@ -19,6 +22,40 @@ namespace usbip {
 
 static const char *TAG = "usbip";
 
+// Control requests not answered within this time complete with -ETIMEDOUT
+// (USB 2.0 9.2.6.4 allows devices up to 5 s for a request with a data stage)
+static const uint32_t CONTROL_TIMEOUT_MS = 5000;
+
+// Bounds of the adaptive per-connection recv() size
+static const size_t RX_CHUNK_MIN = 512;
+static const size_t RX_CHUNK_MAX = 8192;
+// Background work runs at least once per this many loops, even when the
+// I/O tasks used up the whole budget
+static const uint8_t BACKGROUND_MAX_DEFER = 8;
+// Interrupt transfers kept queued per polled endpoint: one stays armed
+// while the previous report waits for the client's CMD_SUBMIT
+static const uint8_t INTERRUPT_DEPTH = 2;
+
+// Current time in microseconds (portable)
+static uint32_t now_us() {
+#ifdef ESP_PLATFORM
+  return (uint32_t)esp_timer_get_time();
+#else
+  using namespace std::chrono;
+  return (uint32_t)duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// Current time in milliseconds (portable)
+static uint32_t now_ms() {
+#ifdef ESP_PLATFORM
+  return (uint32_t)(esp_timer_get_time() / 1000ULL);
+#else
+  using namespace std::chrono;
+  return (uint32_t)duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
 void USBIPComponent::setup() {
   ESP_LOGCONFIG(TAG, "Setting up USB/IP server (port=%u)", this->port_);
   ESP_LOGI(TAG, "USBIPComponent setup() entering");
@@ -34,7 +71,13 @@ void USBIPComponent::setup() {
   }
 #endif
 
+  // Seed the transfer buffer pool with the control endpoint's packet size
+  // (64) and the adapter's largest control IN request (512); endpoints and
+  // URBs add their own sizes as devices get imported
+  this->buffers_.add_size(64);
+  this->buffers_.add_size(512);
   if (this->host_) {
+    this->host_->set_buffer_pool(&this->buffers_);
     ESP_LOGI(TAG, "Starting host adapter...");
     if (!this->host_->begin()) {
       ESP_LOGE(TAG, "USB host adapter failed to start");
@@ -44,49 +87,86 @@ void USBIPComponent::setup() {
     }
   }
 
-  // Request descriptors for any registered clients
-  this->client_descriptors_.resize(this->exported_clients_.size());
-  this->last_string_request_ms_.resize(this->exported_clients_.size());
-  this->request_client_descriptors();
+  this->connections_.resize(this->max_connections_);
+  for (auto &conn : this->connections_) conn.tx.set_pool(&this->buffers_);
+  // One pollfd for the listening socket plus one per connection
+  this->pollfds_.resize(this->max_connections_ + 1);
+
+  // Per-client tables, indexed by registration order
+  size_t nclients = this->devices_.size();
+  if (this->host_) {
+    this->host_->register_clients(this->devices_.clients(), nclients, this->config_cache_size_,
+                                  this->string_cache_size_);
+    for (size_t i = 0; i < nclients; ++i) this->devices_.set_attached(i, this->host_->device_attached(this->devices_[i].client));
+    this->host_->set_device_listener([this](void *client, bool attached) { this->on_device_event(client, attached); });
+  }
+
+  // Start warming the descriptor cache right away so the first
+  // OP_REQ_DEVLIST finds it populated
+  this->restore_descriptors();
+  this->prefetcher_.begin(this->host_.get(), this->devices_.clients(), nclients);
+  this->prefetcher_.run(now_ms());
+
+  this->capture_.configure(this->capture_records_);
 }
 
-void USBIPComponent::start_server() {
-  if (this->server_started_) return;
-  ESP_LOGI(TAG, "Starting TCP server on port %u", this->port_);
-  // Create a non-blocking TCP listening socket
-  this->server_fd_ = socket(AF_INET, SOCK_STREAM, 0);
-  if (this->server_fd_ < 0) {
+// Create a non-blocking TCP listening socket; -1 on failure
+static int open_listener(uint16_t port, int backlog) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
     ESP_LOGE(TAG, "Failed to create socket: %d", errno);
-    return;
+    return -1;
   }
 
-  int flags = fcntl(this->server_fd_, F_GETFL, 0);
-  if (flags >= 0) fcntl(this->server_fd_, F_SETFL, flags | O_NONBLOCK);
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags >= 0) fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 
   struct sockaddr_in addr;
   addr.sin_family = AF_INET;
   addr.sin_addr.s_addr = INADDR_ANY;
-  addr.sin_port = htons(this->port_);
+  addr.sin_port = htons(port);
 
   int opt = 1;
-  setsockopt(this->server_fd_, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
 
-  if (bind(this->server_fd_, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-    ESP_LOGE(TAG, "bind() failed: %d", errno);
-    close(this->server_fd_);
-    this->server_fd_ = -1;
-    return;
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    ESP_LOGE(TAG, "bind() on port %u failed: %d", port, errno);
+    close(fd);
+    return -1;
   }
 
-  if (listen(this->server_fd_, 1) < 0) {
-    ESP_LOGE(TAG, "listen() failed: %d", errno);
-    close(this->server_fd_);
-    this->server_fd_ = -1;
-    return;
+  if (listen(fd, backlog) < 0) {
+    ESP_LOGE(TAG, "listen() on port %u failed: %d", port, errno);
+    close(fd);
+    return -1;
   }
+  return fd;
+}
 
+void USBIPComponent::start_server() {
+  if (this->server_started_) return;
+  ESP_LOGI(TAG, "Starting TCP server on port %u", this->port_);
+  this->server_fd_ = open_listener(this->port_, this->max_connections_);
+  if (this->server_fd_ < 0) return;
   ESP_LOGI(TAG, "Listening for USB/IP clients on port %u", this->port_);
   this->server_started_ = true;
+
+  if (this->net_task_enabled_) {
+    // The task takes over the listening socket; without it the main loop
+    // serves the sockets as usual
+    this->net_task_.reset(new NetTask());
+    if (this->net_task_->start(this->server_fd_, this->connections_.size(), this->net_task_core_,
+                               this->net_task_priority_)) {
+      ESP_LOGI(TAG, "Socket I/O runs in the network task");
+    } else {
+      this->net_task_.reset();
+    }
+  }
+
+  if (this->capture_.enabled() && this->capture_port_ != 0) {
+    this->capture_server_fd_ = open_listener(this->capture_port_, 1);
+    if (this->capture_server_fd_ >= 0) ESP_LOGI(TAG, "Serving pcap captures on port %u", this->capture_port_);
+  }
 }
 
 void USBIPComponent::set_esphome_host(void *host_ptr) {
@@ -102,461 +182,1320 @@ void USBIPComponent::set_esphome_host(void *host_ptr) {
 
 void USBIPComponent::loop() {
   // Ensure TCP server is started from the first loop iterations
-  // Helper to get current time in milliseconds (portable)
-  auto now_ms = []() -> uint32_t {
-#ifdef ESP_PLATFORM
-    return (uint32_t)(esp_timer_get_time() / 1000ULL);
-#else
-    using namespace std::chrono;
-    return (uint32_t)duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
-#endif
-  };
-
   if (!this->server_started_) {
     this->start_server();
   }
 
-  // Flush any pending send buffer in a non-blocking way (do this early in loop)
-  if (this->sending_devlist_ && !this->send_buf_.empty() && this->client_fd_ >= 0) {
-    const size_t CHUNK = 512; // smaller chunk to yield frequently
-    size_t remaining = this->send_buf_.size() - this->send_offset_;
-    size_t to_send = std::min(CHUNK, remaining);
-    ssize_t s = send(this->client_fd_, this->send_buf_.data() + this->send_offset_, to_send, 0);
-    if (s > 0) {
-      this->send_offset_ += (size_t)s;
-      if (this->send_offset_ >= this->send_buf_.size()) {
-        ESP_LOGI(TAG, "Finished non-blocking send of devlist (total=%u)", (unsigned)this->send_buf_.size());
-        this->send_buf_.clear();
-        this->send_offset_ = 0;
-        this->sending_devlist_ = false;
-        this->pending_devlist_ = false;
-      }
-    } else if (s < 0) {
-      if (errno != EWOULDBLOCK && errno != EAGAIN) {
-        ESP_LOGW(TAG, "send() failed while flushing devlist: %d", errno);
-        close(this->client_fd_);
-        this->client_fd_ = -1;
-        this->send_buf_.clear();
-        this->send_offset_ = 0;
-        this->sending_devlist_ = false;
-        this->pending_devlist_ = false;
-      }
-    }
+  // Work is split into tasks that run in priority order and share one time
+  // budget per loop(), so USB/IP traffic cannot stall the other components.
+  // Network and USB I/O always get a turn (bounded by the budget inside
+  // their loops); background descriptor work only runs with time left, or
+  // after it has been deferred for BACKGROUND_MAX_DEFER loops.
+  uint32_t start = now_us();
+  this->loop_deadline_us_ = start + this->loop_budget_us_;
+  if (this->server_fd_ >= 0) this->run_net_rx();
+  this->run_usb();
+  if (this->server_fd_ >= 0) this->run_net_tx();
+  if (!this->budget_exhausted() || ++this->background_deferred_ >= BACKGROUND_MAX_DEFER) {
+    this->background_deferred_ = 0;
+    this->run_background();
+  }
+  if (this->net_task_wake_) {
+    this->net_task_wake_ = false;
+    this->net_task_->wake();
   }
+  this->metrics_.loop_us.record(now_us() - start);
+}
+
+bool USBIPComponent::budget_exhausted() const { return (int32_t)(now_us() - this->loop_deadline_us_) >= 0; }
 
-  if (this->server_fd_ < 0) {
-    // Server not available yet; still poll host and update descriptors
-    if (this->host_) this->host_->poll();
-    this->update_client_descriptors();
+void USBIPComponent::run_net_rx() {
+  if (this->net_task_) {
+    this->run_net_events();
     return;
   }
+  // One readiness pass over the listening socket and every connection.
+  // pollfds_[0] is the listening socket; slot i of connections_ maps to
+  // pollfds_[poll_index[i]] (0 when the slot is unused).
+  size_t nfds = 0;
+  this->pollfds_[nfds].fd = this->server_fd_;
+  this->pollfds_[nfds].events = POLLIN;
+  this->pollfds_[nfds].revents = 0;
+  nfds++;
+  for (size_t i = 0; i < this->connections_.size(); ++i) {
+    auto &conn = this->connections_[i];
+    conn.poll_index = 0;
+    if (conn.fd < 0) continue;
+    conn.poll_index = nfds;
+    this->pollfds_[nfds].fd = conn.fd;
+    this->pollfds_[nfds].events = POLLIN | (conn.tx.empty() ? 0 : POLLOUT);
+    this->pollfds_[nfds].revents = 0;
+    nfds++;
+  }
+  int ready = ::poll(this->pollfds_.data(), nfds, 0);
+  if (ready < 0 && errno != EINTR) {
+    ESP_LOGD(TAG, "poll() failed: %d", errno);
+  }
+  if (ready <= 0) return;
 
-  // Accept a single client (non-blocking)
-  if (this->client_fd_ < 0) {
-    struct sockaddr_in client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    int fd = accept(this->server_fd_, (struct sockaddr *)&client_addr, &client_len);
-    if (fd >= 0) {
-      // Set non-blocking on client
-      int flags = fcntl(fd, F_GETFL, 0);
-      if (flags >= 0) fcntl(fd, F_SETFL, flags | O_NONBLOCK);
-      this->client_fd_ = fd;
-      ESP_LOGI(TAG, "Accepted client %s:%u", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
-    } else {
-      if (errno != EWOULDBLOCK && errno != EAGAIN) {
-        // Unexpected error
-        // Log at debug level to avoid flooding
-        ESP_LOGD(TAG, "accept() returned %d (errno=%d)", fd, errno);
-      }
+  if (this->pollfds_[0].revents & POLLIN) this->accept_connection();
+
+  // Read from every readable client. A connection keeps reading while its
+  // chunks come back full (more data is waiting) and budget remains.
+  for (auto &conn : this->connections_) {
+    if (conn.fd < 0 || conn.poll_index == 0) continue;
+    short revents = this->pollfds_[conn.poll_index].revents;
+    if (revents & POLLOUT) conn.tx_blocked = false;
+    if (!(revents & (POLLIN | POLLERR | POLLHUP))) continue;
+    while (this->receive(conn) && !this->budget_exhausted()) {
     }
   }
+}
+
+void USBIPComponent::run_net_events() {
+  NetTask &task = *this->net_task_;
+  NetTask::Counters &counters = task.counters();
+  this->metrics_.rx_bytes += counters.rx_bytes.exchange(0);
+  this->metrics_.tx_bytes += counters.tx_bytes.exchange(0);
+  this->metrics_.tx_eagain += counters.tx_eagain.exchange(0);
+  this->metrics_.tx_short_writes += counters.tx_short_writes.exchange(0);
+  this->metrics_.connections_accepted += counters.accepted.exchange(0);
 
-  // Read from client if present
-  if (this->client_fd_ >= 0) {
-    uint8_t buf[512];
-    ssize_t r = recv(this->client_fd_, buf, sizeof(buf), 0);
-    if (r > 0) {
-      ESP_LOGD(TAG, "Received %d bytes from client", (int)r);
-      // Check for OP_REQ_DEVLIST (USB/IP) and reply with a minimal OP_REP_DEVLIST
-      // If the client sent at least 4 bytes, interpret the first 4 as the command (network byte order)
-      bool handled = false;
-  if (r >= 4) {
-        // USB/IP request header starts with two 16-bit fields: version and command
-        uint16_t ver_net;
-        uint16_t cmd_net16;
-        memcpy(&ver_net, buf + 0, 2);
-        memcpy(&cmd_net16, buf + 2, 2);
-        uint16_t ver = ntohs(ver_net);
-        uint16_t cmd16 = ntohs(cmd_net16);
-        // OP_REQ_DEVLIST command code is 0x8005
-        if (cmd16 == 0x8005) {
-          ESP_LOGI(TAG, "Received OP_REQ_DEVLIST (ver=0x%04X) from usbip client", ver);
-          // Initiate asynchronous descriptor requests; complete the reply in
-          // later loop() iterations when descriptors are ready or timeout
-          // expires to avoid long blocking here.
-          for (auto cptr : this->exported_clients_) {
-            std::vector<uint8_t> tmp;
-            if (!this->host_->get_device_descriptor(cptr, tmp)) {
-              this->host_->request_device_descriptor(cptr);
-            }
-          }
-            // Mark pending and set a deadline (ms since boot). The wait time
-            // is configurable via set_string_wait_ms(); keep a short default
-            // to avoid blocking the client too long.
-            this->pending_devlist_ = true;
-            this->pending_devlist_deadline_ = now_ms() + this->string_wait_ms_;
-          handled = true;
+  // Events of a connection the main loop has already closed carry an old
+  // epoch and are dropped
+  NetTask::Event &ev = this->net_event_;
+  while (!this->budget_exhausted() && task.pop_event(ev)) {
+    if (ev.slot >= this->connections_.size()) continue;
+    Connection &conn = this->connections_[ev.slot];
+    switch (ev.type) {
+      case NetTask::Event::Type::OPENED:
+        if (conn.fd >= 0) this->close_connection(conn);
+        // The descriptor is only a marker here; the task owns the socket
+        conn.fd = ev.fd;
+        conn.epoch = ev.epoch;
+        break;
+      case NetTask::Event::Type::DATA:
+        if (conn.fd < 0 || conn.epoch != ev.epoch) break;
+        if (conn.rx_buf.empty()) {
+          conn.rx_buf.swap(ev.data);
+        } else {
+          conn.rx_buf.insert(conn.rx_buf.end(), ev.data.begin(), ev.data.end());
         }
-      }
-      if (!handled) {
-      // For now, just log hex of first bytes
-      std::string s;
-      s.reserve(r * 3);
-      for (ssize_t i = 0; i < r; ++i) {
-        char tmp[4];
-        snprintf(tmp, sizeof(tmp), "%02X ", buf[i]);
-        s += tmp;
-      }
-      ESP_LOGI(TAG, "Client data (hex): %s", s.c_str());
+        this->process_rx(conn);
+        break;
+      case NetTask::Event::Type::CLOSED:
+        if (conn.fd >= 0 && conn.epoch == ev.epoch) this->close_connection(conn);
+        break;
+    }
+  }
+  // The task stopped reading while the ring was full
+  if (task.take_starved()) this->net_task_wake_ = true;
+}
 
-      // Echo back to client (simple behavior to test round-trip)
-      ssize_t w = send(this->client_fd_, buf, r, 0);
-      if (w < 0) {
-        ESP_LOGW(TAG, "send() failed: %d", errno);
-      }
-      }
+void USBIPComponent::run_usb() {
+  if (!this->host_) return;
+  this->host_->poll();
+  uint32_t now = host_now_ms();
+  for (auto &conn : this->connections_) {
+    if (conn.fd < 0 || conn.imported_index < 0) continue;
+    for (auto &s : conn.in_streams) {
+      if (s.active()) s.poll(now);
     }
-    else if (r == 0) {
-      ESP_LOGI(TAG, "Client disconnected");
-      close(this->client_fd_);
-      this->client_fd_ = -1;
-    } else {
-      if (errno != EWOULDBLOCK && errno != EAGAIN) {
-        ESP_LOGW(TAG, "recv() error: %d", errno);
-        close(this->client_fd_);
-        this->client_fd_ = -1;
-      }
+  }
+}
+
+void USBIPComponent::run_net_tx() {
+  // Replies queued by completions in run_usb() go out in this same
+  // iteration unless the socket reported EAGAIN earlier and has not become
+  // writable since. A queue holding more segments than one sendmsg() takes
+  // is flushed again while budget remains.
+  uint32_t now = now_us();
+  for (auto &conn : this->connections_) {
+    if (conn.fd < 0) continue;
+    if (conn.socket_options_pending && this->apply_tx_policy(conn)) conn.socket_options_pending = false;
+    if (conn.detached) this->close_detached(conn);
+    if (conn.fd < 0 || conn.tx_blocked) continue;
+    // Replies held by the THROUGHPUT policy wait for their window to close
+    if (conn.coalescing && conn.imported_index >= 0 && (int32_t)(now - conn.coalesce_deadline_us) < 0 &&
+        conn.tx.bytes() < this->client_options_[conn.imported_index].coalesce_bytes)
+      continue;
+    while (this->flush_send_queue(conn) == TxQueue::FlushResult::PARTIAL && !this->budget_exhausted()) {
     }
   }
-  
-  // Poll USB host if available
-  if (this->host_) {
-    this->host_->poll();
-  }
-
-  // Flush any pending send buffer in a non-blocking way
-  if (this->sending_devlist_ && !this->send_buf_.empty() && this->client_fd_ >= 0) {
-    const size_t CHUNK = 1024;
-    size_t remaining = this->send_buf_.size() - this->send_offset_;
-    size_t to_send = std::min(CHUNK, remaining);
-    ssize_t s = send(this->client_fd_, this->send_buf_.data() + this->send_offset_, to_send, 0);
-    if (s > 0) {
-      this->send_offset_ += (size_t)s;
-      if (this->send_offset_ >= this->send_buf_.size()) {
-        ESP_LOGI(TAG, "Finished non-blocking send of devlist (total=%u)", (unsigned)this->send_buf_.size());
-        this->send_buf_.clear();
-        this->send_offset_ = 0;
-        this->sending_devlist_ = false;
-        this->pending_devlist_ = false;
-      }
-    } else if (s < 0) {
-      if (errno != EWOULDBLOCK && errno != EAGAIN) {
-        ESP_LOGW(TAG, "send() failed while flushing devlist: %d", errno);
-        close(this->client_fd_);
-        this->client_fd_ = -1;
-        this->send_buf_.clear();
-        this->send_offset_ = 0;
-        this->sending_devlist_ = false;
-        this->pending_devlist_ = false;
-      }
+}
+
+void USBIPComponent::close_detached(Connection &conn) {
+  if (!conn.tx.empty()) this->flush_send_queue(conn);
+  if (conn.fd < 0) return;
+  uint32_t waited = now_ms() - conn.detached_ms;
+  if ((conn.tx.empty() && (!this->net_task_ || waited >= DETACH_LINGER_MS)) || waited >= DETACH_CLOSE_MS) {
+    ESP_LOGI(TAG, "Closing connection of unplugged device");
+    this->close_connection(conn);
+  }
+}
+
+void USBIPComponent::on_device_event(void *client, bool attached) {
+  int index = this->devices_.find_client(client);
+  if (index < 0 || !this->devices_.set_attached(index, attached)) return;
+  DeviceTable::Device &dev = this->devices_[index];
+  ESP_LOGI(TAG, "Device %s %s", dev.busid, attached ? "attached" : "unplugged");
+  if (attached) {
+    // Fetch everything again; it may be another device than before
+    this->prefetcher_.restart(index);
+    return;
+  }
+  this->prefetcher_.cancel(index);
+  dev.device_len = 0;
+  // The adapter has already completed the device's host transfers with
+  // -ENODEV; answer the CMD_SUBMITs the IN streams hold the same way. Later
+  // CMD_SUBMITs find no imported device and get -ENODEV too.
+  for (auto &conn : this->connections_) {
+    if (conn.fd < 0 || conn.imported_index != index) continue;
+    for (auto &s : conn.in_streams) {
+      if (s.active()) s.fail(USB_STATUS_NODEV);
     }
+    conn.imported_index = -1;
+    conn.coalescing = false;
+    conn.detached = true;
+    conn.detached_ms = now_ms();
   }
+}
 
+void USBIPComponent::run_background() {
   // Try to update cached descriptors
   this->update_client_descriptors();
+  this->prefetcher_.run(now_ms());
+  this->persist_descriptors(now_ms());
+  this->publish_metrics(now_ms());
+  this->run_capture_export();
+
+  // Complete OP_REQ_DEVLIST replies once descriptors are ready or the
+  // per-request deadline expired
+  bool any_pending = false;
+  for (auto &conn : this->connections_) {
+    if (conn.fd >= 0 && conn.pending_devlist && !conn.sending_devlist) any_pending = true;
+  }
+  if (!any_pending) return;
+
+  // The prefetcher keeps fetching missing descriptors in the background;
+  // replies wait for it until their deadline
+  bool descriptors_ready = this->devlist_descriptors_ready();
+  uint32_t now = now_ms();
+  for (auto &conn : this->connections_) {
+    if (conn.fd < 0 || !conn.pending_devlist || conn.sending_devlist) continue;
+    if (!descriptors_ready && (int32_t)(now - conn.pending_devlist_deadline) < 0) continue;
+    this->queue_devlist_reply(conn);
+    // pending_devlist remains true until send buffer completely flushed
+  }
+}
+
+void USBIPComponent::publish_metrics(uint32_t now) {
+  uint32_t window_ms = now - this->last_metrics_publish_ms_;
+  if (window_ms < this->metrics_update_interval_ms_) return;
+  this->last_metrics_publish_ms_ = now;
+
+  UsbipMetrics &m = this->metrics_;
+  Histogram &fetch = this->prefetcher_.fetch_latency_ms();
+  MetricsSnapshot &prev = this->metrics_published_;
+  // Averages over the window since the previous publish; NAN when the
+  // window saw no samples
+  auto window_avg = [](uint64_t sum, uint64_t prev_sum, uint32_t count, uint32_t prev_count) -> float {
+    return count == prev_count ? NAN : (float)(sum - prev_sum) / (float)(count - prev_count);
+  };
+  float loop_avg = window_avg(m.loop_us.sum(), prev.loop_sum, m.loop_us.count(), prev.loop_count);
+  float urb_avg = window_avg(m.urb_rtt_us.sum(), prev.urb_sum, m.urb_rtt_us.count(), prev.urb_count);
+  float rx_rate = (float)(m.rx_bytes - prev.rx_bytes) * 1000.0f / (float)window_ms;
+  float tx_rate = (float)(m.tx_bytes - prev.tx_bytes) * 1000.0f / (float)window_ms;
+  size_t open = 0;
+  for (const auto &conn : this->connections_) {
+    if (conn.fd >= 0) open++;
+  }
+  size_t in_flight = this->host_ ? this->host_->transfers_in_flight() : 0;
+
+#ifdef USE_SENSOR
+  float fetch_avg = window_avg(fetch.sum(), prev.fetch_sum, fetch.count(), prev.fetch_count);
+  float interrupt_avg = window_avg(m.interrupt_latency_us.sum(), prev.interrupt_sum, m.interrupt_latency_us.count(),
+                                   prev.interrupt_count);
+  if (this->loop_time_sensor_ != nullptr) this->loop_time_sensor_->publish_state(loop_avg);
+  if (this->loop_time_max_sensor_ != nullptr) this->loop_time_max_sensor_->publish_state(m.loop_us.max());
+  if (this->rx_rate_sensor_ != nullptr) this->rx_rate_sensor_->publish_state(rx_rate);
+  if (this->tx_rate_sensor_ != nullptr) this->tx_rate_sensor_->publish_state(tx_rate);
+  if (this->send_eagain_sensor_ != nullptr) this->send_eagain_sensor_->publish_state(m.tx_eagain);
+  if (this->short_writes_sensor_ != nullptr) this->short_writes_sensor_->publish_state(m.tx_short_writes);
+  if (this->connections_sensor_ != nullptr) this->connections_sensor_->publish_state(open);
+  if (this->transfers_in_flight_sensor_ != nullptr) this->transfers_in_flight_sensor_->publish_state(in_flight);
+  if (this->descriptor_fetch_latency_sensor_ != nullptr && !std::isnan(fetch_avg))
+    this->descriptor_fetch_latency_sensor_->publish_state(fetch_avg);
+  if (this->urb_latency_sensor_ != nullptr) this->urb_latency_sensor_->publish_state(urb_avg);
+  if (this->interrupt_latency_sensor_ != nullptr) this->interrupt_latency_sensor_->publish_state(interrupt_avg);
+  if (this->buffer_pool_high_water_sensor_ != nullptr)
+    this->buffer_pool_high_water_sensor_->publish_state(this->buffers_.high_water_bytes());
+#endif
+#ifdef USE_TEXT_SENSOR
+  if (this->metrics_summary_text_sensor_ != nullptr) {
+    char buf[192];
+    snprintf(buf, sizeof(buf),
+             "loop p99<%uus max %uus, urb p99<%uus, %u conn, %u xfer, %u cached, eagain %u, short %u, pool hw %uB",
+             (unsigned)m.loop_us.quantile_bound(0.99f), (unsigned)m.loop_us.max(),
+             (unsigned)m.urb_rtt_us.quantile_bound(0.99f), (unsigned)open, (unsigned)in_flight,
+             (unsigned)m.urbs_from_cache, (unsigned)m.tx_eagain, (unsigned)m.tx_short_writes,
+             (unsigned)this->buffers_.high_water_bytes());
+    this->metrics_summary_text_sensor_->publish_state(buf);
+  }
+#endif
+  ESP_LOGV(TAG, "Metrics: loop avg %.0fus max %uus, rx %.0fB/s, tx %.0fB/s, urb avg %.0fus, %u conn, %u xfer",
+           loop_avg, (unsigned)m.loop_us.max(), rx_rate, tx_rate, urb_avg, (unsigned)open, (unsigned)in_flight);
 
-  if (this->pending_devlist_) {
-    bool all_device_ready = true;
-    for (auto cptr : this->exported_clients_) {
-      std::vector<uint8_t> tmp;
-      if (!this->host_->get_device_descriptor(cptr, tmp)) { all_device_ready = false; break; }
+  prev = MetricsSnapshot{m.rx_bytes,
+                         m.tx_bytes,
+                         m.loop_us.count(),
+                         m.loop_us.sum(),
+                         m.urb_rtt_us.count(),
+                         m.urb_rtt_us.sum(),
+                         fetch.count(),
+                         fetch.sum(),
+                         m.interrupt_latency_us.count(),
+                         m.interrupt_latency_us.sum()};
+  m.loop_us.reset_max();
+  m.urb_rtt_us.reset_max();
+  m.interrupt_latency_us.reset_max();
+  fetch.reset_max();
+}
+
+void USBIPComponent::run_capture_export() {
+  if (this->capture_server_fd_ < 0) return;
+  if (this->capture_fd_ < 0) {
+    int fd = accept(this->capture_server_fd_, nullptr, nullptr);
+    if (fd < 0) return;
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags >= 0) fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    // Snapshot the ring now; the client gets what was captured up to here
+    std::vector<uint8_t> pcap;
+    this->capture_.export_pcap(pcap, this->port_);
+    ESP_LOGI(TAG, "Sending capture of %u PDUs (%u bytes)", (unsigned)this->capture_.size(), (unsigned)pcap.size());
+    this->capture_fd_ = fd;
+    this->capture_tx_.push_buffer(std::move(pcap));
+  }
+  size_t sent = 0;
+  TxQueue::FlushResult result = this->capture_tx_.flush(this->capture_fd_, sent);
+  if (result == TxQueue::FlushResult::DRAINED || result == TxQueue::FlushResult::ERROR ||
+      result == TxQueue::FlushResult::IDLE) {
+    close(this->capture_fd_);
+    this->capture_fd_ = -1;
+    this->capture_tx_.clear();
+  }
+}
+
+#ifndef ESP_PLATFORM
+bool USBIPComponent::write_capture_file(const char *path) const {
+  std::vector<uint8_t> pcap;
+  this->capture_.export_pcap(pcap, this->port_);
+  FILE *f = fopen(path, "wb");
+  if (f == nullptr) {
+    ESP_LOGE(TAG, "Cannot open capture file %s: %d", path, errno);
+    return false;
+  }
+  bool ok = fwrite(pcap.data(), 1, pcap.size(), f) == pcap.size();
+  ok = fclose(f) == 0 && ok;
+  if (!ok) ESP_LOGE(TAG, "Failed to write capture file %s", path);
+  return ok;
+}
+#endif
+
+bool USBIPComponent::devlist_descriptors_ready() {
+  if (!this->host_) return true;
+  // The answer only changes with the adapter's descriptor generation and
+  // when devices come or go
+  uint32_t gen = this->host_->descriptor_generation();
+  uint32_t version = this->devices_.version();
+  if (this->ready_checked_ && gen == this->ready_generation_ && version == this->ready_version_)
+    return this->ready_cached_;
+  bool ready = true;
+  for (size_t i = 0; i < this->devices_.size(); ++i) {
+    // Unplugged devices are not listed, so nothing waits for them
+    if (!this->devices_[i].attached) continue;
+    void *cptr = this->devices_[i].client;
+    DescriptorView devd = this->host_->device_descriptor(cptr);
+    // Check whether the configuration descriptor and the required strings
+    // (iManufacturer/iProduct) are cached.
+    if (!devd.ready || devd.size() < 16) {
+      ready = false;
+      break;
+    }
+    int iManufacturer = devd[14];
+    int iProduct = devd[15];
+    if (!this->host_->config_descriptor(cptr).ready ||
+        (iManufacturer > 0 && !this->host_->string_descriptor(cptr, iManufacturer).ready) ||
+        (iProduct > 0 && !this->host_->string_descriptor(cptr, iProduct).ready)) {
+      ready = false;
+      break;
     }
+  }
+  this->ready_checked_ = true;
+  this->ready_generation_ = gen;
+  this->ready_version_ = version;
+  this->ready_cached_ = ready;
+  return ready;
+}
 
-    // Check whether required strings (iManufacturer/iProduct) are cached.
-    bool all_strings_ready = true;
-    for (auto cptr : this->exported_clients_) {
-      std::vector<uint8_t> devd;
-      if (!this->host_->get_device_descriptor(cptr, devd) || devd.size() < 16) { all_strings_ready = false; break; }
-      int iManufacturer = devd[14];
-      int iProduct = devd[15];
-      std::vector<uint8_t> tmp;
-      if (iManufacturer > 0 && !this->host_->get_string_descriptor(cptr, iManufacturer, tmp)) { all_strings_ready = false; break; }
-      if (iProduct > 0 && !this->host_->get_string_descriptor(cptr, iProduct, tmp)) { all_strings_ready = false; break; }
+void USBIPComponent::accept_connection() {
+  struct sockaddr_in client_addr;
+  socklen_t client_len = sizeof(client_addr);
+  int fd = accept(this->server_fd_, (struct sockaddr *)&client_addr, &client_len);
+  if (fd < 0) {
+    if (errno != EWOULDBLOCK && errno != EAGAIN) {
+      // Unexpected error
+      // Log at debug level to avoid flooding
+      ESP_LOGD(TAG, "accept() returned %d (errno=%d)", fd, errno);
     }
+    return;
+  }
 
-    // While waiting for the devlist deadline, issue conservative, rate-limited
-    // retries for missing string descriptors so they may be available when we
-    // compose the reply. We avoid busy-waiting by checking last attempt times.
-    if ((!all_device_ready || !all_strings_ready) && now_ms() < this->pending_devlist_deadline_) {
-      // For each client, find string indices and request them if sufficient
-      for (size_t ci = 0; ci < this->exported_clients_.size(); ++ci) {
-        void *cptr = this->exported_clients_[ci];
-        std::vector<uint8_t> devd;
-        if (!this->host_->get_device_descriptor(cptr, devd) || devd.size() < 16) continue;
-        int iManufacturer = devd[14];
-        int iProduct = devd[15];
-        auto try_request = [&](int idx) {
-          if (idx <= 0) return;
-          uint32_t now = now_ms();
-          auto &map = this->last_string_request_ms_[ci];
-          auto it = map.find(idx);
-          if (it == map.end() || now - it->second >= this->string_request_interval_ms_) {
-            // issue a non-blocking request (adapter will handle retries/fallback)
-            this->host_->request_string_descriptor(cptr, idx);
-            map[idx] = now;
-          }
-        };
-        try_request(iManufacturer);
-        try_request(iProduct);
+  Connection *slot = nullptr;
+  for (auto &conn : this->connections_) {
+    if (conn.fd < 0) {
+      slot = &conn;
+      break;
+    }
+  }
+  if (slot == nullptr) {
+    ESP_LOGW(TAG, "Rejecting client %s:%u: all %u connections in use", inet_ntoa(client_addr.sin_addr),
+             ntohs(client_addr.sin_port), (unsigned)this->connections_.size());
+    close(fd);
+    return;
+  }
+
+  // Set non-blocking on client
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags >= 0) fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  slot->fd = fd;
+  slot->epoch = ++this->next_epoch_;
+  this->metrics_.connections_accepted++;
+  ESP_LOGI(TAG, "Accepted client %s:%u (connection %u)", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port),
+           (unsigned)(slot - this->connections_.data()));
+}
+
+bool USBIPComponent::receive(Connection &conn) {
+  // Read straight into the tail of rx_buf. The chunk size adapts to the
+  // traffic: it doubles while reads fill it (bulk transfers streaming in)
+  // and shrinks again when they come back mostly empty.
+  size_t chunk = conn.rx_chunk;
+  size_t old_size = conn.rx_buf.size();
+  conn.rx_buf.resize(old_size + chunk);
+  ssize_t r = recv(conn.fd, conn.rx_buf.data() + old_size, chunk, 0);
+  conn.rx_buf.resize(old_size + (r > 0 ? (size_t)r : 0));
+  if (r > 0) {
+    ESP_LOGV(TAG, "Received %d bytes from client", (int)r);
+    this->metrics_.rx_bytes += (size_t)r;
+    if ((size_t)r == chunk && chunk < RX_CHUNK_MAX) {
+      conn.rx_chunk = (uint16_t)(chunk * 2);
+    } else if ((size_t)r < chunk / 4 && chunk > RX_CHUNK_MIN) {
+      conn.rx_chunk = (uint16_t)(chunk / 2);
+    }
+    this->process_rx(conn);
+    return conn.fd >= 0 && (size_t)r == chunk;
+  } else if (r == 0) {
+    ESP_LOGI(TAG, "Client disconnected");
+    this->close_connection(conn);
+  } else {
+    if (errno != EWOULDBLOCK && errno != EAGAIN) {
+      ESP_LOGW(TAG, "recv() error: %d", errno);
+      this->close_connection(conn);
+    }
+  }
+  return false;
+}
+
+void USBIPComponent::process_rx(Connection &conn) {
+  size_t off = 0;
+  while (conn.fd >= 0 && off < conn.rx_buf.size()) {
+    const uint8_t *p = conn.rx_buf.data() + off;
+    size_t avail = conn.rx_buf.size() - off;
+    uint32_t epoch = conn.epoch;
+    size_t used = conn.state == ConnState::OP ? this->handle_op_pdu(conn, p, avail) : this->handle_urb_pdu(conn, p, avail);
+    if (used == 0) {
+      // A PDU the handler rejected (and closed the connection over) is the
+      // one worth looking at; the buffer is cleared but not released yet
+      if (conn.fd < 0 && this->capture_.enabled()) {
+        this->capture_.record(now_us(), (uint16_t)epoch, CaptureRing::Direction::RX, p,
+                              std::min(avail, USBIP_HEADER_SIZE));
       }
-      // Not yet time to finish; return and let retries progress
-      // Poll host and come back
-      if (this->host_) this->host_->poll();
-      this->update_client_descriptors();
+      break;
+    }
+    if (this->capture_.enabled()) this->capture_.record(now_us(), (uint16_t)epoch, CaptureRing::Direction::RX, p, used);
+    off += used;
+  }
+  // close_client() already discarded the buffer if the connection was dropped
+  if (conn.fd >= 0 && off > 0) {
+    conn.rx_buf.erase(conn.rx_buf.begin(), conn.rx_buf.begin() + off);
+  }
+}
+
+size_t USBIPComponent::handle_op_pdu(Connection &conn, const uint8_t *p, size_t len) {
+  if (len < OP_HEADER_SIZE) return 0;
+  // USB/IP request header starts with two 16-bit fields: version and command
+  uint16_t ver = get_be16(p);
+  uint16_t code = get_be16(p + 2);
+  if (code == OP_REQ_DEVLIST) {
+    ESP_LOGI(TAG, "Received OP_REQ_DEVLIST (ver=0x%04X) from usbip client", ver);
+    this->begin_devlist_reply(conn);
+    return OP_HEADER_SIZE;
+  }
+  if (code == OP_REQ_IMPORT) {
+    if (len < OP_IMPORT_REQUEST_SIZE) return 0;
+    ESP_LOGI(TAG, "Received OP_REQ_IMPORT (ver=0x%04X) from usbip client", ver);
+    this->handle_import_request(conn, p + OP_HEADER_SIZE);
+    return OP_IMPORT_REQUEST_SIZE;
+  }
+
+  // Unknown request: drop the connection since we cannot resynchronise the
+  // stream. The capture ring keeps the offending header.
+  ESP_LOGW(TAG, "Unsupported USB/IP operation 0x%04X; closing connection", code);
+  this->close_connection(conn);
+  return 0;
+}
+
+size_t USBIPComponent::handle_urb_pdu(Connection &conn, const uint8_t *p, size_t len) {
+  if (conn.rx_discard > 0 || conn.discard_iso) return this->discard_rx(conn, p, len);
+  if (len < USBIP_HEADER_SIZE) return 0;
+  UsbipHeader h;
+  decode_usbip_header(p, h);
+
+  if (h.command == USBIP_CMD_SUBMIT) {
+    uint32_t length = (uint32_t)h.transfer_buffer_length;
+    uint32_t npackets = h.number_of_packets > 0 ? (uint32_t)h.number_of_packets : 0;
+    if (length > USBIP_MAX_SANE_TRANSFER_LENGTH || npackets > USBIP_MAX_ISO_PACKETS) {
+      ESP_LOGW(TAG, "CMD_SUBMIT seqnum=%u too large (len=%u packets=%u); closing connection", (unsigned)h.seqnum,
+               (unsigned)length, (unsigned)npackets);
+      this->close_connection(conn);
+      return 0;
+    }
+    if (length > USBIP_MAX_TRANSFER_LENGTH) return this->reject_oversized(conn, h, p, len);
+    size_t out_len = h.direction == USBIP_DIR_OUT ? length : 0;
+    size_t need = USBIP_HEADER_SIZE + out_len + npackets * USBIP_ISO_DESC_SIZE;
+    if (len < need) return 0;
+    this->handle_cmd_submit(conn, h, p + USBIP_HEADER_SIZE);
+    return need;
+  }
+  if (h.command == USBIP_CMD_UNLINK) {
+    this->handle_cmd_unlink(conn, h);
+    return USBIP_HEADER_SIZE;
+  }
+
+  ESP_LOGW(TAG, "Unknown USB/IP command 0x%08X; closing connection", (unsigned)h.command);
+  this->close_connection(conn);
+  return 0;
+}
+
+size_t USBIPComponent::reject_oversized(Connection &conn, const UsbipHeader &h, const uint8_t *p, size_t len) {
+  ESP_LOGW(TAG, "CMD_SUBMIT seqnum=%u of %u bytes exceeds %u; answering -EINVAL", (unsigned)h.seqnum,
+           (unsigned)h.transfer_buffer_length, (unsigned)USBIP_MAX_TRANSFER_LENGTH);
+  size_t desc_len = (h.number_of_packets > 0 ? (size_t)h.number_of_packets : 0) * USBIP_ISO_DESC_SIZE;
+  if (h.direction == USBIP_DIR_OUT) {
+    // The payload is thrown away as it arrives (see discard_rx()); an
+    // isochronous URB is answered from the descriptors that follow it
+    conn.rx_discard = (uint32_t)h.transfer_buffer_length;
+    if (desc_len > 0) {
+      conn.discard_iso = true;
+      conn.discard_header = h;
+    } else {
+      this->queue_ret_submit(conn, h.seqnum, USB_STATUS_INVALID, nullptr, 0);
+    }
+    return USBIP_HEADER_SIZE;
+  }
+  if (len < USBIP_HEADER_SIZE + desc_len) return 0;
+  if (desc_len > 0) {
+    this->reject_iso(conn, h, p + USBIP_HEADER_SIZE, USB_STATUS_INVALID);
+  } else {
+    this->queue_ret_submit(conn, h.seqnum, USB_STATUS_INVALID, nullptr, 0);
+  }
+  return USBIP_HEADER_SIZE + desc_len;
+}
+
+size_t USBIPComponent::discard_rx(Connection &conn, const uint8_t *p, size_t len) {
+  if (conn.rx_discard > 0) {
+    size_t n = std::min((size_t)conn.rx_discard, len);
+    conn.rx_discard -= (uint32_t)n;
+    return n;
+  }
+  size_t need = (size_t)conn.discard_header.number_of_packets * USBIP_ISO_DESC_SIZE;
+  if (len < need) return 0;
+  conn.discard_iso = false;
+  this->reject_iso(conn, conn.discard_header, p, USB_STATUS_INVALID);
+  return need;
+}
+
+// Fill a struct usbip_usb_device for exported device 'dev'
+static void encode_usbip_device(uint8_t *p, const DeviceTable::Device &dev, const DescriptorView &dev_desc,
+                                const DescriptorView &cfg) {
+  memset(p, 0, USBIP_DEVICE_SIZE);
+  strncpy((char *)p, "/", 255);
+  memcpy(p + 256, dev.busid, USBIP_BUSID_SIZE);
+  uint8_t *n = p + 256 + USBIP_BUSID_SIZE;
+  put_be32(n + 0, dev.busnum);
+  put_be32(n + 4, dev.devnum);
+  put_be32(n + 8, USBIP_SPEED_FULL);
+  put_be16(n + 12, (uint16_t)(dev_desc[8] | (dev_desc[9] << 8)));    // idVendor
+  put_be16(n + 14, (uint16_t)(dev_desc[10] | (dev_desc[11] << 8)));  // idProduct
+  put_be16(n + 16, (uint16_t)(dev_desc[12] | (dev_desc[13] << 8)));  // bcdDevice
+  n[18] = dev_desc[4];  // bDeviceClass
+  n[19] = dev_desc[5];  // bDeviceSubClass
+  n[20] = dev_desc[6];  // bDeviceProtocol
+  n[21] = cfg.size() >= 9 ? cfg[5] : 1;  // bConfigurationValue
+  n[22] = dev_desc[17] ? dev_desc[17] : 1;  // bNumConfigurations
+  n[23] = cfg.size() >= 9 ? cfg[4] : 1;  // bNumInterfaces
+}
+
+void USBIPComponent::handle_import_request(Connection &conn, const uint8_t *busid_raw) {
+  char busid[USBIP_BUSID_SIZE + 1];
+  memcpy(busid, busid_raw, USBIP_BUSID_SIZE);
+  busid[USBIP_BUSID_SIZE] = '\0';
+
+  uint8_t reply[OP_HEADER_SIZE];
+  put_be16(reply + 0, USBIP_VERSION);
+  put_be16(reply + 2, OP_REP_IMPORT);
+
+  int index = this->devices_.find_busid(busid);
+  DescriptorView dev_desc;
+  if (index >= 0 && this->host_ && this->devices_[index].attached)
+    dev_desc = this->host_->device_descriptor(this->devices_[index].client);
+  if (!dev_desc.ready || dev_desc.size() < 18) {
+    ESP_LOGW(TAG, "OP_REQ_IMPORT for unknown, unplugged or not yet enumerated busid '%s'", busid);
+    put_be32(reply + 4, OP_STATUS_NA);
+    this->capture_pdu(conn, CaptureRing::Direction::TX, reply, OP_HEADER_SIZE);
+    this->queue_inline(conn, reply, OP_HEADER_SIZE);
+    return;
+  }
+  // Like usbip-host, a device can only be imported by one client at a time
+  for (auto &other : this->connections_) {
+    if (other.fd >= 0 && other.imported_index == index) {
+      ESP_LOGW(TAG, "OP_REQ_IMPORT for busid '%s' which is already imported by another client", busid);
+      put_be32(reply + 4, OP_STATUS_DEV_BUSY);
+      this->capture_pdu(conn, CaptureRing::Direction::TX, reply, OP_HEADER_SIZE);
+      this->queue_inline(conn, reply, OP_HEADER_SIZE);
       return;
     }
+  }
+
+  DescriptorView cfg = this->host_->config_descriptor(this->devices_[index].client);
+  put_be32(reply + 4, OP_STATUS_OK);
+  std::vector<uint8_t> device(USBIP_DEVICE_SIZE);
+  encode_usbip_device(device.data(), this->devices_[index], dev_desc, cfg);
+  this->capture_pdu(conn, CaptureRing::Direction::TX, reply, sizeof(reply), device.data(), device.size());
+  this->queue_inline(conn, reply, sizeof(reply));
+  this->queue_buffer(conn, std::move(device));
+
+  this->parse_endpoint_types(conn, cfg);
+  conn.state = ConnState::URB;
+  conn.imported_index = index;
+  conn.tx_policy = this->client_options_[index].tx_policy;
+  conn.socket_options_pending = conn.tx_policy != TxPolicy::DEFAULT;
+  ESP_LOGI(TAG, "Client imported device %s", busid);
+}
+
+void USBIPComponent::parse_endpoint_types(Connection &conn, const DescriptorView &cfg) {
+  for (auto &t : conn.endpoint_types) t = TransferType::BULK;
+  for (auto &i : conn.endpoint_intervals) i = 0;
+  // Walk the descriptors following the configuration descriptor and pick up
+  // every endpoint descriptor (bDescriptorType 5)
+  size_t off = 0;
+  while (off + 2 <= cfg.size()) {
+    uint8_t len = cfg[off];
+    if (len < 2 || off + len > cfg.size()) break;
+    if (cfg[off + 1] == 0x05 && len >= 7) {
+      uint8_t addr = cfg[off + 2];
+      size_t idx = (addr & 0x0F) + ((addr & 0x80) ? 16 : 0);
+      conn.endpoint_types[idx] = (TransferType)(cfg[off + 3] & 0x03);
+      conn.endpoint_intervals[idx] = cfg[off + 6];
+      this->buffers_.add_size((cfg[off + 4] | (cfg[off + 5] << 8)) & 0x7FF);
+    }
+    off += len;
+  }
+}
 
-  if ((all_device_ready && all_strings_ready) || now_ms() >= this->pending_devlist_deadline_) {
-  // Send the OP_REP_DEVLIST header and device records (same logic as before)
-      uint16_t rep_ver_net = htons(0x0111);
-      uint16_t rep_cmd_net = htons(0x0005);
-      uint32_t status_net = htonl(0);
-
-      uint32_t ndev = (uint32_t)this->exported_clients_.size();
-      uint32_t ndev_net = htonl(ndev);
-
-  // Build reply into send buffer for non-blocking send
-  this->send_buf_.clear();
-  this->send_offset_ = 0;
-  this->sending_devlist_ = true;
-  // Header (network-order copies)
-  this->send_buf_.insert(this->send_buf_.end(), (uint8_t *)&rep_ver_net, (uint8_t *)&rep_ver_net + 2);
-  this->send_buf_.insert(this->send_buf_.end(), (uint8_t *)&rep_cmd_net, (uint8_t *)&rep_cmd_net + 2);
-  this->send_buf_.insert(this->send_buf_.end(), (uint8_t *)&status_net, (uint8_t *)&status_net + 4);
-  this->send_buf_.insert(this->send_buf_.end(), (uint8_t *)&ndev_net, (uint8_t *)&ndev_net + 4);
-  ESP_LOGI(TAG, "Queued OP_REP_DEVLIST header (n=%u)", ndev);
-      for (size_t i = 0; i < this->exported_clients_.size(); ++i) {
-        void *c = this->exported_clients_[i];
-          std::vector<uint8_t> dev_desc;
-          uint16_t idVendor = 0, idProduct = 0, bcdDevice = 0;
-          uint8_t devClass = 0, devSub = 0, devProto = 0, bNumConfigurations = 0;
-          if (this->host_->get_device_descriptor(c, dev_desc) && dev_desc.size() >= 1) {
-            // Log raw device descriptor bytes for debugging
-            std::string hex;
-            size_t show = std::min((size_t)18, dev_desc.size());
-            hex.reserve(show * 3);
-            for (size_t bi = 0; bi < show; ++bi) {
-              char tmp[4];
-              snprintf(tmp, sizeof(tmp), "%02X ", dev_desc[bi]);
-              hex += tmp;
-            }
-            ESP_LOGD(TAG, "Device descriptor bytes (first %u): %s", (unsigned)show, hex.c_str());
-            if (dev_desc.size() >= 18) {
-              // Must have full 18-byte device descriptor to parse ids
-              int iManufacturer = dev_desc[14];
-              int iProduct = dev_desc[15];
-              idVendor = (uint16_t)dev_desc[8] | ((uint16_t)dev_desc[9] << 8);
-              idProduct = (uint16_t)dev_desc[10] | ((uint16_t)dev_desc[11] << 8);
-              // Log whether these strings are already cached to help tuning
-              std::vector<int> missing_indices;
-              std::vector<uint8_t> tmp;
-              if (iManufacturer > 0 && !this->host_->get_string_descriptor(c, iManufacturer, tmp)) missing_indices.push_back(iManufacturer);
-              if (iProduct > 0 && !this->host_->get_string_descriptor(c, iProduct, tmp)) missing_indices.push_back(iProduct);
-              if (!missing_indices.empty()) {
-                std::string ms;
-                for (auto idx : missing_indices) {
-                  char t[8]; snprintf(t, sizeof(t), "%d ", idx); ms += t;
-                }
-                ESP_LOGD(TAG, "Device %u missing string indices: %s", (unsigned)i, ms.c_str());
-              }
-              bcdDevice = (uint16_t)dev_desc[12] | ((uint16_t)dev_desc[13] << 8);
-              devClass = dev_desc[4];
-              devSub = dev_desc[5];
-              devProto = dev_desc[6];
-              bNumConfigurations = dev_desc[17];
-            } else {
-              ESP_LOGW(TAG, "Device descriptor too short (%u bytes)", (unsigned)dev_desc.size());
-            }
-            ESP_LOGI(TAG, "Parsed idVendor=0x%04X idProduct=0x%04X", (unsigned)idVendor, (unsigned)idProduct);
-          }
-
-          std::vector<uint8_t> rec;
-          rec.resize(256 + 32 + (16 * 4));
-          const char *path = "/";
-          strncpy((char *)rec.data(), path, 255);
-          char busid[32];
-          snprintf(busid, sizeof(busid), "1-%u", (unsigned)(i + 1));
-          strncpy((char *)(rec.data() + 256), busid, 31);
-          size_t num_base = 256 + 32;
-          auto put_u32 = [&](size_t idx, uint32_t v) {
-            uint32_t tmp = htonl(v);
-            memcpy(rec.data() + num_base + idx * 4, &tmp, 4);
-          };
-          put_u32(0, 0);
-          put_u32(1, (uint32_t)(i + 1));
-          put_u32(2, 3);
-          // Place vendor/product in the canonical order expected by USB/IP
-          // clients: idVendor then idProduct.
-          put_u32(3, (uint32_t)idVendor);
-          put_u32(4, (uint32_t)idProduct);
-          put_u32(5, (uint32_t)bcdDevice);
-          put_u32(6, (uint32_t)devClass);
-          put_u32(7, (uint32_t)devSub);
-          put_u32(8, (uint32_t)devProto);
-          put_u32(9, 1);
-          put_u32(10, 0);
-          put_u32(11, 0);
-          put_u32(12, 0);
-          put_u32(13, 0);
-          put_u32(14, 0);
-          put_u32(15, (uint32_t)(bNumConfigurations ? bNumConfigurations : 1));
-
-          std::vector<uint8_t> extra;
-          if (!dev_desc.empty()) {
-            uint32_t dlen = (uint32_t)dev_desc.size();
-            uint32_t dlen_net = htonl(dlen);
-            extra.insert(extra.end(), (uint8_t *)&dlen_net, (uint8_t *)&dlen_net + 4);
-            extra.insert(extra.end(), dev_desc.begin(), dev_desc.end());
-          } else {
-            uint32_t dlen_net = htonl(0);
-            extra.insert(extra.end(), (uint8_t *)&dlen_net, (uint8_t *)&dlen_net + 4);
-          }
-          std::vector<uint8_t> cfg;
-          if (this->host_->get_config_descriptor(c, cfg) && !cfg.empty()) {
-            uint32_t clen = (uint32_t)cfg.size();
-            uint32_t clen_net = htonl(clen);
-            extra.insert(extra.end(), (uint8_t *)&clen_net, (uint8_t *)&clen_net + 4);
-            extra.insert(extra.end(), cfg.begin(), cfg.end());
-          } else {
-            uint32_t clen_net = htonl(0);
-            extra.insert(extra.end(), (uint8_t *)&clen_net, (uint8_t *)&clen_net + 4);
-          }
-
-          // Append iManufacturer and iProduct string descriptors (if available)
-          if (dev_desc.size() >= 16) {
-            int iManufacturer = dev_desc[14];
-            int iProduct = dev_desc[15];
-            auto append_string_index = [&](int idx) {
-              if (idx <= 0) {
-                uint32_t slen_net = htonl(0);
-                extra.insert(extra.end(), (uint8_t *)&slen_net, (uint8_t *)&slen_net + 4);
-                return;
-              }
-              std::vector<uint8_t> sraw;
-              if (!this->host_->get_string_descriptor(c, idx, sraw)) {
-                // Request asynchronously for future calls
-                this->host_->request_string_descriptor(c, idx);
-                uint32_t slen_net = htonl(0);
-                extra.insert(extra.end(), (uint8_t *)&slen_net, (uint8_t *)&slen_net + 4);
-                return;
-              }
-              // sraw is a USB string descriptor (bLength, bDescriptorType, UTF-16LE chars)
-              if (sraw.size() < 2) {
-                uint32_t slen_net = htonl(0);
-                extra.insert(extra.end(), (uint8_t *)&slen_net, (uint8_t *)&slen_net + 4);
-                return;
-              }
-              // Convert UTF-16LE to UTF-8 (simple implementation for BMP/basic ascii)
-              std::string utf8;
-              for (size_t si = 2; si + 1 < sraw.size(); si += 2) {
-                uint16_t ch = sraw[si] | (sraw[si + 1] << 8);
-                if (ch < 0x80) {
-                  utf8.push_back((char)ch);
-                } else if (ch < 0x800) {
-                  utf8.push_back((char)(0xC0 | ((ch >> 6) & 0x1F)));
-                  utf8.push_back((char)(0x80 | (ch & 0x3F)));
-                } else {
-                  utf8.push_back((char)(0xE0 | ((ch >> 12) & 0x0F)));
-                  utf8.push_back((char)(0x80 | ((ch >> 6) & 0x3F)));
-                  utf8.push_back((char)(0x80 | (ch & 0x3F)));
-                }
-              }
-              uint32_t slen = (uint32_t)utf8.size();
-              uint32_t slen_net = htonl(slen);
-              extra.insert(extra.end(), (uint8_t *)&slen_net, (uint8_t *)&slen_net + 4);
-              extra.insert(extra.end(), utf8.begin(), utf8.end());
-            };
-
-            append_string_index(iManufacturer);
-            append_string_index(iProduct);
-          } else {
-            // two zero-length string entries
-            uint32_t slen_net = htonl(0);
-            extra.insert(extra.end(), (uint8_t *)&slen_net, (uint8_t *)&slen_net + 4);
-            extra.insert(extra.end(), (uint8_t *)&slen_net, (uint8_t *)&slen_net + 4);
-          }
-
-          // Debug: dump numeric fields (16 u32) to help diagnose endianness/offsets
-          {
-            std::string numhex;
-            numhex.reserve(16 * 11);
-            for (size_t bi = 0; bi < 16 * 4; ++bi) {
-              char tmp[4];
-              snprintf(tmp, sizeof(tmp), "%02X ", rec[num_base + bi]);
-              numhex += tmp;
-            }
-            ESP_LOGD(TAG, "Device record numeric fields (hex): %s", numhex.c_str());
-
-            // Also decode each u32 (network order -> host order) to show values
-            std::string vals;
-            vals.reserve(16 * 12);
-            for (size_t idx = 0; idx < 16; ++idx) {
-              uint32_t netv = 0;
-              memcpy(&netv, rec.data() + num_base + idx * 4, 4);
-              uint32_t hostv = ntohl(netv);
-              char tmp[32];
-              snprintf(tmp, sizeof(tmp), "%02zu:%08X ", idx, hostv);
-              vals += tmp;
-            }
-            ESP_LOGD(TAG, "Device record numeric fields (decoded): %s", vals.c_str());
-          }
-
-          // Append record and extra blobs to send buffer (non-blocking send)
-          this->send_buf_.insert(this->send_buf_.end(), rec.begin(), rec.end());
-          if (!extra.empty()) this->send_buf_.insert(this->send_buf_.end(), extra.begin(), extra.end());
-          ESP_LOGI(TAG, "Queued device record %u (len=%u + extra=%u)", (unsigned)i, (unsigned)rec.size(), (unsigned)extra.size());
-        }
+bool USBIPComponent::handle_local_control(Connection &conn, const UsbipHeader &h) {
+  uint8_t bmRequestType = h.setup[0];
+  uint8_t bRequest = h.setup[1];
+  // SET_ADDRESS (0x05) and SET_CONFIGURATION (0x09) to the device
+  if (bmRequestType == 0x00 && (bRequest == 0x05 || bRequest == 0x09)) {
+    ESP_LOGD(TAG, "Completing control request 0x%02X locally (seqnum=%u)", bRequest, (unsigned)h.seqnum);
+    this->queue_ret_submit(conn, h.seqnum, USB_STATUS_OK, nullptr, 0);
+    return true;
+  }
+  // GET_DESCRIPTOR to the device: the client's driver re-reads what the
+  // adapter has cached since enumeration, so answer from the cache instead
+  // of a bus round trip each. Anything not cached goes to the device.
+  if (bmRequestType == 0x80 && bRequest == 0x06) {
+    DescriptorView d = this->cached_descriptor(this->devices_[conn.imported_index].client, h.setup);
+    if (!d.ready) return false;
+    uint16_t wLength = h.setup[6] | (h.setup[7] << 8);
+    size_t len = std::min({d.size(), (size_t)wLength, (size_t)h.transfer_buffer_length});
+    ESP_LOGV(TAG, "GET_DESCRIPTOR %04X answered from the cache (%u bytes, seqnum=%u)",
+             (unsigned)(h.setup[2] | (h.setup[3] << 8)), (unsigned)len, (unsigned)h.seqnum);
+    this->metrics_.urbs_from_cache++;
+    this->queue_ret_submit(conn, h.seqnum, USB_STATUS_OK, d.data, len);
+    return true;
+  }
+  return false;
+}
+
+DescriptorView USBIPComponent::cached_descriptor(void *client, const uint8_t *setup) {
+  uint8_t index = setup[2];
+  uint8_t type = setup[3];
+  uint16_t wIndex = setup[4] | (setup[5] << 8);
+  switch (type) {
+    case 0x01:  // DEVICE
+      return index == 0 && wIndex == 0 ? this->host_->device_descriptor(client) : DescriptorView{};
+    case 0x02:  // CONFIGURATION: only the first one is cached
+      return index == 0 && wIndex == 0 ? this->host_->config_descriptor(client) : DescriptorView{};
+    case 0x03:  // STRING, wIndex is the LANGID
+      return this->host_->string_descriptor_langid(client, index, wIndex);
+    default:
+      return DescriptorView{};
+  }
+}
+
+void USBIPComponent::handle_cmd_submit(Connection &conn, const UsbipHeader &h, const uint8_t *out_data) {
+  if (conn.imported_index < 0 || !this->host_) {
+    this->queue_ret_submit(conn, h.seqnum, USB_STATUS_NODEV, nullptr, 0);
+    return;
+  }
+  if (h.number_of_packets > 0) {
+    this->metrics_.urbs_submitted++;
+    this->submit_iso(conn, h, out_data, now_us());
+    return;
+  }
+  if (h.ep == 0 && this->handle_local_control(conn, h)) return;
+
+  bool in = h.direction == USBIP_DIR_IN;
+  UsbTransfer xfer;
+  if (h.ep == 0) {
+    xfer.type = TransferType::CONTROL;
+    xfer.endpoint = 0;
+    xfer.timeout_ms = CONTROL_TIMEOUT_MS;
+  } else {
+    xfer.type = conn.endpoint_types[(h.ep & 0x0F) + (in ? 16 : 0)];
+    xfer.endpoint = (uint8_t)((h.ep & 0x0F) | (in ? 0x80 : 0x00));
+  }
+  memcpy(xfer.setup, h.setup, sizeof(xfer.setup));
+  xfer.data = in ? nullptr : out_data;
+  xfer.length = (size_t)h.transfer_buffer_length;
+  if (in) this->buffers_.add_size(xfer.length);
+
+  uint32_t submitted_us = now_us();
+  this->metrics_.urbs_submitted++;
+  if (in && (xfer.type == TransferType::BULK || xfer.type == TransferType::INTERRUPT) &&
+      this->submit_to_stream(conn, h, xfer.type, submitted_us))
+    return;
+
+  size_t slot = &conn - this->connections_.data();
+  uint32_t epoch = conn.epoch;
+  uint32_t seqnum = h.seqnum;
+  if (conn.urbs.insert(seqnum, UrbTable::Kind::HOST) == nullptr) {
+    ESP_LOGD(TAG, "URB table full; seqnum=%u cannot be unlinked", (unsigned)seqnum);
+  }
+  transfer_handle_t handle = this->host_->submit_transfer(
+      this->devices_[conn.imported_index].client, xfer,
+      [this, slot, epoch, seqnum, in, submitted_us](const UsbTransferResult &res) {
+        this->metrics_.urb_rtt_us.record(now_us() - submitted_us);
+        // Drop completions that belong to a connection that has since closed
+        Connection &c = this->connections_[slot];
+        if (c.fd < 0 || c.epoch != epoch) return;
+        if (!this->retire_urb(c, seqnum)) return;
+        this->queue_ret_submit(c, seqnum, res.status, in ? res.data : nullptr, res.actual_length);
+      });
+  UrbTable::Entry *entry = conn.urbs.find(seqnum);
+  if (handle == INVALID_TRANSFER) {
+    conn.urbs.remove(entry);
+    ESP_LOGW(TAG, "Host refused transfer on ep 0x%02X (seqnum=%u)", xfer.endpoint, (unsigned)seqnum);
+    this->queue_ret_submit(conn, seqnum, USB_STATUS_STALL, nullptr, 0);
+  } else if (entry != nullptr) {
+    entry->handle = handle;
+  }
+}
+
+bool USBIPComponent::retire_urb(Connection &conn, uint32_t seqnum) {
+  UrbTable::Entry *e = conn.urbs.find(seqnum);
+  if (e == nullptr) return true;
+  bool unlinked = e->unlinked;
+  conn.urbs.remove(e);
+  return !unlinked;
+}
+
+void USBIPComponent::submit_iso(Connection &conn, const UsbipHeader &h, const uint8_t *payload, uint32_t submitted_us) {
+  bool in = h.direction == USBIP_DIR_IN;
+  size_t length = (size_t)h.transfer_buffer_length;
+  size_t npackets = (size_t)h.number_of_packets;
+  // The descriptors follow the OUT payload
+  const uint8_t *desc = payload + (in ? 0 : length);
+  if (h.ep == 0 || npackets > IsoUrbPool::MAX_PACKETS) {
+    ESP_LOGW(TAG, "Rejecting isochronous URB seqnum=%u on ep %u with %u packets", (unsigned)h.seqnum, (unsigned)h.ep,
+             (unsigned)npackets);
+    this->reject_iso(conn, h, desc, USB_STATUS_INVALID);
+    return;
+  }
+  conn.iso.allocate();
+  IsoUrbPool::Urb *urb = conn.iso.acquire(conn.tx.retired());
+  if (urb == nullptr) {
+    ESP_LOGW(TAG, "All %u isochronous URB slots in use (seqnum=%u)", (unsigned)IsoUrbPool::MAX_URBS,
+             (unsigned)h.seqnum);
+    this->reject_iso(conn, h, desc, USB_STATUS_NOSPC);
+    return;
+  }
+  if (!IsoUrbPool::load(*urb, desc, npackets, length)) {
+    ESP_LOGW(TAG, "Isochronous URB seqnum=%u has packets outside its buffer", (unsigned)h.seqnum);
+    this->reject_iso(conn, h, desc, USB_STATUS_INVALID);
+    return;
+  }
+  if (!in && length > 0) memcpy(urb->buffer.data(), payload, length);
+
+  UsbTransfer xfer;
+  xfer.type = TransferType::ISOCHRONOUS;
+  xfer.endpoint = (uint8_t)((h.ep & 0x0F) | (in ? 0x80 : 0x00));
+  xfer.length = length;
+  xfer.iso_packets = urb->packets;
+  xfer.num_iso_packets = urb->num_packets;
+  xfer.iso_buffer = urb->buffer.data();
+  urb->seqnum = h.seqnum;
+  urb->in = in;
+  urb->busy = true;
+
+  size_t slot = &conn - this->connections_.data();
+  uint32_t epoch = conn.epoch;
+  size_t index = conn.iso.index_of(*urb);
+  conn.urbs.insert(h.seqnum, UrbTable::Kind::ISO, (uint8_t)index);
+  urb->handle = this->host_->submit_transfer(
+      this->devices_[conn.imported_index].client, xfer,
+      [this, slot, epoch, index, submitted_us](const UsbTransferResult &res) {
+        this->metrics_.urb_rtt_us.record(now_us() - submitted_us);
+        Connection &c = this->connections_[slot];
+        if (c.fd < 0 || c.epoch != epoch) return;
+        IsoUrbPool::Urb &u = c.iso.at(index);
+        u.busy = false;
+        u.handle = INVALID_TRANSFER;
+        // An unlinked URB is answered by the RET_UNLINK alone
+        if (this->retire_urb(c, u.seqnum)) this->queue_ret_iso(c, u, res);
+      });
+  UrbTable::Entry *entry = conn.urbs.find(h.seqnum);
+  if (entry != nullptr) entry->handle = urb->handle;
+  if (urb->handle == INVALID_TRANSFER) {
+    conn.urbs.remove(entry);
+    urb->busy = false;
+    ESP_LOGW(TAG, "Host refused isochronous transfer on ep 0x%02X (seqnum=%u)", xfer.endpoint, (unsigned)h.seqnum);
+    this->reject_iso(conn, h, desc, USB_STATUS_NOT_SUPPORTED);
+  }
+}
+
+void USBIPComponent::queue_ret_iso(Connection &conn, IsoUrbPool::Urb &urb, const UsbTransferResult &res) {
+  uint32_t actual = 0;
+  uint32_t errors = 0;
+  for (size_t i = 0; i < urb.num_packets; ++i) {
+    UsbIsoPacket &p = urb.packets[i];
+    // A transfer that failed as a whole (cancelled, device gone) did not
+    // report per packet
+    if (res.status != USB_STATUS_OK) {
+      p.actual_length = 0;
+      p.status = res.status;
+    }
+    actual += p.actual_length;
+    if (p.status != USB_STATUS_OK) errors++;
+  }
+  uint8_t hdr[USBIP_HEADER_SIZE];
+  encode_ret_submit(hdr, urb.seqnum, res.status, (int32_t)actual, (int32_t)res.start_frame, urb.num_packets,
+                    (int32_t)errors);
+  const uint8_t *first = urb.in && actual > 0 ? urb.buffer.data() + urb.packets[0].offset : nullptr;
+  this->capture_pdu(conn, CaptureRing::Direction::TX, hdr, sizeof(hdr), first, first ? urb.packets[0].actual_length : 0);
+  this->queue_inline(conn, hdr, sizeof(hdr));
+
+  // IN data goes out packet by packet, back to back, straight from the
+  // slot's buffer. Packets that filled up lie next to each other and share
+  // one segment.
+  if (urb.in && actual > 0) {
+    size_t run_start = 0;
+    size_t run_len = 0;
+    for (size_t i = 0; i < urb.num_packets; ++i) {
+      const UsbIsoPacket &p = urb.packets[i];
+      if (p.actual_length == 0) continue;
+      if (run_len > 0 && p.offset != run_start + run_len) {
+        conn.tx.push_borrowed(urb.buffer.data() + run_start, run_len);
+        run_len = 0;
       }
-      // pending_devlist_ remains true until send buffer completely flushed
+      if (run_len == 0) run_start = p.offset;
+      run_len += p.actual_length;
     }
+    conn.tx.push_borrowed(urb.buffer.data() + run_start, run_len);
   }
+  conn.tx.push_borrowed(IsoUrbPool::seal(urb), urb.num_packets * USBIP_ISO_DESC_SIZE);
+  urb.sending = true;
+  urb.release_at = conn.tx.end();
+  this->reply_queued(conn);
 }
 
-void USBIPComponent::request_client_descriptors() {
-  if (!this->host_) return;
-  for (auto c : this->exported_clients_) {
-    this->host_->request_device_descriptor(c);
+void USBIPComponent::reject_iso(Connection &conn, const UsbipHeader &h, const uint8_t *desc, int32_t status) {
+  size_t n = (size_t)h.number_of_packets;
+  std::vector<uint8_t> pdu(USBIP_HEADER_SIZE + n * USBIP_ISO_DESC_SIZE);
+  encode_ret_submit(pdu.data(), h.seqnum, status, 0, 0, (int32_t)n, (int32_t)n);
+  for (size_t i = 0; i < n; ++i) {
+    uint8_t *d = pdu.data() + USBIP_HEADER_SIZE + i * USBIP_ISO_DESC_SIZE;
+    memcpy(d, desc + i * USBIP_ISO_DESC_SIZE, 8);
+    put_be32(d + 8, 0);
+    put_be32(d + 12, (uint32_t)status);
+  }
+  this->capture_pdu(conn, CaptureRing::Direction::TX, pdu.data(), pdu.size());
+  this->queue_buffer(conn, std::move(pdu));
+  this->reply_queued(conn);
+}
+
+bool USBIPComponent::submit_to_stream(Connection &conn, const UsbipHeader &h, TransferType type, uint32_t submitted_us) {
+  // Interrupt endpoints are always polled; bulk endpoints stream if enabled
+  bool interrupt = type == TransferType::INTERRUPT;
+  uint8_t depth = interrupt ? INTERRUPT_DEPTH : this->client_options_[conn.imported_index].bulk_in_depth;
+  if (depth == 0) return false;
+  uint8_t endpoint = (uint8_t)(0x80 | (h.ep & 0x0F));
+  InStream *stream = nullptr;
+  for (auto &s : conn.in_streams) {
+    if (s.active() && s.endpoint() == endpoint) {
+      stream = &s;
+      break;
+    }
+    if (stream == nullptr && !s.active()) stream = &s;
+  }
+  if (stream == nullptr) return false;  // more streaming endpoints than slots
+  if (!stream->active()) {
+    // Host transfers get the size of the CMD_SUBMIT that starts the stream
+    size_t slot = &conn - this->connections_.data();
+    uint32_t epoch = conn.epoch;
+    // bInterval is in frames (ms) for full and low speed devices
+    uint8_t interval = conn.endpoint_intervals[(h.ep & 0x0F) + 16];
+    uint32_t interval_ms = interrupt ? (interval ? interval : 1) : 0;
+    stream->set_pool(&this->buffers_);
+    stream->start(this->host_.get(), this->devices_[conn.imported_index].client, endpoint, type,
+                  (size_t)h.transfer_buffer_length, depth, interval_ms,
+                  [this, slot, epoch, interrupt](uint32_t seqnum, uint32_t tag, int32_t status,
+                                                 std::vector<uint8_t> &&data, uint32_t ready_us) {
+                    this->metrics_.urb_rtt_us.record(now_us() - tag);
+                    Connection &c = this->connections_[slot];
+                    if (c.fd < 0 || c.epoch != epoch) {
+                      this->buffers_.give(std::move(data));
+                      return;
+                    }
+                    this->retire_urb(c, seqnum);
+                    this->queue_ret_submit(c, seqnum, status, std::move(data));
+                    if (!interrupt) return;
+                    // Input reports go out right away instead of waiting for
+                    // this loop's send pass
+                    if (!c.tx_blocked) this->flush_send_queue(c, false);
+                    this->metrics_.interrupt_latency_us.record(host_now_us() - ready_us);
+                  });
+    ESP_LOGD(TAG, "%s IN endpoint 0x%02X (%u x %u bytes, interval %u ms)",
+             interrupt ? "Polling interrupt" : "Streaming bulk", endpoint, (unsigned)depth,
+             (unsigned)h.transfer_buffer_length, (unsigned)interval_ms);
+  }
+  conn.urbs.insert(h.seqnum, UrbTable::Kind::STREAM, (uint8_t)(stream - conn.in_streams));
+  stream->submit(h.seqnum, (size_t)h.transfer_buffer_length, submitted_us);
+  return true;
+}
+
+void USBIPComponent::handle_cmd_unlink(Connection &conn, const UsbipHeader &h) {
+  ESP_LOGD(TAG, "CMD_UNLINK seqnum=%u victim=%u", (unsigned)h.seqnum, (unsigned)h.unlink_seqnum);
+  // A victim still in flight is cancelled and only answered by this
+  // RET_UNLINK (-ECONNRESET). One that is not in the table has completed
+  // and its RET_SUBMIT is already queued: report status 0, as the Linux
+  // server does; the client then takes the RET_SUBMIT.
+  int32_t status = 0;
+  UrbTable::Entry *e = conn.urbs.find(h.unlink_seqnum);
+  if (e != nullptr && e->kind == UrbTable::Kind::STREAM) {
+    // Waiting for stream data: just forget the request
+    conn.in_streams[e->index].unlink(h.unlink_seqnum);
+    conn.urbs.remove(e);
+    status = USB_STATUS_CONNRESET;
+  } else if (e != nullptr) {
+    // Cancelling runs the completion right away; retire_urb() then drops
+    // its RET_SUBMIT
+    e->unlinked = true;
+    if (this->host_->cancel_transfer(e->handle)) {
+      status = USB_STATUS_CONNRESET;
+    } else {
+      // Completed in the meantime but not answered yet
+      e = conn.urbs.find(h.unlink_seqnum);
+      if (e != nullptr) e->unlinked = false;
+    }
+  }
+  uint8_t hdr[USBIP_HEADER_SIZE];
+  encode_ret_unlink(hdr, h.seqnum, status);
+  this->capture_pdu(conn, CaptureRing::Direction::TX, hdr, sizeof(hdr));
+  this->queue_inline(conn, hdr, sizeof(hdr));
+}
+
+void USBIPComponent::queue_ret_submit(Connection &conn, uint32_t seqnum, int32_t status, const uint8_t *data, size_t actual_length) {
+  uint8_t hdr[USBIP_HEADER_SIZE];
+  encode_ret_submit(hdr, seqnum, status, (int32_t)actual_length, 0, 0, 0);
+  this->capture_pdu(conn, CaptureRing::Direction::TX, hdr, sizeof(hdr), data, data != nullptr ? actual_length : 0);
+  this->queue_inline(conn, hdr, sizeof(hdr));
+  // The host stack's buffer is only valid during the completion callback,
+  // so this is the one copy the payload takes on its way to the socket.
+  if (data != nullptr && actual_length > 0) {
+    std::vector<uint8_t> buf = this->buffers_.take(actual_length);
+    memcpy(buf.data(), data, actual_length);
+    this->queue_pooled(conn, std::move(buf));
+  }
+  this->reply_queued(conn);
+}
+
+void USBIPComponent::queue_ret_submit(Connection &conn, uint32_t seqnum, int32_t status, std::vector<uint8_t> &&data) {
+  uint8_t hdr[USBIP_HEADER_SIZE];
+  encode_ret_submit(hdr, seqnum, status, (int32_t)data.size(), 0, 0, 0);
+  this->capture_pdu(conn, CaptureRing::Direction::TX, hdr, sizeof(hdr), data.data(), data.size());
+  this->queue_inline(conn, hdr, sizeof(hdr));
+  this->queue_pooled(conn, std::move(data));
+  this->reply_queued(conn);
+}
+
+void USBIPComponent::capture_pdu(const Connection &conn, CaptureRing::Direction dir, const uint8_t *a, size_t a_len,
+                                 const uint8_t *b, size_t b_len) {
+  if (!this->capture_.enabled() || conn.fd < 0) return;
+  this->capture_.record(now_us(), (uint16_t)conn.epoch, dir, a, a_len, b, b_len);
+}
+
+void USBIPComponent::queue_inline(Connection &conn, const uint8_t *data, size_t len) {
+  if (conn.fd < 0) return;
+  conn.tx.push_inline(data, len);
+}
+
+void USBIPComponent::queue_buffer(Connection &conn, std::vector<uint8_t> &&buf) {
+  if (conn.fd < 0) return;
+  conn.tx.push_buffer(std::move(buf));
+}
+
+void USBIPComponent::queue_pooled(Connection &conn, std::vector<uint8_t> &&buf) {
+  if (conn.fd < 0) {
+    this->buffers_.give(std::move(buf));
+    return;
   }
+  conn.tx.push_pooled(std::move(buf));
+}
+
+TxQueue::FlushResult USBIPComponent::flush_send_queue(Connection &conn, bool may_close) {
+  if (conn.fd < 0) return TxQueue::FlushResult::IDLE;
+  conn.coalescing = false;
+  size_t sent = 0;
+  TxQueue::FlushResult result;
+  if (this->net_task_) {
+    // Hand everything queued to the network task, which does the writing
+    // (and counts the bytes). Completions leave one command per connection
+    // free for run_net_tx(). Without room the replies simply stay queued
+    // for the next run_net_tx(); the socket is not blocked, so tx_blocked
+    // stays clear.
+    if (conn.tx.empty()) return TxQueue::FlushResult::IDLE;
+    size_t reserve = may_close ? 0 : this->connections_.size();
+    if (!this->net_task_->can_send(reserve)) return TxQueue::FlushResult::IDLE;
+    this->net_task_->send((uint8_t)(&conn - this->connections_.data()), conn.epoch, conn.tx.detach());
+    this->net_task_wake_ = true;
+    result = TxQueue::FlushResult::DRAINED;
+  } else {
+    result = conn.tx.flush(conn.fd, sent);
+  }
+  this->metrics_.tx_bytes += sent;
+  switch (result) {
+    case TxQueue::FlushResult::IDLE:
+    case TxQueue::FlushResult::PARTIAL:
+      break;
+    case TxQueue::FlushResult::SHORT_WRITE:
+      this->metrics_.tx_short_writes++;
+      break;
+    case TxQueue::FlushResult::DRAINED:
+      if (conn.sending_devlist) {
+        ESP_LOGI(TAG, "Finished non-blocking send of devlist (total=%u)", (unsigned)conn.devlist_bytes);
+        conn.sending_devlist = false;
+        conn.pending_devlist = false;
+      }
+      break;
+    case TxQueue::FlushResult::WOULD_BLOCK:
+      this->metrics_.tx_eagain++;
+      conn.tx_blocked = true;
+      break;
+    case TxQueue::FlushResult::ERROR:
+      if (!may_close) break;
+      ESP_LOGW(TAG, "sendmsg() failed: %d", errno);
+      this->close_connection(conn);
+      break;
+  }
+  return result;
+}
+
+void USBIPComponent::reply_queued(Connection &conn) {
+  if (conn.fd < 0 || conn.imported_index < 0) return;
+  const ClientOptions &opts = this->client_options_[conn.imported_index];
+  switch (conn.tx_policy) {
+    case TxPolicy::DEFAULT:
+      break;
+    case TxPolicy::LATENCY:
+      if (conn.tx_blocked) break;
+      this->flush_send_queue(conn, false);
+      // Do not leave the reply waiting for the end of this loop either
+      if (this->net_task_) this->net_task_->wake();
+      break;
+    case TxPolicy::THROUGHPUT:
+      if (conn.tx.bytes() >= opts.coalesce_bytes) {
+        if (!conn.tx_blocked) this->flush_send_queue(conn, false);
+      } else if (!conn.coalescing) {
+        conn.coalescing = true;
+        conn.coalesce_deadline_us = now_us() + opts.coalesce_us;
+      }
+      break;
+  }
+}
+
+bool USBIPComponent::apply_tx_policy(Connection &conn) {
+  if (conn.fd < 0 || conn.imported_index < 0) return true;
+  const ClientOptions &opts = this->client_options_[conn.imported_index];
+  SocketOptions options;
+  options.nodelay = conn.tx_policy != TxPolicy::DEFAULT;
+  if (conn.tx_policy == TxPolicy::THROUGHPUT) {
+    options.send_buffer = opts.socket_buffer_size;
+    options.receive_buffer = opts.socket_buffer_size;
+  }
+  if (this->net_task_) {
+    // The task owns the socket; the options travel with its commands
+    if (!this->net_task_->set_socket_options((uint8_t)(&conn - this->connections_.data()), conn.epoch, options))
+      return false;
+    this->net_task_wake_ = true;
+    return true;
+  }
+  apply_socket_options(conn.fd, options);
+  return true;
+}
+
+void USBIPComponent::close_connection(Connection &conn) {
+  if (conn.fd >= 0 && this->net_task_) {
+    this->net_task_->close((uint8_t)(&conn - this->connections_.data()), conn.epoch);
+    this->net_task_wake_ = true;
+  } else if (conn.fd >= 0) {
+    close(conn.fd);
+  }
+  conn.fd = -1;
+  if (conn.imported_index >= 0) {
+    ESP_LOGI(TAG, "Released imported device %s", this->devices_[conn.imported_index].busid);
+  }
+  for (auto &s : conn.in_streams) s.stop();
+  conn.iso.release(this->host_.get());
+  // Cancel host transfers still in flight instead of letting them finish
+  // for nobody; their completions see the closed slot and are dropped
+  if (this->host_) {
+    conn.urbs.for_each([this](UrbTable::Entry &e) {
+      if (e.kind == UrbTable::Kind::HOST && e.handle != INVALID_TRANSFER) this->host_->cancel_transfer(e.handle);
+    });
+  }
+  conn.urbs.clear();
+  conn.state = ConnState::OP;
+  conn.imported_index = -1;
+  conn.detached = false;
+  conn.epoch = 0;
+  conn.rx_buf.clear();
+  conn.rx_discard = 0;
+  conn.discard_iso = false;
+  conn.tx.clear();
+  conn.tx_blocked = false;
+  conn.rx_chunk = RX_CHUNK_MIN;
+  conn.tx_policy = TxPolicy::DEFAULT;
+  conn.socket_options_pending = false;
+  conn.coalescing = false;
+  conn.sending_devlist = false;
+  conn.pending_devlist = false;
+}
+
+void USBIPComponent::begin_devlist_reply(Connection &conn) {
+  if (conn.pending_devlist) return;
+  // Complete the reply in later loop() iterations once the prefetcher has
+  // cached the descriptors or the timeout expires, to avoid blocking here.
+  // Mark pending and set a deadline (ms since boot). The wait time
+  // is configurable via set_string_wait_ms(); keep a short default
+  // to avoid blocking the client too long.
+  conn.pending_devlist = true;
+  conn.pending_devlist_deadline = now_ms() + this->string_wait_ms_;
+}
+
+void USBIPComponent::queue_devlist_reply(Connection &conn) {
+  bool changed = this->refresh_devlist_records();
+  if (changed || !this->devlist_snapshot_ || this->devlist_snapshot_version_ != this->devices_.version()) {
+    this->build_devlist_snapshot();
+  }
+  // Every connection shares the same immutable buffer; a rebuild while a
+  // connection is still sending leaves its copy alive until written.
+  conn.sending_devlist = true;
+  conn.devlist_bytes = this->devlist_snapshot_->size();
+  conn.tx.push_shared(this->devlist_snapshot_);
+  this->capture_pdu(conn, CaptureRing::Direction::TX, this->devlist_snapshot_->data(), conn.devlist_bytes);
+  ESP_LOGD(TAG, "Queued OP_REP_DEVLIST snapshot (%u bytes)", (unsigned)conn.devlist_bytes);
+}
+
+bool USBIPComponent::refresh_devlist_records() {
+  bool changed = false;
+  for (size_t i = 0; i < this->devices_.size(); ++i) {
+    DeviceTable::Device &dev = this->devices_[i];
+    if (!dev.attached) continue;
+    uint32_t gen = this->host_->client_generation(dev.client);
+    if (dev.record_valid && dev.record_generation == gen) continue;
+    this->encode_devlist_record(dev);
+    dev.record_valid = true;
+    dev.record_generation = gen;
+    changed = true;
+  }
+  return changed;
+}
+
+void USBIPComponent::build_devlist_snapshot() {
+  // The OP_REP_DEVLIST header followed by the attached devices' records
+  uint32_t ndev = (uint32_t)this->devices_.attached_count();
+  size_t total = 12;
+  for (size_t i = 0; i < this->devices_.size(); ++i) {
+    if (this->devices_[i].attached) total += this->devices_[i].record.size();
+  }
+  std::vector<uint8_t> out(12);
+  out.reserve(total);
+  put_be16(out.data() + 0, USBIP_VERSION);
+  put_be16(out.data() + 2, OP_REP_DEVLIST);
+  put_be32(out.data() + 4, OP_STATUS_OK);
+  put_be32(out.data() + 8, ndev);
+  for (size_t i = 0; i < this->devices_.size(); ++i) {
+    const DeviceTable::Device &dev = this->devices_[i];
+    if (dev.attached) out.insert(out.end(), dev.record.begin(), dev.record.end());
+  }
+
+  this->devlist_snapshot_ = std::make_shared<const std::vector<uint8_t>>(std::move(out));
+  this->devlist_snapshot_version_ = this->devices_.version();
+  ESP_LOGI(TAG, "Rebuilt OP_REP_DEVLIST snapshot (n=%u, %u bytes)", ndev, (unsigned)this->devlist_snapshot_->size());
+}
+
+void USBIPComponent::encode_devlist_record(DeviceTable::Device &dev) {
+  void *c = dev.client;
+  // The device list may go out before the device descriptor arrived; the
+  // entry then carries zero ids
+  static const uint8_t NO_DEVICE_DESC[DescriptorStore::DEVICE_SIZE] = {};
+  DescriptorView dev_desc = this->host_->device_descriptor(c);
+  bool have_dev = dev_desc.ready && dev_desc.size() >= DescriptorStore::DEVICE_SIZE;
+  if (!have_dev) dev_desc = DescriptorView{NO_DEVICE_DESC, sizeof(NO_DEVICE_DESC), true};
+  DescriptorView cfg = this->host_->config_descriptor(c);
+  if (!cfg.ready) cfg = DescriptorView{};
+  uint8_t iManufacturer = dev_desc[14];
+  uint8_t iProduct = dev_desc[15];
+  DescriptorView manufacturer = iManufacturer ? this->host_->string_utf8(c, iManufacturer) : DescriptorView{};
+  DescriptorView product = iProduct ? this->host_->string_utf8(c, iProduct) : DescriptorView{};
+
+  // The usbip_usb_device OP_REP_IMPORT sends as well, then its
+  // bNumInterfaces usbip_usb_interface entries
+  size_t num_interfaces = cfg.size() >= 9 ? cfg[4] : 1;
+  size_t size = USBIP_DEVICE_SIZE + num_interfaces * USBIP_INTERFACE_SIZE;
+  if (this->devlist_extensions_)
+    size += 4 * 4 + (have_dev ? dev_desc.size() : 0) + cfg.size() + manufacturer.size() + product.size();
+  std::vector<uint8_t> &rec = dev.record;
+  rec.assign(size, 0);
+  encode_usbip_device(rec.data(), dev, dev_desc, cfg);
+  uint8_t *p = rec.data() + USBIP_DEVICE_SIZE;
+  // bInterfaceClass, bInterfaceSubClass, bInterfaceProtocol of each
+  // interface's first alternate setting, in descriptor order
+  size_t found = 0;
+  for (size_t off = 0; off + 2 <= cfg.size() && found < num_interfaces;) {
+    uint8_t len = cfg[off];
+    if (len < 2 || off + len > cfg.size()) break;
+    if (cfg[off + 1] == 0x04 && len >= 9 && cfg[off + 3] == 0) {
+      uint8_t *iface = p + found++ * USBIP_INTERFACE_SIZE;
+      iface[0] = cfg[off + 5];
+      iface[1] = cfg[off + 6];
+      iface[2] = cfg[off + 7];
+    }
+    off += len;
+  }
+  p += num_interfaces * USBIP_INTERFACE_SIZE;
+  ESP_LOGD(TAG, "Serialized device record %s (%u bytes): %.*s %.*s", dev.busid, (unsigned)rec.size(),
+           (int)manufacturer.size(), (const char *)manufacturer.data, (int)product.size(),
+           (const char *)product.data);
+  if (!this->devlist_extensions_) return;
+
+  // Extension read by this project's clients only (set_devlist_extensions()):
+  // the device and configuration descriptors and the manufacturer and
+  // product strings (UTF-8), each a big-endian u32 length and the bytes
+  auto put_blob = [&p](const uint8_t *data, size_t len) {
+    put_be32(p, (uint32_t)len);
+    if (len != 0) memcpy(p + 4, data, len);
+    p += 4 + len;
+  };
+  put_blob(dev_desc.data, have_dev ? dev_desc.size() : 0);
+  put_blob(cfg.data, cfg.size());
+  put_blob(manufacturer.data, manufacturer.size());
+  put_blob(product.data, product.size());
 }
 
 void USBIPComponent::update_client_descriptors() {
   if (!this->host_) return;
-  for (size_t i = 0; i < this->exported_clients_.size(); ++i) {
-    auto c = this->exported_clients_[i];
-    std::vector<uint8_t> desc;
-    if (this->host_->get_device_descriptor(c, desc)) {
-      if (desc != this->client_descriptors_[i]) {
-        this->client_descriptors_[i] = std::move(desc);
-        ESP_LOGI(TAG, "Cached device descriptor for client %u (len=%u)", (unsigned)i,
-                 (unsigned)this->client_descriptors_[i].size());
-        // Proactively request iManufacturer/iProduct strings (non-blocking).
-        if (this->client_descriptors_[i].size() >= 16) {
-          int iManufacturer = this->client_descriptors_[i][14];
-          int iProduct = this->client_descriptors_[i][15];
-          if (iManufacturer > 0) this->host_->request_string_descriptor(c, iManufacturer);
-          if (iProduct > 0) this->host_->request_string_descriptor(c, iProduct);
-        }
-      }
+  // Nothing to do until the adapter caches something new
+  uint32_t gen = this->host_->descriptor_generation();
+  if (gen == this->seen_generation_) return;
+  this->seen_generation_ = gen;
+  for (size_t i = 0; i < this->devices_.size(); ++i) {
+    auto &slot = this->devices_[i];
+    // An unplugged device is fetched again when it comes back
+    if (!slot.attached) continue;
+    DescriptorView desc = this->host_->device_descriptor(slot.client);
+    if (!desc.ready && slot.device_len != 0) {
+      // The adapter dropped the device's descriptors (say a restored cache
+      // record turned out to belong to another device): fetch them again
+      slot.device_len = 0;
+      this->prefetcher_.restart(i);
+      continue;
+    }
+    if (!desc.ready || desc.size() > sizeof(slot.device) ||
+        (desc.size() == slot.device_len && std::equal(desc.begin(), desc.end(), slot.device)))
+      continue;
+    memcpy(slot.device, desc.data, desc.size());
+    slot.device_len = (uint8_t)desc.size();
+    ESP_LOGI(TAG, "Cached device descriptor for %s (len=%u)", slot.busid, (unsigned)slot.device_len);
+    // New or re-enumerated device: fetch all of its descriptors
+    this->prefetcher_.restart(i);
+  }
+}
+
+void USBIPComponent::restore_descriptors() {
+  size_t n = this->devices_.size();
+  this->persisted_digest_.reset(n ? new uint32_t[n]() : nullptr);
+  if (!this->persist_descriptors_ || !this->host_) return;
+  std::vector<uint8_t> record;
+  for (size_t i = 0; i < n; ++i) {
+    if (!this->persistence_.load(i, record)) continue;
+    if (!this->host_->restore_descriptors(this->devices_[i].client, record.data(), record.size())) {
+      ESP_LOGW(TAG, "Saved descriptors of %s are unusable; fetching them again", this->devices_[i].busid);
+      continue;
+    }
+    this->persisted_digest_[i] = DescriptorPersistence::digest(record);
+    ESP_LOGI(TAG, "Restored %u bytes of saved descriptors for %s; revalidating in the background",
+             (unsigned)record.size(), this->devices_[i].busid);
+  }
+}
+
+void USBIPComponent::persist_descriptors(uint32_t now) {
+  if (!this->persist_descriptors_ || !this->host_) return;
+  uint32_t gen = this->host_->descriptor_generation();
+  if (gen != this->persist_generation_) {
+    // Let a burst of fetches settle before writing to flash
+    this->persist_generation_ = gen;
+    this->persist_pending_ = true;
+    this->persist_due_ms_ = now + PERSIST_DELAY_MS;
+  }
+  if (!this->persist_pending_ || (int32_t)(now - this->persist_due_ms_) < 0 || !this->prefetcher_.idle()) return;
+  this->persist_pending_ = false;
+  std::vector<uint8_t> record;
+  for (size_t i = 0; i < this->devices_.size(); ++i) {
+    record.clear();
+    if (!this->host_->save_descriptors(this->devices_[i].client, record)) continue;
+    uint32_t digest = DescriptorPersistence::digest(record);
+    if (digest == this->persisted_digest_[i]) continue;
+    // Remembered even if saving fails, so an oversized record is not
+    // retried (and warned about) on every change
+    this->persisted_digest_[i] = digest;
+    if (this->persistence_.save(i, record)) {
+      ESP_LOGD(TAG, "Saved %u bytes of descriptors for %s", (unsigned)record.size(), this->devices_[i].busid);
+    } else {
+      ESP_LOGW(TAG, "Descriptors of %s (%u bytes) could not be saved", this->devices_[i].busid, (unsigned)record.size());
     }
   }
 }
@@ -564,12 +1503,54 @@ void USBIPComponent::update_client_descriptors() {
 void USBIPComponent::dump_config() {
   ESP_LOGCONFIG(TAG, "USB/IP server:");
   ESP_LOGCONFIG(TAG, "  Port: %u", this->port_);
-
-  if (!this->exported_clients_.empty()) {
-    ESP_LOGCONFIG(TAG, "  Exported USB clients: %u", (unsigned)this->exported_clients_.size());
+  ESP_LOGCONFIG(TAG, "  Max connections: %u", (unsigned)this->max_connections_);
+  ESP_LOGCONFIG(TAG, "  Loop budget: %u us", (unsigned)this->loop_budget_us_);
+  if (this->net_task_enabled_) {
+    ESP_LOGCONFIG(TAG, "  Network task: core %d, priority %u", (int)this->net_task_core_,
+                  (unsigned)this->net_task_priority_);
+  }
+  ESP_LOGCONFIG(TAG, "  Descriptor prefetch concurrency: %u", (unsigned)this->prefetch_concurrency_);
+  ESP_LOGCONFIG(TAG, "  Persistent descriptor cache: %s", this->persist_descriptors_ ? "yes" : "no");
+  ESP_LOGCONFIG(TAG, "  Device list extensions: %s", this->devlist_extensions_ ? "yes" : "no");
+  size_t slot_bytes = this->devices_.size() * sizeof(DeviceTable::Device);
+  size_t cache_bytes = this->host_ ? this->host_->descriptor_memory() : 0;
+  ESP_LOGCONFIG(TAG, "  Descriptor cache: %u bytes config + %u bytes strings per client (%u bytes total)",
+                (unsigned)this->config_cache_size_, (unsigned)this->string_cache_size_,
+                (unsigned)(slot_bytes + cache_bytes));
+  {
+    char classes[48];
+    size_t n = 0;
+    classes[0] = '\0';
+    for (size_t i = 0; i < this->buffers_.num_classes() && n < sizeof(classes); ++i) {
+      n += snprintf(classes + n, sizeof(classes) - n, "%s%u", i ? " " : "", (unsigned)this->buffers_.class_size(i));
+    }
+    ESP_LOGCONFIG(TAG, "  Buffer pool: classes %s bytes, high water %u bytes", classes,
+                  (unsigned)this->buffers_.high_water_bytes());
+  }
+  ESP_LOGCONFIG(TAG, "  Metrics update interval: %u ms", (unsigned)this->metrics_update_interval_ms_);
+  if (this->capture_.enabled()) {
+    ESP_LOGCONFIG(TAG, "  Capture: last %u PDUs (%u bytes), pcap export port %u", (unsigned)this->capture_.capacity(),
+                  (unsigned)this->capture_.memory_usage(), (unsigned)this->capture_port_);
+  }
+  if (!this->devices_.empty()) {
+    ESP_LOGCONFIG(TAG, "  Exported USB clients: %u (%u attached)", (unsigned)this->devices_.size(),
+                  (unsigned)this->devices_.attached_count());
+    for (size_t i = 0; i < this->client_options_.size(); ++i) {
+      const ClientOptions &opts = this->client_options_[i];
+      const char *busid = this->devices_[i].busid;
+      if (opts.bulk_in_depth != 0) {
+        ESP_LOGCONFIG(TAG, "    %s: bulk IN streaming, %u transfers queued", busid, (unsigned)opts.bulk_in_depth);
+      }
+      if (opts.tx_policy == TxPolicy::LATENCY) {
+        ESP_LOGCONFIG(TAG, "    %s: latency TX policy", busid);
+      } else if (opts.tx_policy == TxPolicy::THROUGHPUT) {
+        ESP_LOGCONFIG(TAG, "    %s: throughput TX policy, coalescing %u us / %u bytes, socket buffers %u bytes", busid,
+                      (unsigned)opts.coalesce_us, (unsigned)opts.coalesce_bytes, (unsigned)opts.socket_buffer_size);
+      }
+    }
 #ifdef ESP_PLATFORM
-    for (auto c : this->exported_clients_) {
-      auto client = static_cast<esphome::usb_host::USBClient *>(c);
+    for (size_t i = 0; i < this->devices_.size(); ++i) {
+      auto client = static_cast<esphome::usb_host::USBClient *>(this->devices_[i].client);
       if (client) {
         client->dump_config();
       }
@@ -580,12 +1561,12 @@ void USBIPComponent::dump_config() {
   }
 }
 
-void USBIPComponent::add_exported_client(void *client_ptr) {
+void USBIPComponent::add_exported_client(void *client_ptr, const ClientOptions &options) {
   if (client_ptr) {
-    this->exported_clients_.push_back(client_ptr);
-    // Keep the last-request map in sync with clients
-    this->last_string_request_ms_.emplace_back();
-    this->client_descriptors_.resize(this->exported_clients_.size());
+    // Registration order is the client's slot index and names its busid;
+    // per-client tables are sized from this list in setup()
+    this->devices_.add(client_ptr);
+    this->client_options_.push_back(options);
   }
 }
 
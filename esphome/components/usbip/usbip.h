@@ -1,15 +1,46 @@
 #pragma once
 
 #include "esphome/core/component.h"
+#include "esphome/core/defines.h"
+#ifdef USE_SENSOR
+#include "esphome/components/sensor/sensor.h"
+#endif
+#ifdef USE_TEXT_SENSOR
+#include "esphome/components/text_sensor/text_sensor.h"
+#endif
 #include <string>
 #include <memory>
 #include "usb_host.h"
+#include "descriptor_store.h"
+#include "descriptor_prefetcher.h"
+#include "usbip_protocol.h"
+#include "tx_queue.h"
+#include "metrics.h"
+#include "capture.h"
+#include "in_stream.h"
+#include "iso_pool.h"
+#include "urb_table.h"
+#include "net_task.h"
+#include "descriptor_persistence.h"
+#include "device_table.h"
 #include <vector>
-#include <unordered_map>
+#include <poll.h>
 
 namespace esphome {
 namespace usbip {
 
+// How replies to an imported device's URBs are written to the socket
+enum class TxPolicy : uint8_t {
+  // Stack defaults (Nagle on); queued replies are written once per loop
+  DEFAULT,
+  // TCP_NODELAY; every RET_SUBMIT is written as soon as it is queued (HID,
+  // serial adapters)
+  LATENCY,
+  // TCP_NODELAY and optional socket buffer sizes; RET_SUBMITs are held for
+  // a short window and written together (mass storage, network adapters)
+  THROUGHPUT,
+};
+
 class USBIPComponent : public Component {
  public:
   USBIPComponent() = default;
@@ -23,6 +54,80 @@ class USBIPComponent : public Component {
   // How long (ms) to wait for string descriptor fetches when responding to
   // an OP_REQ_DEVLIST. Exposed so codegen can set from YAML.
   void set_string_wait_ms(uint32_t ms) { string_wait_ms_ = ms; }
+  // Append this project's extension blobs (descriptors and UTF-8 strings)
+  // to every OP_REP_DEVLIST entry. Off by default: stock usbip clients only
+  // parse the kernel layout.
+  void set_devlist_extensions(bool enable) { devlist_extensions_ = enable; }
+  // Maximum number of clients served at the same time (each may list
+  // devices or hold one imported device)
+  void set_max_connections(uint8_t n) { max_connections_ = n; }
+  // Maximum number of descriptor requests the background prefetcher keeps
+  // outstanding
+  void set_prefetch_concurrency(uint8_t n) {
+    prefetch_concurrency_ = n;
+    prefetcher_.set_max_in_flight(n);
+  }
+  // Keep each exported device's descriptors across reboots (NVS on ESP) so
+  // the first OP_REQ_DEVLIST after a boot is answered at once
+  void set_persist_descriptors(bool persist) { persist_descriptors_ = persist; }
+#ifndef ESP_PLATFORM
+  // Same, with the records kept as files in 'dir'
+  void set_descriptor_cache_dir(const std::string &dir) {
+    persistence_.set_directory(dir);
+    persist_descriptors_ = true;
+  }
+#endif
+  // Time (us) one loop() may spend on USB/IP work before lower priority
+  // tasks are deferred to the next loop
+  void set_loop_budget_us(uint32_t us) { loop_budget_us_ = us; }
+  // Run socket I/O in a dedicated task (see NetTask) pinned to 'core' (-1:
+  // any core) with FreeRTOS priority 'priority'; a std::thread on other
+  // platforms
+  void set_network_task(int8_t core, uint8_t priority) {
+    net_task_enabled_ = true;
+    net_task_core_ = core;
+    net_task_priority_ = priority;
+  }
+  // Descriptor cache reserved per exported client: the largest
+  // configuration descriptor kept and the space for its string descriptors
+  void set_descriptor_cache_size(uint16_t config_bytes, uint16_t string_bytes) {
+    config_cache_size_ = config_bytes;
+    string_cache_size_ = string_bytes;
+  }
+
+  // Interval (ms) at which the metric sensors are published
+  void set_metrics_update_interval(uint32_t ms) { metrics_update_interval_ms_ = ms; }
+#ifdef USE_SENSOR
+  void set_loop_time_sensor(sensor::Sensor *s) { loop_time_sensor_ = s; }
+  void set_loop_time_max_sensor(sensor::Sensor *s) { loop_time_max_sensor_ = s; }
+  void set_rx_rate_sensor(sensor::Sensor *s) { rx_rate_sensor_ = s; }
+  void set_tx_rate_sensor(sensor::Sensor *s) { tx_rate_sensor_ = s; }
+  void set_send_eagain_sensor(sensor::Sensor *s) { send_eagain_sensor_ = s; }
+  void set_short_writes_sensor(sensor::Sensor *s) { short_writes_sensor_ = s; }
+  void set_connections_sensor(sensor::Sensor *s) { connections_sensor_ = s; }
+  void set_transfers_in_flight_sensor(sensor::Sensor *s) { transfers_in_flight_sensor_ = s; }
+  void set_descriptor_fetch_latency_sensor(sensor::Sensor *s) { descriptor_fetch_latency_sensor_ = s; }
+  void set_urb_latency_sensor(sensor::Sensor *s) { urb_latency_sensor_ = s; }
+  void set_interrupt_latency_sensor(sensor::Sensor *s) { interrupt_latency_sensor_ = s; }
+  void set_buffer_pool_high_water_sensor(sensor::Sensor *s) { buffer_pool_high_water_sensor_ = s; }
+#endif
+#ifdef USE_TEXT_SENSOR
+  void set_metrics_summary_text_sensor(text_sensor::TextSensor *s) { metrics_summary_text_sensor_ = s; }
+#endif
+  const UsbipMetrics &metrics() const { return metrics_; }
+  const BufferPool &buffer_pool() const { return buffers_; }
+  // Keep the last 'records' PDUs in the capture ring (0 disables it) and
+  // serve them as a pcap file to whoever connects to 'port' (0: no export
+  // port)
+  void set_capture(uint16_t records, uint16_t port) {
+    capture_records_ = records;
+    capture_port_ = port;
+  }
+  const CaptureRing &capture() const { return capture_; }
+#ifndef ESP_PLATFORM
+  // Write the capture ring as a pcap file; false if it cannot be written
+  bool write_capture_file(const char *path) const;
+#endif
 
   // Inject a USB host adapter (ownership transferred). If not set, the
   // component will not attempt to access USB host functionality.
@@ -31,60 +136,331 @@ class USBIPComponent : public Component {
   // Directly bind to an esphome usb_host::USBHost instance. This creates an
   // adapter that delegates to the provided host.
   void set_esphome_host(void *host_ptr);
+  // Per exported client settings
+  struct ClientOptions {
+    // Bulk IN transfers kept queued per endpoint ahead of the client's
+    // CMD_SUBMITs (0 = one host transfer per CMD_SUBMIT)
+    uint8_t bulk_in_depth{0};
+    TxPolicy tx_policy{TxPolicy::DEFAULT};
+    // THROUGHPUT: the first held reply is written after at most
+    // 'coalesce_us', or as soon as 'coalesce_bytes' are queued
+    uint32_t coalesce_us{1000};
+    uint32_t coalesce_bytes{16384};
+    // THROUGHPUT: SO_SNDBUF / SO_RCVBUF (0 keeps the stack's default)
+    uint32_t socket_buffer_size{0};
+  };
   // Register a USBClient (from esphome::usb_host) to be exported over USB/IP.
-  void add_exported_client(void *client_ptr);
+  void add_exported_client(void *client_ptr, const ClientOptions &options);
+  void add_exported_client(void *client_ptr) { this->add_exported_client(client_ptr, ClientOptions{}); }
 
  protected:
   // The TCP port to listen on for USB/IP connections
   uint16_t port_{3240};
   // Listening socket file descriptor (or -1 if unused)
   int server_fd_{-1};
-  // Accepted client socket file descriptor (or -1 if unused)
-  int client_fd_{-1};
   // Whether the TCP server has been started
   bool server_started_{false};
 
+  // Protocol phase of a connection: OP_REQ_* requests until a device has
+  // been imported, CMD_SUBMIT/CMD_UNLINK afterwards.
+  enum class ConnState : uint8_t { OP, URB };
+
+  // Streaming bulk and polled interrupt IN endpoints per connection
+  static const size_t MAX_IN_STREAMS = 4;
+
+  // Per-connection state. The table is sized once in setup() and slots are
+  // reused, so references and slot indices stay valid for the component's
+  // lifetime.
+  struct Connection {
+    // Accepted client socket file descriptor (or -1 if the slot is unused)
+    int fd{-1};
+    // Identifies the connection occupying this slot; completions of
+    // transfers submitted by an earlier connection are discarded.
+    uint32_t epoch{0};
+    // Index of this connection's socket in pollfds_ for the current loop
+    size_t poll_index{0};
+    ConnState state{ConnState::OP};
+    // Index into devices_ of the imported device (-1 while no device is
+    // imported, or after it was unplugged)
+    int imported_index{-1};
+    // The imported device was unplugged at detached_ms: every URB has been
+    // answered with -ENODEV and the connection closes once those replies
+    // are out, as usbip-host drops the connection of a removed device
+    bool detached{false};
+    uint32_t detached_ms{0};
+    // Transfer type and polling interval (ms, from bInterval) of each
+    // endpoint of the imported device, indexed by endpoint number (+16 for
+    // IN endpoints). Filled from the configuration descriptor on import;
+    // endpoints not found there are treated as bulk.
+    TransferType endpoint_types[32]{};
+    uint8_t endpoint_intervals[32]{};
+    // Received bytes that do not yet form a complete PDU
+    std::vector<uint8_t> rx_buf{};
+    // OUT payload bytes of a rejected oversized CMD_SUBMIT still to be read
+    // and dropped; for an isochronous one (discard_iso) its packet
+    // descriptors follow, and the URB is answered from them
+    uint32_t rx_discard{0};
+    bool discard_iso{false};
+    UsbipHeader discard_header{};
+    // Replies waiting to be written. Flushed with one sendmsg() per loop
+    // while the socket accepts data, so we never block the main loop.
+    TxQueue tx{};
+    // The last flush hit EAGAIN; wait for POLLOUT before trying again
+    bool tx_blocked{false};
+    // Current recv() size, adapted to the traffic (see receive())
+    uint16_t rx_chunk{512};
+    // Transmit policy of the imported device, and whether its socket
+    // options still have to be applied
+    TxPolicy tx_policy{TxPolicy::DEFAULT};
+    bool socket_options_pending{false};
+    // THROUGHPUT: replies are held until coalesce_deadline_us (now_us()
+    // clock) unless enough bytes pile up first
+    bool coalescing{false};
+    uint32_t coalesce_deadline_us{0};
+    // Streaming bulk IN endpoints (see ClientOptions::bulk_in_depth) and
+    // interrupt IN endpoints of the imported device, started by their first
+    // CMD_SUBMIT
+    InStream in_streams[MAX_IN_STREAMS];
+    // Isochronous URBs in flight; allocated by the first one
+    IsoUrbPool iso{};
+    // Submitted URBs not answered yet, by seqnum (for CMD_UNLINK)
+    UrbTable urbs{};
+    // State for non-blocking OP_REQ_DEVLIST handling: when an OP_REQ_DEVLIST
+    // is received we request descriptors asynchronously and finish the reply
+    // in subsequent loop() calls when descriptors are ready or the deadline
+    // (ms since boot) expires.
+    bool pending_devlist{false};
+    uint32_t pending_devlist_deadline{0};
+    bool sending_devlist{false};
+    // Size of the devlist reply being sent (for logging)
+    size_t devlist_bytes{0};
+  };
+
+  // Send a CMD_SUBMIT for a streaming bulk or interrupt IN endpoint to its
+  // stream. Returns false if the endpoint does not stream.
+  bool submit_to_stream(Connection &conn, const UsbipHeader &h, TransferType type, uint32_t submitted_us);
+
+  // Transfer buffers shared by the send queues, the IN streams and the host
+  // adapter; declared before them so it outlives their buffers
+  BufferPool buffers_{};
+
+  // Maximum number of simultaneous client connections
+  uint8_t max_connections_{4};
+  std::vector<Connection> connections_{};
+  // Scratch pollfd array for the readiness pass in loop()
+  std::vector<struct pollfd> pollfds_{};
+  uint32_t next_epoch_{0};
+
+  // loop() tasks, highest priority first
+  void run_net_rx();
+  // run_net_rx() with the network task: handle its events
+  void run_net_events();
+  void run_usb();
+  void run_net_tx();
+  void run_background();
+  bool budget_exhausted() const;
+  uint32_t loop_budget_us_{2000};
+  // End of the current loop()'s budget (now_us() clock)
+  uint32_t loop_deadline_us_{0};
+  // Consecutive loops that skipped run_background()
+  uint8_t background_deferred_{0};
+
+  void accept_connection();
+  // Read one chunk; returns true if it filled the chunk and more data is
+  // likely waiting
+  bool receive(Connection &conn);
+  // Parse and dispatch all complete PDUs in conn.rx_buf
+  void process_rx(Connection &conn);
+  // Handle one PDU at the start of 'p'. Return the number of bytes consumed,
+  // or 0 if more data is needed (or the connection was closed).
+  size_t handle_op_pdu(Connection &conn, const uint8_t *p, size_t len);
+  size_t handle_urb_pdu(Connection &conn, const uint8_t *p, size_t len);
+  // CMD_SUBMIT longer than USBIP_MAX_TRANSFER_LENGTH: answered with -EINVAL
+  // instead of being served; its OUT payload is discarded
+  size_t reject_oversized(Connection &conn, const UsbipHeader &h, const uint8_t *p, size_t len);
+  // Consume discarded payload (see Connection::rx_discard)
+  size_t discard_rx(Connection &conn, const uint8_t *p, size_t len);
+  void handle_import_request(Connection &conn, const uint8_t *busid);
+  void parse_endpoint_types(Connection &conn, const DescriptorView &cfg);
+  void handle_cmd_submit(Connection &conn, const UsbipHeader &h, const uint8_t *out_data);
+  void handle_cmd_unlink(Connection &conn, const UsbipHeader &h);
+  // Drop a completed URB from the connection's table. False if CMD_UNLINK
+  // cancelled it, in which case it gets no RET_SUBMIT.
+  bool retire_urb(Connection &conn, uint32_t seqnum);
+  // CMD_SUBMIT with number_of_packets > 0; 'payload' is the OUT data, if
+  // any, followed by the iso descriptors
+  void submit_iso(Connection &conn, const UsbipHeader &h, const uint8_t *payload, uint32_t submitted_us);
+  // RET_SUBMIT of a completed isochronous URB, sent from the URB's slot:
+  // header, IN packet data and the descriptor trailer
+  void queue_ret_iso(Connection &conn, IsoUrbPool::Urb &urb, const UsbTransferResult &res);
+  // RET_SUBMIT for an isochronous URB that was not submitted; echoes the
+  // client's descriptors with 'status'
+  void reject_iso(Connection &conn, const UsbipHeader &h, const uint8_t *desc, int32_t status);
+  // Answer control requests that must not be forwarded to the device (the
+  // host stack owns addressing and configuration) and GET_DESCRIPTORs the
+  // descriptor cache can serve. Returns true if handled.
+  bool handle_local_control(Connection &conn, const UsbipHeader &h);
+  // The cached descriptor a standard GET_DESCRIPTOR SETUP packet asks for
+  // (not ready if the adapter does not hold it)
+  DescriptorView cached_descriptor(void *client, const uint8_t *setup);
+  // Start collecting descriptors for an OP_REP_DEVLIST reply
+  void begin_devlist_reply(Connection &conn);
+  // Whether every descriptor the devlist reply carries is cached
+  bool devlist_descriptors_ready();
+  // Queue the OP_REP_DEVLIST snapshot, rebuilding it first if a device
+  // changed since it was serialized
+  void queue_devlist_reply(Connection &conn);
+  void build_devlist_snapshot();
+  void queue_ret_submit(Connection &conn, uint32_t seqnum, int32_t status, const uint8_t *data, size_t actual_length);
+  // Same, taking over a payload the caller already owns
+  void queue_ret_submit(Connection &conn, uint32_t seqnum, int32_t status, std::vector<uint8_t> &&data);
+  // Queue a small header (copied) / a payload buffer (moved) for sending
+  void queue_inline(Connection &conn, const uint8_t *data, size_t len);
+  void queue_buffer(Connection &conn, std::vector<uint8_t> &&buf);
+  // Same for a buffer taken from buffers_; given back if the connection
+  // has closed
+  void queue_pooled(Connection &conn, std::vector<uint8_t> &&buf);
+  // Write queued replies without blocking. With 'may_close' false a send
+  // error is left for the next run_net_tx() to handle, for callers that
+  // run inside a completion the connection's state is still in use by;
+  // with the network task those also leave ring room for run_net_tx().
+  TxQueue::FlushResult flush_send_queue(Connection &conn, bool may_close = true);
+  // Called after a RET_SUBMIT was queued; writes it now or arms the
+  // coalescing window, as the imported device's TxPolicy says
+  void reply_queued(Connection &conn);
+  // Set the socket options of the imported device's TxPolicy (directly or
+  // through the network task). False if it has to be retried.
+  bool apply_tx_policy(Connection &conn);
+  // Close the connection and reset its slot
+  void close_connection(Connection &conn);
+  // Close connections whose imported device was unplugged, once their
+  // replies are written
+  void close_detached(Connection &conn);
+  // With the network task, "written" means handed to it this long ago
+  static const uint32_t DETACH_LINGER_MS = 100;
+  // Closed at the latest this long after the device went away
+  static const uint32_t DETACH_CLOSE_MS = 1000;
+
   // Start the TCP server (bind/listen). Called from loop() to defer risky
   // operations until after setup() logs have been emitted.
   void start_server();
+  // Socket I/O task, if enabled (see set_network_task()). It owns the
+  // sockets; connections_ keeps the protocol state, slot for slot.
+  std::unique_ptr<NetTask> net_task_{nullptr};
+  bool net_task_enabled_{false};
+  int8_t net_task_core_{1};
+  uint8_t net_task_priority_{5};
+  // Commands or close requests were handed to the task in this loop()
+  bool net_task_wake_{false};
+  // Receives popped events; kept so its buffer is reused
+  NetTask::Event net_event_{};
   // Optional USB host adapter used to access attached USB devices
   std::unique_ptr<USBHostAdapter> host_{nullptr};
-  // Registered USB clients to export
-  std::vector<void *> exported_clients_{};
-  // Cached device descriptors per exported client (same index as exported_clients_)
-  std::vector<std::vector<uint8_t>> client_descriptors_{};
-  // Request descriptors for registered clients
-  void request_client_descriptors();
+  // Registered USB clients to export, with their busids and attach state
+  DeviceTable devices_{};
+  // Settings of each exported client, same index as devices_
+  std::vector<ClientOptions> client_options_{};
+  // The host adapter reported a device plugged into / removed from 'client'
+  void on_device_event(void *client, bool attached);
+  // Descriptor cache reserved in the host adapter per client (see
+  // set_descriptor_cache_size())
+  uint16_t config_cache_size_{1024};
+  uint16_t string_cache_size_{512};
+  // Adapter descriptor generation update_client_descriptors() last handled
+  uint32_t seen_generation_{0};
+  // devlist_descriptors_ready() result for ready_generation_ and the
+  // device table version ready_version_
+  bool ready_checked_{false};
+  bool ready_cached_{false};
+  uint32_t ready_generation_{0};
+  uint32_t ready_version_{0};
+  // Ready-to-send OP_REP_DEVLIST reply, made of the attached devices'
+  // records, and the device table version it was built from; rebuilt
+  // lazily on the next OP_REQ_DEVLIST after a change
+  std::shared_ptr<const std::vector<uint8_t>> devlist_snapshot_{};
+  uint32_t devlist_snapshot_version_{0};
+  bool devlist_extensions_{false};
+  // Re-serialize the records of attached devices whose descriptors changed;
+  // true if any was
+  bool refresh_devlist_records();
+  void encode_devlist_record(DeviceTable::Device &dev);
   // Try to update cached descriptors (non-blocking)
   void update_client_descriptors();
 
-  // How long (ms) to wait for string descriptor fetches when responding to
-  // an OP_REQ_DEVLIST before finishing the reply. Small values reduce
-  // latency but may result in missing human-readable names in the first
-  // response.
-
-  // State for non-blocking OP_REQ_DEVLIST handling: when an OP_REQ_DEVLIST is
-  // received we request descriptors asynchronously and finish the reply in
-  // subsequent loop() calls when descriptors are ready or timeout expires.
-  bool pending_devlist_{false};
-  // Millis deadline when pending devlist should be completed regardless
-  uint32_t pending_devlist_deadline_{0};
+  // Saved descriptor cache records (see set_persist_descriptors())
+  static const uint32_t PERSIST_DELAY_MS = 5000;
+  DescriptorPersistence persistence_{};
+  bool persist_descriptors_{false};
+  // Digest of the record last saved or restored per client
+  std::unique_ptr<uint32_t[]> persisted_digest_{};
+  uint32_t persist_generation_{0};
+  uint32_t persist_due_ms_{0};
+  bool persist_pending_{false};
+  // Hand the saved records to the adapter (setup())
+  void restore_descriptors();
+  // Save the records whose descriptors changed, once fetching settled
+  void persist_descriptors(uint32_t now);
 
   // How long to wait for string descriptors during a pending devlist
-  // operation (see set_string_wait_ms()).
+  // operation (see set_string_wait_ms()). Small values reduce latency but
+  // may result in missing human-readable names in the first response.
   uint32_t string_wait_ms_{2000};
 
-  // Non-blocking send buffer/state used to stream OP_REP_DEVLIST replies
-  // across multiple loop() iterations so we never block the main loop.
-  std::vector<uint8_t> send_buf_{};
-  size_t send_offset_{0};
-  bool sending_devlist_{false};
-
-  // Per-client map of last time (ms) we attempted to request a string
-  // descriptor for a given index. This avoids hammering the USB host.
-  std::vector<std::unordered_map<int, uint32_t>> last_string_request_ms_{};
-  // Minimum ms between retry attempts for the same string index
-  uint32_t string_request_interval_ms_{200};
+  // Warms the adapter's descriptor cache in the background
+  DescriptorPrefetcher prefetcher_{};
+  uint8_t prefetch_concurrency_{2};
+
+  // Recent PDUs for debugging (see set_capture())
+  CaptureRing capture_{};
+  uint16_t capture_records_{0};
+  uint16_t capture_port_{0};
+  // Listening socket of the pcap export port and the one client being
+  // served a snapshot of the ring (-1 if none)
+  int capture_server_fd_{-1};
+  int capture_fd_{-1};
+  TxQueue capture_tx_{};
+  void capture_pdu(const Connection &conn, CaptureRing::Direction dir, const uint8_t *a, size_t a_len,
+                   const uint8_t *b = nullptr, size_t b_len = 0);
+  // Accept an export client and stream the pcap snapshot to it
+  void run_capture_export();
+
+  // Runtime counters, updated on the hot path without allocating
+  UsbipMetrics metrics_{};
+  // Publish window averages and maxima to the metric sensors
+  void publish_metrics(uint32_t now);
+  uint32_t metrics_update_interval_ms_{60000};
+  uint32_t last_metrics_publish_ms_{0};
+  // Counters at the previous publish, to report per-window values
+  struct MetricsSnapshot {
+    uint64_t rx_bytes;
+    uint64_t tx_bytes;
+    uint32_t loop_count;
+    uint64_t loop_sum;
+    uint32_t urb_count;
+    uint64_t urb_sum;
+    uint32_t fetch_count;
+    uint64_t fetch_sum;
+    uint32_t interrupt_count;
+    uint64_t interrupt_sum;
+  };
+  MetricsSnapshot metrics_published_{};
+#ifdef USE_SENSOR
+  sensor::Sensor *loop_time_sensor_{nullptr};
+  sensor::Sensor *loop_time_max_sensor_{nullptr};
+  sensor::Sensor *rx_rate_sensor_{nullptr};
+  sensor::Sensor *tx_rate_sensor_{nullptr};
+  sensor::Sensor *send_eagain_sensor_{nullptr};
+  sensor::Sensor *short_writes_sensor_{nullptr};
+  sensor::Sensor *connections_sensor_{nullptr};
+  sensor::Sensor *transfers_in_flight_sensor_{nullptr};
+  sensor::Sensor *descriptor_fetch_latency_sensor_{nullptr};
+  sensor::Sensor *urb_latency_sensor_{nullptr};
+  sensor::Sensor *interrupt_latency_sensor_{nullptr};
+  sensor::Sensor *buffer_pool_high_water_sensor_{nullptr};
+#endif
+#ifdef USE_TEXT_SENSOR
+  text_sensor::TextSensor *metrics_summary_text_sensor_{nullptr};
+#endif
 };
 
 }  // namespace usbip
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace esphome {
+namespace usbip {
+
+// USB/IP wire protocol constants. See Documentation/usb/usbip_protocol.rst in
+// the Linux kernel tree. All multi-byte fields are big-endian on the wire.
+static const uint16_t USBIP_VERSION = 0x0111;
+
+// Operation codes used before a device is imported
+static const uint16_t OP_REQ_DEVLIST = 0x8005;
+static const uint16_t OP_REP_DEVLIST = 0x0005;
+static const uint16_t OP_REQ_IMPORT = 0x8003;
+static const uint16_t OP_REP_IMPORT = 0x0003;
+
+// OP_REP_* status values
+static const uint32_t OP_STATUS_OK = 0;
+static const uint32_t OP_STATUS_NA = 1;
+static const uint32_t OP_STATUS_DEV_BUSY = 2;
+
+// URB phase commands (after a successful OP_REQ_IMPORT)
+static const uint32_t USBIP_CMD_SUBMIT = 0x00000001;
+static const uint32_t USBIP_CMD_UNLINK = 0x00000002;
+static const uint32_t USBIP_RET_SUBMIT = 0x00000003;
+static const uint32_t USBIP_RET_UNLINK = 0x00000004;
+
+static const uint32_t USBIP_DIR_OUT = 0;
+static const uint32_t USBIP_DIR_IN = 1;
+
+// usbip_device_speed values
+static const uint32_t USBIP_SPEED_FULL = 2;
+
+static const size_t OP_HEADER_SIZE = 8;
+static const size_t USBIP_BUSID_SIZE = 32;
+static const size_t OP_IMPORT_REQUEST_SIZE = OP_HEADER_SIZE + USBIP_BUSID_SIZE;
+// struct usbip_usb_device: path[256], busid[32], 3x u32, 3x u16, 6x u8
+static const size_t USBIP_DEVICE_SIZE = 312;
+// struct usbip_usb_interface: class, subclass, protocol, padding
+static const size_t USBIP_INTERFACE_SIZE = 4;
+// Every URB phase PDU starts with a fixed 48 byte header
+static const size_t USBIP_HEADER_SIZE = 48;
+static const size_t USBIP_ISO_DESC_SIZE = 16;
+
+// Largest transfer_buffer_length served. Longer URBs are real (usb-storage
+// submits 120 KiB bulk reads) but too large to buffer, so they are answered
+// with an error and the connection stays up.
+static const uint32_t USBIP_MAX_TRANSFER_LENGTH = 64 * 1024;
+// Beyond these bounds (or with a negative length) a CMD_SUBMIT is taken
+// for a protocol error and the connection is dropped.
+static const uint32_t USBIP_MAX_SANE_TRANSFER_LENGTH = 16 * 1024 * 1024;
+static const uint32_t USBIP_MAX_ISO_PACKETS = 1024;
+
+inline uint16_t get_be16(const uint8_t *p) { return (uint16_t)((p[0] << 8) | p[1]); }
+inline uint32_t get_be32(const uint8_t *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+inline void put_be16(uint8_t *p, uint16_t v) {
+  p[0] = (uint8_t)(v >> 8);
+  p[1] = (uint8_t)v;
+}
+inline void put_be32(uint8_t *p, uint32_t v) {
+  p[0] = (uint8_t)(v >> 24);
+  p[1] = (uint8_t)(v >> 16);
+  p[2] = (uint8_t)(v >> 8);
+  p[3] = (uint8_t)v;
+}
+
+// Decoded URB phase header (usbip_header_basic plus the CMD_SUBMIT or
+// CMD_UNLINK specific part).
+struct UsbipHeader {
+  uint32_t command;
+  uint32_t seqnum;
+  uint32_t devid;
+  uint32_t direction;
+  uint32_t ep;
+  // CMD_SUBMIT
+  uint32_t transfer_flags;
+  int32_t transfer_buffer_length;
+  int32_t start_frame;
+  int32_t number_of_packets;
+  int32_t interval;
+  uint8_t setup[8];
+  // CMD_UNLINK
+  uint32_t unlink_seqnum;
+};
+
+inline void decode_usbip_header(const uint8_t *p, UsbipHeader &h) {
+  h.command = get_be32(p + 0);
+  h.seqnum = get_be32(p + 4);
+  h.devid = get_be32(p + 8);
+  h.direction = get_be32(p + 12);
+  h.ep = get_be32(p + 16);
+  h.transfer_flags = get_be32(p + 20);
+  h.transfer_buffer_length = (int32_t)get_be32(p + 24);
+  h.start_frame = (int32_t)get_be32(p + 28);
+  h.number_of_packets = (int32_t)get_be32(p + 32);
+  h.interval = (int32_t)get_be32(p + 36);
+  memcpy(h.setup, p + 40, 8);
+  // CMD_UNLINK reuses the first u32 after the basic header
+  h.unlink_seqnum = h.transfer_flags;
+}
+
+// Encode a USBIP_RET_SUBMIT header. devid/direction/ep are zero in replies.
+inline void encode_ret_submit(uint8_t *p, uint32_t seqnum, int32_t status, int32_t actual_length,
+                              int32_t start_frame, int32_t number_of_packets, int32_t error_count) {
+  memset(p, 0, USBIP_HEADER_SIZE);
+  put_be32(p + 0, USBIP_RET_SUBMIT);
+  put_be32(p + 4, seqnum);
+  put_be32(p + 20, (uint32_t)status);
+  put_be32(p + 24, (uint32_t)actual_length);
+  put_be32(p + 28, (uint32_t)start_frame);
+  put_be32(p + 32, (uint32_t)number_of_packets);
+  put_be32(p + 36, (uint32_t)error_count);
+}
+
+// Encode a USBIP_RET_UNLINK header.
+inline void encode_ret_unlink(uint8_t *p, uint32_t seqnum, int32_t status) {
+  memset(p, 0, USBIP_HEADER_SIZE);
+  put_be32(p + 0, USBIP_RET_UNLINK);
+  put_be32(p + 4, seqnum);
+  put_be32(p + 20, (uint32_t)status);
+}
+
+}  // namespace usbip
+}  // namespace esphome
@@ -0,0 +1,172 @@
+// Micro benchmarks for the usbip component hot paths, built natively against
+// the dummy USB host adapter (see the top-level CMakeLists.txt).
+//
+//   usbip_bench [scale] [capture.pcap]
+//
+// 'scale' multiplies every iteration count (default 1). With a second
+// argument the capture ring (the last PDUs of the send pump) is written
+// there as a pcap file for Wireshark. Each line reports
+// the average cost of one operation; run under perf or heaptrack to see
+// where the time and allocations go.
+
+#include "esphome/components/usbip/usbip.h"
+#include "esphome/components/usbip/descriptor_store.h"
+#include "esphome/components/usbip/capture.h"
+
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+namespace esphome {
+namespace usbip {
+
+// Exposes the protected hot paths of USBIPComponent to the benchmarks
+class BenchComponent : public USBIPComponent {
+ public:
+  USBHostAdapter *host() { return this->host_.get(); }
+  void *client(size_t i) { return this->devices_[i].client; }
+
+  // Encodes every device record again, as after a descriptor change
+  size_t build_devlist() {
+    for (size_t i = 0; i < this->devices_.size(); ++i) this->encode_devlist_record(this->devices_[i]);
+    this->build_devlist_snapshot();
+    return this->devlist_snapshot_->size();
+  }
+  bool descriptors_ready() { return this->devlist_descriptors_ready(); }
+
+  // Bind connection slot 0 to 'fd' as if a client had imported a device
+  Connection &attach(int fd) {
+    Connection &conn = this->connections_[0];
+    conn.fd = fd;
+    conn.epoch = 1;
+    conn.state = ConnState::URB;
+    return conn;
+  }
+  void queue_reply(Connection &conn, uint32_t seqnum, const uint8_t *data, size_t len) {
+    this->queue_ret_submit(conn, seqnum, USB_STATUS_OK, data, len);
+  }
+  void flush(Connection &conn) { this->flush_send_queue(conn); }
+  bool tx_empty(const Connection &conn) const { return conn.tx.empty(); }
+};
+
+}  // namespace usbip
+}  // namespace esphome
+
+using esphome::usbip::BenchComponent;
+using esphome::usbip::DescriptorView;
+
+namespace {
+
+// Keeps results observable so the compiler cannot drop the measured work
+volatile size_t g_sink = 0;
+
+template<typename F> void run(const char *name, size_t iterations, F &&fn) {
+  using clock = std::chrono::steady_clock;
+  for (size_t i = 0; i < iterations / 10 + 1; ++i) fn(i);  // warm up caches and allocator
+  auto start = clock::now();
+  for (size_t i = 0; i < iterations; ++i) fn(i);
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+  printf("%-36s %10zu iterations %12.1f ns/op\n", name, iterations, (double)ns / (double)iterations);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  size_t scale = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1;
+  if (scale == 0) scale = 1;
+
+  // Four exported clients; the dummy adapter ignores the client pointer
+  static int clients[4];
+  BenchComponent component;
+  for (auto &c : clients) component.add_exported_client(&c);
+  component.set_capture(64, 0);
+  component.setup();
+  auto *host = component.host();
+  void *client = component.client(0);
+  // The dummy device answers at once; read everything the loop's
+  // prefetcher would
+  for (size_t i = 0; i < 4; ++i) {
+    host->request_device_descriptor(component.client(i));
+    host->request_config_descriptor(component.client(i));
+    for (int idx = 0; idx < 4; ++idx) host->request_string_descriptor(component.client(i), idx);
+  }
+
+  run("devlist snapshot build (4 devices)", 20000 * scale, [&](size_t) { g_sink = g_sink + component.build_devlist(); });
+
+  run("devlist readiness check", 1000000 * scale, [&](size_t) { g_sink = g_sink + component.descriptors_ready(); });
+
+  run("descriptor view lookup", 1000000 * scale, [&](size_t i) {
+    DescriptorView d = (i & 1) ? host->device_descriptor(client) : host->string_descriptor(client, 2);
+    g_sink = g_sink + d.size();
+  });
+
+  esphome::usbip::DescriptorStore store;
+  store.configure(4, 1024, 512);
+  for (size_t slot = 0; slot < 4; ++slot) {
+    DescriptorView d = host->device_descriptor(client);
+    store.set_device(slot, d.data, d.size());
+    for (int idx = 0; idx < 4; ++idx) {
+      DescriptorView sd = host->string_descriptor(client, idx);
+      store.set_string(slot, idx, idx ? 0x0409 : 0, sd.data, sd.size());
+    }
+  }
+  run("descriptor store lookup", 1000000 * scale, [&](size_t i) {
+    DescriptorView d = (i & 1) ? store.device(i & 3) : store.string(i & 3, 2);
+    g_sink = g_sink + d.size();
+  });
+
+  std::vector<uint8_t> copy;
+  run("descriptor copy lookup", 1000000 * scale, [&](size_t) {
+    host->get_string_descriptor(client, 2, copy);
+    g_sink = g_sink + copy.size();
+  });
+
+  esphome::usbip::CaptureRing ring;
+  ring.configure(64);
+  std::vector<uint8_t> urb_header(48, 0x11), urb_payload(512, 0x22);
+  run("capture record (48 + 512 byte PDU)", 1000000 * scale, [&](size_t i) {
+    ring.record((uint32_t)i, 1, esphome::usbip::CaptureRing::Direction::TX, urb_header.data(), urb_header.size(),
+                urb_payload.data(), urb_payload.size());
+  });
+  g_sink = g_sink + ring.total();
+
+  std::string utf8;
+  DescriptorView product = host->string_descriptor(client, 2);
+  run("UTF-16LE to UTF-8 (product string)", 1000000 * scale, [&](size_t) {
+    esphome::usbip::string_descriptor_to_utf8(product, utf8);
+    g_sink = g_sink + utf8.size();
+  });
+
+  // Send pump: queue RET_SUBMIT replies on a connection backed by a
+  // non-blocking socketpair and flush until the queue drains, reading the
+  // other end as we go.
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+    perror("socketpair");
+    return 1;
+  }
+  for (int fd : fds) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  auto &conn = component.attach(fds[0]);
+  const size_t replies_per_batch = 32;
+  const size_t payload_len = 512;
+  std::vector<uint8_t> payload(payload_len, 0xA5);
+  std::vector<uint8_t> drain(64 * 1024);
+  uint32_t seqnum = 0;
+  run("send pump (32 x 512 byte RET_SUBMIT)", 20000 * scale, [&](size_t) {
+    for (size_t r = 0; r < replies_per_batch; ++r) component.queue_reply(conn, ++seqnum, payload.data(), payload_len);
+    while (!component.tx_empty(conn)) {
+      component.flush(conn);
+      ssize_t n;
+      while ((n = read(fds[1], drain.data(), drain.size())) > 0) g_sink = g_sink + (size_t)n;
+    }
+  });
+  close(fds[1]);
+
+  if (argc > 2 && !component.write_capture_file(argv[2])) return 1;
+  return 0;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+// Minimal stand-in for esphome/core/component.h used by the native (Linux)
+// build. Only what the usbip component needs is provided.
+
+namespace esphome {
+
+class Component {
+ public:
+  virtual ~Component() = default;
+
+  virtual void setup() {}
+  virtual void loop() {}
+  virtual void dump_config() {}
+  virtual float get_setup_priority() const { return 0.0f; }
+
+  void mark_failed() { this->failed_ = true; }
+  bool is_failed() const { return this->failed_; }
+
+ protected:
+  bool failed_{false};
+};
+
+}  // namespace esphome
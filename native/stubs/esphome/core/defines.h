@@ -0,0 +1,4 @@
+#pragma once
+
+// Native builds have no code generation step, so no optional component
+// (USE_SENSOR, USE_TEXT_SENSOR, ...) is enabled.
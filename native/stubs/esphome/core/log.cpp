@@ -0,0 +1,19 @@
+#include "esphome/core/log.h"
+
+#include <cstdarg>
+#include <cstdio>
+
+namespace esphome {
+
+void esp_log_printf_(int level, const char *tag, int line, const char *format, ...) {  // NOLINT
+  static const char LEVEL_LETTERS[] = "-EWICDV";
+  char letter = (level >= 0 && level <= ESPHOME_LOG_LEVEL_VERBOSE) ? LEVEL_LETTERS[level] : '?';
+  fprintf(stderr, "[%c][%s:%d]: ", letter, tag, line);
+  va_list args;
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  fputc('\n', stderr);
+}
+
+}  // namespace esphome
@@ -0,0 +1,36 @@
+#pragma once
+
+// Minimal stand-in for esphome/core/log.h used by the native (Linux) build.
+// Messages above ESPHOME_LOG_LEVEL compile to nothing, like on the device.
+
+#define ESPHOME_LOG_LEVEL_NONE 0
+#define ESPHOME_LOG_LEVEL_ERROR 1
+#define ESPHOME_LOG_LEVEL_WARN 2
+#define ESPHOME_LOG_LEVEL_INFO 3
+#define ESPHOME_LOG_LEVEL_CONFIG 4
+#define ESPHOME_LOG_LEVEL_DEBUG 5
+#define ESPHOME_LOG_LEVEL_VERBOSE 6
+
+#ifndef ESPHOME_LOG_LEVEL
+#define ESPHOME_LOG_LEVEL ESPHOME_LOG_LEVEL_DEBUG
+#endif
+
+namespace esphome {
+
+void esp_log_printf_(int level, const char *tag, int line, const char *format, ...)  // NOLINT
+    __attribute__((format(printf, 4, 5)));
+
+}  // namespace esphome
+
+#define ESPHOME_LOG_AT_(level, tag, format, ...) \
+  do { \
+    if ((level) <= ESPHOME_LOG_LEVEL) \
+      ::esphome::esp_log_printf_(level, tag, __LINE__, format, ##__VA_ARGS__); \
+  } while (0)
+
+#define ESP_LOGE(tag, format, ...) ESPHOME_LOG_AT_(ESPHOME_LOG_LEVEL_ERROR, tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) ESPHOME_LOG_AT_(ESPHOME_LOG_LEVEL_WARN, tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) ESPHOME_LOG_AT_(ESPHOME_LOG_LEVEL_INFO, tag, format, ##__VA_ARGS__)
+#define ESP_LOGCONFIG(tag, format, ...) ESPHOME_LOG_AT_(ESPHOME_LOG_LEVEL_CONFIG, tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) ESPHOME_LOG_AT_(ESPHOME_LOG_LEVEL_DEBUG, tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...) ESPHOME_LOG_AT_(ESPHOME_LOG_LEVEL_VERBOSE, tag, format, ##__VA_ARGS__)
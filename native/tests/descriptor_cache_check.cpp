@@ -0,0 +1,109 @@
+// Persistent descriptor cache on the native build: descriptors saved by one
+// component instance are served by the next one ("after a reboot") from
+// the cache directory, before the device has been asked for anything.
+//
+//   descriptor_cache_check
+
+#include "esphome/components/usbip/usbip.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+namespace esphome {
+namespace usbip {
+
+class CheckComponent : public USBIPComponent {
+ public:
+  USBHostAdapter *host() { return this->host_.get(); }
+  void *client(size_t i) { return this->devices_[i].client; }
+  bool descriptors_ready() { return this->devlist_descriptors_ready(); }
+  // Descriptor requests the prefetcher has sent to the device and not seen
+  // answered yet
+  size_t fetches_in_flight() { return this->prefetcher_.in_flight(); }
+  // Let the prefetcher read every descriptor, then save once the cache
+  // has been stable for PERSIST_DELAY_MS
+  void fetch_and_persist() {
+    uint32_t now = 0;
+    for (int i = 0; i < 32 && !this->prefetcher_.idle(); ++i) this->prefetcher_.run(now += 10);
+    this->persist_descriptors(now);
+    this->persist_descriptors(now + PERSIST_DELAY_MS);
+  }
+  std::string devlist() {
+    this->refresh_devlist_records();
+    this->build_devlist_snapshot();
+    return std::string(this->devlist_snapshot_->begin(), this->devlist_snapshot_->end());
+  }
+};
+
+}  // namespace usbip
+}  // namespace esphome
+
+using esphome::usbip::CheckComponent;
+using esphome::usbip::DescriptorView;
+
+namespace {
+
+int g_failures = 0;
+
+void check(bool ok, const char *what) {
+  printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+  if (!ok) g_failures++;
+}
+
+}  // namespace
+
+int main() {
+  char dir[] = "/tmp/usbip-descriptors-XXXXXX";
+  if (mkdtemp(dir) == nullptr) {
+    perror("mkdtemp");
+    return 1;
+  }
+  static int client;
+  const char *product = "USB/IP loopback device";
+
+  {
+    CheckComponent first;
+    first.add_exported_client(&client);
+    first.set_descriptor_cache_dir(dir);
+    first.setup();
+    first.fetch_and_persist();
+    check(first.descriptors_ready(), "descriptors fetched");
+  }
+  std::string file = std::string(dir) + "/usbip-descriptors-1-1.bin";
+  FILE *f = fopen(file.c_str(), "rb");
+  check(f != nullptr, "cache file written");
+  if (f != nullptr) fclose(f);
+
+  {
+    // setup() runs the prefetcher once; with the file restored it finds
+    // every descriptor cached and asks the device for none of them
+    CheckComponent rebooted;
+    rebooted.add_exported_client(&client);
+    rebooted.set_descriptor_cache_dir(dir);
+    rebooted.setup();
+    check(rebooted.fetches_in_flight() == 0, "nothing requested from the device after reboot");
+    check(rebooted.host()->config_descriptor(rebooted.client(0)).ready, "configuration descriptor restored");
+    DescriptorView name = rebooted.host()->string_utf8(rebooted.client(0), 2);
+    check(std::string(name.begin(), name.end()) == product, "product string restored");
+    check(rebooted.descriptors_ready(), "device list ready after reboot");
+    // Header, usbip_usb_device and the one interface of the emulated device
+    check(rebooted.devlist().size() == 12 + 312 + 4, "device list in the kernel layout");
+  }
+
+  {
+    CheckComponent cold;
+    cold.add_exported_client(&client);
+    cold.set_persist_descriptors(false);
+    cold.setup();
+    check(cold.fetches_in_flight() == 1, "without the cache setup() asks for the device descriptor");
+    check(!cold.descriptors_ready(), "without the cache the device list waits for the device");
+  }
+
+  remove(file.c_str());
+  rmdir(dir);
+  return g_failures == 0 ? 0 : 1;
+}